@@ -0,0 +1,345 @@
+/** @file bench.c
+ *  @brief Host benchmark of the bldc.c control path
+ *
+ *  bldc.c is compiled in here against the stub SDK headers in include/,
+ *  with its main() renamed out of the way
+ *  Each function is called millions of times with inputs that move like
+ *  the real ones: a pot being turned, a noisy current, the direction
+ *  switch flipped now and then
+ *  Reports ns and instructions per call and writes them to a JSON file
+ *  Instructions are counted with perf events when the host allows it
+ *
+ *  Build and run with run.sh
+ */
+#define main bldc_main
+#include "../bldc.c"
+#undef main
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef BENCH_CFLAGS
+#define BENCH_CFLAGS    ""
+#endif
+#define BENCH_BATCH     64              // calls between input updates
+#define BENCH_BEMF      400             // back EMF peak on the phase dividers, adc counts
+
+/** @brief  One benchmark case */
+typedef struct {
+  const char *name;
+  void (*fn)(void);
+  uint32_t calls;
+} bench_case;
+
+/** @brief  Result of one case */
+typedef struct {
+  double ns_per_call;
+  double instructions_per_call;         // < 0 if not counted
+} bench_result;
+
+/**
+ *  @brief  spi_exchange - One spi frame: taken in, applied by pwm_isr, reply filled
+ *
+ *  The dma register writes of spi_dma_isr are left out
+ */
+static void spi_exchange(void) {
+  spi_frame_in();
+  spi_apply();
+}
+
+/** @brief  Simulated i2c master: bus bits clocked, per exchange */
+static uint32_t i2c_bits;
+
+static void i2c_write_regs(uint8_t reg, const uint8_t *data, uint n) {
+  uint i;
+  i2c_rx(reg, true);
+  for (i = 0; i < n; ++i) {
+    i2c_rx(data[i], false);
+  }
+  i2c_stop();
+  i2c_bits = 2 + (2 + n) * 9;           // start, address, pointer, data, stop
+}
+
+static void i2c_read_regs(uint8_t reg, uint8_t *data, uint n) {
+  uint i;
+  i2c_rx(reg, true);                    // pointer write, then a repeated start
+  for (i = 0; i < n; ++i) {
+    data[i] = i2c_tx();
+  }
+  i2c_stop();
+  i2c_bits += 3 + (3 + n) * 9;
+}
+
+/**
+ *  @brief  i2c_exchange - A host sets the setpoint and block reads the state
+ *
+ *  Two transactions through the slave's byte handlers, as i2c_isr would
+ *  call them, then i2c_apply() as pwm_isr would
+ */
+static void i2c_exchange(void) {
+  static const uint8_t ctl[3] = { I2C_CTL_HOST | I2C_CTL_SPEED, 120, FWD };
+  uint8_t state[I2C_REGS - I2C_REG_STATUS];
+  i2c_write_regs(I2C_REG_CONTROL, ctl, sizeof(ctl));
+  i2c_read_regs(I2C_REG_STATUS, state, sizeof(state));
+  i2c_apply();
+}
+
+/**
+ *  @brief  diag_core1_window - Core 1 analysis of one window of the samples pwm_isr took
+ */
+static void diag_core1_window(void) {
+  diag_full = 0;
+  diag_step[0][0] = diag_step[0][1] = motor.start_step;
+  diag_window();
+}
+
+/**
+ *  @brief  mpc_period - One period of the mpc current loop, the wrap's reading then every state
+ */
+static void mpc_period(void) {
+  cf_sample = current_read();
+  mpc_update();
+}
+
+/** @brief  Rotor angle and step per period, the way the drive's angle turns */
+static uint32_t bench_rotor, bench_rotor_step;
+
+/**
+ *  @brief  bench_adc_read - adc reading, with a back EMF on the phase dividers
+ *
+ *  From the rotor angle that pwm_isr_running() keeps
+ */
+static uint16_t bench_adc_read(uint input) {
+  uint mux = stub_gpio_out[VSENSE_SEL0] | (stub_gpio_out[VSENSE_SEL1] << 1);
+  uint32_t d;
+  int32_t e;
+  if (input != ADC_VSENSE || mux == VSENSE_VBUS) {
+    return stub_adc_value[input];
+  }
+  d = ((com_dir == REV ? -bench_rotor : bench_rotor) - (mux - VSENSE_VA) * ANGLE_DEG(120))
+      / ANGLE_DEG(1);                   // rotor angle for the phase, degrees
+  e = d < 120 ? 30 : d < 180 ? 150 - (int32_t)d : d < 300 ? -30 : (int32_t)d - 330;
+  return stub_adc_value[ADC_VSENSE] / 2 + e * BENCH_BEMF / 30; // trapezoid about half the bus
+}
+
+/**
+ *  @brief  pwm_isr_running - pwm_isr with the motor running, locked on the back EMF
+ *
+ *  The rotor is dragged round by the start ramp, then keeps the speed it
+ *  has at the lock, so the drive goes on timing real crossings
+ *  The direction switch is held, as turning round would stop the bridge
+ */
+static void pwm_isr_running(void) {
+  stub_gpio_in[SW_DIR] = 0;
+  if (com_locked) {
+    bench_rotor += bench_rotor_step;
+  } else {
+    bench_rotor = elec_angle + angle_step;  // where the slices will have it at the wrap
+    bench_rotor_step = angle_step;
+  }
+  pwm_isr();
+}
+
+/**
+ *  @brief  pwm_isr_running_setup - Start the motor and run pwm_isr until it locks
+ */
+static void pwm_isr_running_setup(void) {
+  uint32_t n;
+  stub_adc_hook = bench_adc_read;
+  selftest_ok = 1;
+  motor_on = 1;
+  for (n = 0; n < 20 * PWM_FREQ && !com_locked; ++n) {
+    pwm_isr_running();
+  }
+  if (!com_locked) {
+    printf("pwm_isr running: no back EMF lock\n");
+  }
+}
+
+static const bench_case cases[] = {
+  { "pwm_isr",          pwm_isr,          4000000 },
+  { "get_speed_cmd",    get_speed_cmd,    8000000 },
+  { "direction_update", direction_update, 8000000 },
+  { "led_blink",        led_blink,        8000000 },
+  { "timer_service",    timer_service,    8000000 },
+  { "spi_exchange",     spi_exchange,     8000000 },
+  { "i2c_exchange",     i2c_exchange,     4000000 },
+  { "mpc_update",       mpc_period,       4000000 },
+  { "diag_window",      diag_core1_window, 40000 },
+  { "pwm_isr running",  pwm_isr_running,  4000000 }, // last, leaves the motor on
+};
+#define BENCH_CASES     (sizeof(cases) / sizeof(cases[0]))
+
+static uint32_t lcg = 12345;
+
+/**
+ *  @brief  bench_inputs - Move the stub inputs on by one batch
+ *
+ *  Pot sweeps up and down over ~0.5 s of function loops, current has
+ *  noise on an offset, the direction switch changes every ~2 s
+ */
+static void bench_inputs(uint32_t batch) {
+  uint32_t sweep = batch & 0x3ff;
+  lcg = lcg * 1664525u + 1013904223u;
+  stub_adc_value[ADC_SPEED] = 800 + (sweep < 0x200 ? sweep : 0x3ff - sweep) * 6;
+  stub_adc_value[ADC_CURRENT] = 600 + (lcg >> 26);
+  stub_adc_value[ADC_VSENSE] = 1540 + ((lcg >> 20) & 15);
+  stub_gpio_in[SW_DIR] = (batch >> 9) & 1;
+}
+
+/**
+ *  @brief  perf_open - Open a user space instruction counter, -1 if not allowed
+ */
+static int perf_open(void) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ *  @brief  bench_run - Time one case, input updates are timed separately and removed
+ */
+static bench_result bench_run(const bench_case *c, int perf_fd) {
+  bench_result r;
+  uint32_t batches = c->calls / BENCH_BATCH, b, i;
+  uint64_t count = 0, overhead_count = 0;
+  double t0, t, overhead;
+
+  if (c->fn == pwm_isr_running) {
+    pwm_isr_running_setup();
+  }
+  for (b = 0; b < batches / 16; ++b) {  // warm up
+    bench_inputs(b);
+    for (i = 0; i < BENCH_BATCH; ++i) {
+      c->fn();
+    }
+  }
+
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  t0 = now_ns();
+  for (b = 0; b < batches; ++b) {
+    bench_inputs(b);
+    for (i = 0; i < BENCH_BATCH; ++i) {
+      c->fn();
+    }
+  }
+  t = now_ns() - t0;
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(perf_fd, &count, sizeof(count)) != sizeof(count)) {
+      count = 0;
+    }
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  t0 = now_ns();
+  for (b = 0; b < batches; ++b) {
+    bench_inputs(b);
+  }
+  overhead = now_ns() - t0;
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(perf_fd, &overhead_count, sizeof(overhead_count)) != sizeof(overhead_count)) {
+      overhead_count = 0;
+    }
+  }
+  r.ns_per_call = (t - overhead) / ((double)batches * BENCH_BATCH);
+  r.instructions_per_call = (perf_fd >= 0 && count)
+    ? (double)(count - overhead_count) / ((double)batches * BENCH_BATCH) : -1.;
+  return r;
+}
+
+/**
+ *  @brief  bench_setup - Bring bldc.c up as far as main() would, without the UI
+ */
+static void bench_setup(void) {
+  memset(stub_flash, 0xff, sizeof(stub_flash));
+  stub_gpio_in[SW_DIR] = 1;
+  stub_gpio_in[ILIM_COMP] = 1;
+  init_analog();
+  init_evlog();
+  init_angle();
+  motor_load(MOTOR_PROFILE);
+  angle_set_step(motor.start_step);
+  init_timers();
+  spi_rx.magic = SPI_MAGIC;             // master in control of the speed loop
+  spi_rx.flags = SPI_CONTROL | SPI_SPEED_LOOP;
+  spi_rx.cmd = 120;
+  spi_rx.check = -spi_check(&spi_rx);
+}
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "baseline.json";
+  bench_result results[BENCH_CASES];
+  struct utsname host;
+  uint k, i2c_k = 0, mpc_k = 0;
+  int perf_fd = perf_open();
+  FILE *f;
+
+  bench_setup();
+  printf("%-20s %12s %14s\n", "function", "ns/call", "instr/call");
+  for (k = 0; k < BENCH_CASES; ++k) {
+    results[k] = bench_run(&cases[k], perf_fd);
+    if (results[k].instructions_per_call < 0) {
+      printf("%-20s %12.2f %14s\n", cases[k].name, results[k].ns_per_call, "n/a");
+    } else {
+      printf("%-20s %12.2f %14.1f\n", cases[k].name, results[k].ns_per_call,
+             results[k].instructions_per_call);
+    }
+    if (cases[k].fn == i2c_exchange) {
+      i2c_k = k;
+    }
+    if (cases[k].fn == mpc_period) {
+      mpc_k = k;
+    }
+  }
+  printf("i2c transactions/s: %.0f slave handler limit on this host, %.0f on a %u Hz bus\n",
+         2e9 / results[i2c_k].ns_per_call, 2. * I2C_BAUD / i2c_bits, I2C_BAUD);
+  printf("mpc_update: %u states, %.1f ns per state on this host\n",
+         MPC_STATES, results[mpc_k].ns_per_call / MPC_STATES);
+  printf("pwm_isr running: %s at speed %u, back EMF lost %u times\n",
+         com_locked ? "locked" : "not locked", speed, bemf_lost);
+
+  f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+  uname(&host);
+  fprintf(f, "{\n  \"host\": \"%s %s\",\n  \"compiler\": \"%s\",\n  \"cflags\": \"%s\",\n",
+          host.sysname, host.machine, __VERSION__, BENCH_CFLAGS);
+  fprintf(f, "  \"instructions_counted\": %s,\n  \"results\": {\n",
+          perf_fd >= 0 ? "true" : "false");
+  for (k = 0; k < BENCH_CASES; ++k) {
+    fprintf(f, "    \"%s\": { \"calls\": %u, \"ns_per_call\": %.3f, \"instructions_per_call\": ",
+            cases[k].name, cases[k].calls, results[k].ns_per_call);
+    if (results[k].instructions_per_call < 0) {
+      fprintf(f, "null }%s\n", k + 1 < BENCH_CASES ? "," : "");
+    } else {
+      fprintf(f, "%.1f }%s\n", results[k].instructions_per_call, k + 1 < BENCH_CASES ? "," : "");
+    }
+  }
+  fprintf(f, "  }\n}\n");
+  fclose(f);
+  printf("Results written to %s\n", path);
+  return 0;
+}
@@ -0,0 +1,17 @@
+/** @file hardware/adc.h
+ *  @brief Host stub of the Pico SDK adc functions
+ */
+#ifndef BENCH_HARDWARE_ADC_H
+#define BENCH_HARDWARE_ADC_H
+
+#include "pico/stdlib.h"
+
+extern uint16_t stub_adc_value[5];      // 12-bit readings, set by the benchmark
+extern uint16_t (*stub_adc_hook)(uint input); // if set, reads the input instead
+
+void adc_init(void);
+void adc_gpio_init(uint gpio);
+void adc_select_input(uint input);
+uint16_t adc_read(void);
+
+#endif
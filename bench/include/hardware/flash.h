@@ -0,0 +1,21 @@
+/** @file hardware/flash.h
+ *  @brief Host stub of the Pico SDK flash functions
+ *
+ *  The flash is a RAM array read through XIP_BASE like the real thing
+ */
+#ifndef BENCH_HARDWARE_FLASH_H
+#define BENCH_HARDWARE_FLASH_H
+
+#include "pico/stdlib.h"
+
+#define FLASH_PAGE_SIZE       (1u << 8)
+#define FLASH_SECTOR_SIZE     (1u << 12)
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+
+extern uint8_t stub_flash[PICO_FLASH_SIZE_BYTES];
+#define XIP_BASE        ((uintptr_t)stub_flash)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
+
+#endif
@@ -0,0 +1,40 @@
+/** @file hardware/gpio.h
+ *  @brief Host stub of the Pico SDK gpio functions
+ */
+#ifndef BENCH_HARDWARE_GPIO_H
+#define BENCH_HARDWARE_GPIO_H
+
+#include "pico/stdlib.h"
+
+#define GPIO_OUT        1
+#define GPIO_IN         0
+
+enum gpio_function {
+  GPIO_FUNC_SPI = 1, GPIO_FUNC_UART = 2, GPIO_FUNC_I2C = 3, GPIO_FUNC_PWM = 4,
+  GPIO_FUNC_SIO = 5, GPIO_FUNC_NULL = 0x1f
+};
+enum gpio_override {
+  GPIO_OVERRIDE_NORMAL = 0, GPIO_OVERRIDE_INVERT = 1, GPIO_OVERRIDE_LOW = 2, GPIO_OVERRIDE_HIGH = 3
+};
+enum gpio_irq_level {
+  GPIO_IRQ_LEVEL_LOW = 1, GPIO_IRQ_LEVEL_HIGH = 2, GPIO_IRQ_EDGE_FALL = 4, GPIO_IRQ_EDGE_RISE = 8
+};
+typedef void (*gpio_irq_callback_t)(uint gpio, uint32_t event_mask);
+
+extern bool stub_gpio_in[30];           // input levels, set by the benchmark
+extern bool stub_gpio_out[30];          // output levels
+extern uint stub_gpio_over[30];         // output overrides, GPIO_OVERRIDE_
+
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_set_pulls(uint gpio, bool up, bool down);
+void gpio_put(uint gpio, bool value);
+bool gpio_get(uint gpio);
+void gpio_set_function(uint gpio, enum gpio_function fn);
+enum gpio_function gpio_get_function(uint gpio);
+void gpio_set_outover(uint gpio, uint value);
+void gpio_set_irq_enabled(uint gpio, uint32_t event_mask, bool enabled);
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t event_mask, bool enabled,
+                                        gpio_irq_callback_t callback);
+
+#endif
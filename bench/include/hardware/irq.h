@@ -0,0 +1,21 @@
+/** @file hardware/irq.h
+ *  @brief Host stub of the Pico SDK irq functions
+ */
+#ifndef BENCH_HARDWARE_IRQ_H
+#define BENCH_HARDWARE_IRQ_H
+
+#include "pico/stdlib.h"
+
+#define PWM_IRQ_WRAP    4
+#define IO_IRQ_BANK0    13
+#define PICO_HIGHEST_IRQ_PRIORITY 0x00
+#define PICO_DEFAULT_IRQ_PRIORITY 0x80
+#define PICO_LOWEST_IRQ_PRIORITY  0xc0
+
+typedef void (*irq_handler_t)(void);
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler);
+void irq_set_enabled(uint num, bool enabled);
+void irq_set_priority(uint num, uint8_t hardware_priority);
+
+#endif
@@ -0,0 +1,47 @@
+/** @file hardware/pwm.h
+ *  @brief Host stub of the Pico SDK pwm functions
+ */
+#ifndef BENCH_HARDWARE_PWM_H
+#define BENCH_HARDWARE_PWM_H
+
+#include "pico/stdlib.h"
+
+enum pwm_clkdiv_mode {
+  PWM_DIV_FREE_RUNNING,
+  PWM_DIV_B_HIGH,
+  PWM_DIV_B_RISING,
+  PWM_DIV_B_FALLING,
+};
+
+typedef struct {
+  uint32_t csr;
+  uint32_t div;
+  uint32_t top;
+} pwm_config;
+
+extern uint16_t stub_pwm_level[30];     // compare level per gpio
+extern uint16_t stub_pwm_counter[8];    // counter per slice, set by the bench
+extern pwm_config stub_pwm_config[8];   // configuration per slice from pwm_init
+extern uint32_t stub_pwm_irq_mask;      // slices with their interrupt enabled
+extern uint32_t stub_pwm_irq_status;    // slices with an interrupt pending, set by the bench
+
+static inline uint pwm_gpio_to_slice_num(uint gpio) {
+  return (gpio >> 1) & 7;
+}
+
+void pwm_clear_irq(uint slice_num);
+void pwm_set_irq_enabled(uint slice_num, bool enabled);
+pwm_config pwm_get_default_config(void);
+void pwm_config_set_clkdiv(pwm_config *c, float div);
+void pwm_config_set_wrap(pwm_config *c, uint16_t wrap);
+void pwm_config_set_phase_correct(pwm_config *c, bool phase_correct);
+void pwm_init(uint slice_num, pwm_config *c, bool start);
+void pwm_set_gpio_level(uint gpio, uint16_t level);
+void pwm_config_set_clkdiv_mode(pwm_config *c, enum pwm_clkdiv_mode mode);
+uint16_t pwm_get_counter(uint slice_num);
+void pwm_set_counter(uint slice_num, uint16_t c);
+uint32_t pwm_get_irq_status_mask(void);
+void pwm_set_enabled(uint slice_num, bool enabled);
+void pwm_set_mask_enabled(uint32_t mask);
+
+#endif
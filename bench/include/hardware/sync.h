@@ -0,0 +1,24 @@
+/** @file hardware/sync.h
+ *  @brief Host stub of the Pico SDK interrupt save and restore
+ */
+#ifndef BENCH_HARDWARE_SYNC_H
+#define BENCH_HARDWARE_SYNC_H
+
+#include "pico/stdlib.h"
+
+static inline uint32_t save_and_disable_interrupts(void) {
+  __compiler_memory_barrier();
+  return 0;
+}
+
+static inline void restore_interrupts(uint32_t status) {
+  (void)status;
+  __compiler_memory_barrier();
+}
+
+// The benchmark is single threaded - a full fence would swamp the few cycles of a cortex-m0plus dmb
+static inline void __dmb(void) {
+  __compiler_memory_barrier();
+}
+
+#endif
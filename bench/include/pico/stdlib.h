@@ -0,0 +1,51 @@
+/** @file pico/stdlib.h
+ *  @brief Host stub of the Pico SDK for the bldc.c benchmark
+ *
+ *  Only what bldc.c uses. Register blocks are plain arrays so the REG()
+ *  macros in bldc.c read and write memory, and the peripheral functions
+ *  are implemented in stubs.c
+ */
+#ifndef BENCH_PICO_STDLIB_H
+#define BENCH_PICO_STDLIB_H
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef unsigned int uint;
+
+#ifndef PICO_ON_DEVICE
+#define PICO_ON_DEVICE  0
+#endif
+#define PICO_ERROR_TIMEOUT (-1)
+
+extern uint32_t stub_timer_regs[16];
+extern uint32_t stub_sio_regs[64];
+extern uint32_t stub_ppb_regs[0x1000];
+#define TIMER_BASE      ((uintptr_t)stub_timer_regs)
+#define SIO_BASE        ((uintptr_t)stub_sio_regs)
+#define PPB_BASE        ((uintptr_t)stub_ppb_regs - 0xe000)
+#define TIMER_IRQ_1     1
+
+#define __compiler_memory_barrier() __asm__ volatile ("" : : : "memory")
+
+bool stdio_init_all(void);
+int getchar_timeout_us(uint32_t timeout_us);
+
+extern uint64_t stub_time_us;           // simulated time
+#define BENCH_PWM_FREQ  20000           // stub_time_us per pwm_clear_irq() is one period of this
+
+uint32_t time_us_32(void);
+static inline void tight_loop_contents(void) {}
+static inline uint __get_current_exception(void) { return 0; } // thread mode
+static inline uint get_core_num(void) { return 0; }
+uint64_t time_us_64(void);
+void sleep_ms(uint32_t ms);
+void sleep_us(uint64_t us);
+void busy_wait_us(uint64_t us);
+
+#include "hardware/gpio.h"
+
+#endif
@@ -0,0 +1,11 @@
+#!/bin/sh
+# Build the host benchmark of bldc.c and run it
+# Usage: bench/run.sh [results.json]    (default bench/baseline.json)
+# CC and CFLAGS may be set in the environment
+set -e
+cd "$(dirname "$0")"
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+$CC $CFLAGS -std=gnu11 -Wall -Wno-int-to-pointer-cast -Wno-pointer-to-int-cast \
+  -Iinclude -DBENCH_CFLAGS="\"$CFLAGS\"" -o bench bench.c stubs.c -lm
+./bench "${1:-baseline.json}"
@@ -0,0 +1,932 @@
+/** @file sim.c
+ *  @brief Host motor simulator for closed loop tests of bldc.c
+ *
+ *  bldc.c is compiled in here against the stub SDK headers in include/,
+ *  as in bench.c, and pwm_isr() drives a model of the bridge and motor
+ *  The bridge follows the pwm levels and output overrides one pwm count at
+ *  a time, with the diodes taking the current of a switch that is off
+ *  The motor has R and L per phase, a trapezoidal back EMF and one inertia
+ *  with a constant load and viscous friction, all from the loaded profile
+ *  The shunt current is fed back to the adc at the start of each period,
+ *  where pwm_isr reads it. Centre-aligned slices switch about the start of
+ *  the period and PWM_MID_SLICE's interrupt comes half way through
+ *
+ *  Each scenario runs the motor through one test and prints its results
+ *  Build and run with sim.sh, with a scenario name to run only that one
+ */
+#define main bldc_main
+#include "../bldc.c"
+#undef main
+
+#include <math.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SIM_VBUS        12.             // bus voltage, V
+#define SIM_COUNTS      250             // pwm counts per period, one model step each
+#define SIM_DT          (PWM_PERIOD * 1e-6 / SIM_COUNTS) // model step, s
+#define SIM_J           2e-5            // rotor and load inertia, kg m^2
+#define SIM_B           2e-6            // viscous friction, Nm per rad/s
+#define SIM_LOAD        0.04            // load torque against the rotation, Nm
+#define SIM_LOAD_W      1.              //   taken up over this speed from rest, rad/s
+#define SIM_RIPPLE_CMD  60              // speed command for the ripple runs, 750 rpm
+#define SIM_BW_CMD      108             // current command the bandwidth runs work about, mid duty
+#define SIM_BW_STEP     3               //   its step and sine amplitude, small enough that the
+#define SIM_BW_AMP      3               //   duty does not limit the slew up to a few kHz
+#define SIM_BW_FREQS    12              // sine frequencies
+#define SIM_BW_MODES    4               // cur_update modes
+#define SIM_DB_CMD      100             // current command the deadbeat steps start from
+#define SIM_DB_BAND     0.75            // settled within this of the final mean, counts
+#define SIM_DB_HOLD     10              //   for this many periods
+#define SIM_DB_PERIODS  100             // periods recorded after a step
+#define SIM_DB_REPEAT   16              // steps averaged, for the noise on the small one
+#define SIM_DB_CASES    7               // plant R and L cases
+#define SIM_MPC_CMD     100             // current command for the mpc runs
+#define SIM_MPC_LAMBDAS 5               // mpc_lambda values compared
+#define SIM_MPC_DOWN    80              // command stepped down to, fastest with the pair reversed
+#define SIM_MPC_STEPS   20              //   steps timed, SIM_DB_PERIODS apart
+#define SIM_ADV_FIXED   6               // fixed advances run, 0 to 25 degrees
+#define SIM_ADV_DEG     5               //   apart
+#define SIM_ADV_SECONDS 20              // optimizer run, the last 2s measured
+#define SIM_DIR_RUNS    5               // direction runs: open loop and back EMF each way, and a turn
+#define SIM_DIR_RPM     600.            //   the right way at over this is ok, the command is 750rpm
+
+/** @brief  Motor and bridge state */
+typedef struct {
+  double i[3];                          // phase currents, A, positive into the motor
+  double theta;                         // rotor electrical angle, rad
+  double omega;                         // rotor speed, mechanical rad/s
+  double torque;                        // torque over the last period, Nm
+  double idc;                           // mean dc link current over the last period, A
+  double iline;                         // mean current in the conducting pair, A
+  double iline2;                        //   and its mean square, A^2
+  uint32_t switched;                    // bridge switch transitions
+  uint32_t flips;                       //   where a leg's other switch was on the count before
+  uint8_t on[6];                        // switches on at the last count
+  double vph[3];                        // phase terminal voltages, V
+  double shunt;                         // dc link current now, A
+  double load;                          // constant load torque, Nm
+  int locked;                           // rotor held still
+  double rk, lk;                        // plant R and L over the profile's
+  uint16_t level[30];                   // pwm levels latched at the last wrap
+} sim_state;
+
+static sim_state sim;
+
+/** @brief  One scenario */
+typedef struct {
+  const char *name;
+  void (*fn)(void);
+} sim_scenario;
+
+/**
+ *  @brief  sim_bemf - Trapezoidal back EMF shape of phase 1, -1 to 1
+ *
+ *  Flat top from 0 to 120 electrical degrees, so that commutation step 0
+ *  lines up with the rotor at zero advance, then 60 degree ramps
+ */
+static double sim_bemf(double theta) {
+  double d = fmod(theta * (180. / M_PI), 360.);
+  if (d < 0) {
+    d += 360.;
+  }
+  if (d < 120.) {
+    return 1.;
+  }
+  if (d < 180.) {
+    return 1. - (d - 120.) / 30.;
+  }
+  if (d < 300.) {
+    return -1.;
+  }
+  return -1. + (d - 300.) / 30.;
+}
+
+/**
+ *  @brief  sim_switch - Is a bridge switch on at this pwm count
+ *
+ *  A centre-aligned slice counts up to the peak half way through the
+ *  period and back down, at twice the rate
+ */
+static int sim_switch(uint gpio, uint count) {
+  if (stub_gpio_over[gpio] == GPIO_OVERRIDE_LOW) {
+    return 0;
+  }
+  if (stub_pwm_config[pwm_gpio_to_slice_num(gpio)].csr & 0x2u) {
+    count = count < SIM_COUNTS / 2 ? 2 * count : 2 * (SIM_COUNTS - count);
+  }
+  return stub_gpio_over[gpio] == GPIO_OVERRIDE_HIGH || count < sim.level[gpio];
+}
+
+/**
+ *  @brief  sim_step - Advance the bridge and motor by one pwm count
+ */
+static void sim_step(uint count) {
+  const motor_profile *mp = motor.profile;
+  double v[3], e[3], f[3], vn = 0, sum, idc = 0, iline = 0, torque = 0, old, load;
+  int conn[3], n, k, h, l;
+
+  for (k = 0; k < 3; ++k) {
+    f[k] = sim_bemf(sim.theta - k * (2. * M_PI / 3.));
+    e[k] = mp->ke * sim.omega * f[k];
+    h = sim_switch(PWM_1H + 2 * k, count);
+    l = sim_switch(PWM_1L + 2 * k, count);
+    sim.switched += (h != sim.on[2 * k]) + (l != sim.on[2 * k + 1]);
+    sim.flips += (h && sim.on[2 * k + 1]) || (l && sim.on[2 * k]); // shoot-through on a bridge
+    sim.on[2 * k] = h;
+    sim.on[2 * k + 1] = l;
+    conn[k] = 1;
+    if (h) {
+      v[k] = SIM_VBUS;
+    } else if (l || sim.i[k] > 0) {
+      v[k] = 0;                         // low switch or its diode
+    } else if (sim.i[k] < 0) {
+      v[k] = SIM_VBUS;                  // high side diode
+    } else {
+      conn[k] = 0;                      // floating
+    }
+  }
+  for (n = 0; n < 2; ++n) {             // a floating phase past a rail starts its diode
+    uint c = 0;
+    sum = 0;
+    for (k = 0; k < 3; ++k) {
+      if (conn[k]) {
+        sum += v[k] - e[k];
+        c++;
+      }
+    }
+    if (c < 2) {
+      sim.i[0] = sim.i[1] = sim.i[2] = 0;
+      break;
+    }
+    vn = sum / c;
+    for (k = 0; k < 3; ++k) {
+      if (!conn[k] && (vn + e[k] > SIM_VBUS || vn + e[k] < 0)) {
+        conn[k] = 2;
+        v[k] = vn + e[k] > SIM_VBUS ? SIM_VBUS : 0;
+      }
+    }
+    if (c == 3 || !(conn[0] == 2 || conn[1] == 2 || conn[2] == 2)) {
+      for (k = 0; k < 3; ++k) {
+        if (conn[k]) {
+          old = sim.i[k];
+          sim.i[k] += SIM_DT * (v[k] - e[k] - vn - mp->r * sim.rk * old) / (mp->l * sim.lk);
+          if (!sim_switch(PWM_1H + 2 * k, count) && !sim_switch(PWM_1L + 2 * k, count)
+              && old * sim.i[k] < 0) {
+            sim.i[k] = 0;               // diode current has run down
+          }
+        }
+      }
+      break;
+    }
+    for (k = 0; k < 3; ++k) {
+      conn[k] = conn[k] != 0;
+    }
+  }
+  for (k = 0; k < 3; ++k) {
+    old = conn[k] ? v[k] : vn + e[k];   // floating: the neutral plus its back EMF
+    sim.vph[k] = old < 0 ? 0 : old > SIM_VBUS ? SIM_VBUS : old;
+    if (v[k] == SIM_VBUS && conn[k]) {
+      idc += sim.i[k];
+    }
+    torque += mp->ke * f[k] * sim.i[k];
+    iline += fabs(sim.i[k]) / 2.;
+  }
+  if (!sim.locked) {
+    load = sim.omega / SIM_LOAD_W;     // the load only holds a rotor at rest, never turns it
+    load = sim.load * (load > 1. ? 1. : load < -1. ? -1. : load);
+    sim.omega += SIM_DT * (torque - load - SIM_B * sim.omega) / SIM_J;
+  }
+  sim.theta += SIM_DT * mp->pole_pairs * sim.omega;
+  sim.torque += torque / SIM_COUNTS;
+  sim.idc += idc / SIM_COUNTS;
+  sim.iline += iline / SIM_COUNTS;
+  sim.iline2 += iline * iline / SIM_COUNTS;
+  sim.shunt = idc;
+}
+
+/**
+ *  @brief  sim_adc - Shunt amplifier reading for a dc link current, 12-bit
+ *
+ *  With half an 8-bit count of amplifier noise, without which the loops'
+ *  8-bit reading would settle into limit cycles no real board shows
+ */
+static uint16_t sim_adc(double amps) {
+  static uint32_t seed = 1;
+  double counts;
+  seed = seed * 1664525u + 1013904223u; // repeatable noise, -8 to 8 counts
+  counts = amps * CURRENT_COUNTS_PER_A * 16. + ((seed >> 8) & 0xffff) / 4096. - 8.;
+  return counts < 0 ? 0 : counts > 4095. ? 4095 : (uint16_t)counts;
+}
+
+/**
+ *  @brief  sim_adc_read - adc reading, with the voltage sense mux
+ *
+ *  The bus divider reads SIM_VBUS. The phase dividers read the terminal
+ *  voltages at the last model step, with the same noise as the shunt
+ */
+static uint16_t sim_adc_read(uint input) {
+  static uint32_t seed = 7;
+  uint mux = stub_gpio_out[VSENSE_SEL0] | (stub_gpio_out[VSENSE_SEL1] << 1);
+  double counts;
+  if (input != ADC_VSENSE || mux == VSENSE_VBUS) {
+    return stub_adc_value[input];
+  }
+  seed = seed * 1664525u + 1013904223u;
+  counts = sim.vph[mux - VSENSE_VA] * 4. * 16. + ((seed >> 8) & 0xffff) / 4096. - 8.;
+  return counts < 0 ? 0 : counts > 4095. ? 4095 : (uint16_t)counts;
+}
+
+/**
+ *  @brief  sim_period - One pwm period: wrap, pwm_isr, then the bridge
+ *
+ *  The levels pwm_isr writes take effect at the next wrap, as on the slices
+ *  The output overrides of the current limit act at once
+ *  The adc reads the shunt a count after the wrap, with the high side on
+ *  PWM_MID_SLICE interrupts at the peak when it is enabled
+ */
+static void sim_period(void) {
+  uint c;
+  memcpy(sim.level, stub_pwm_level, sizeof(sim.level));
+  sim.torque = 0;
+  sim.idc = 0;
+  sim.iline = 0;
+  sim.iline2 = 0;
+  sim_step(0);
+  stub_adc_value[ADC_CURRENT] = sim_adc(sim.shunt);
+  pwm_isr();
+  for (c = 1; c < SIM_COUNTS; ++c) {
+    if (c == SIM_COUNTS / 2 && (stub_pwm_irq_mask & (1u << PWM_MID_SLICE))) {
+      stub_pwm_irq_status |= 1u << PWM_MID_SLICE;
+      pwm_isr();
+    }
+    sim_step(c);
+  }
+}
+
+/**
+ *  @brief  sim_run - Run for a number of pwm periods
+ */
+static void sim_run(uint32_t periods) {
+  while (periods--) {
+    sim_period();
+  }
+}
+
+/** @brief  sim_rpm - Rotor speed, rpm */
+static double sim_rpm(void) {
+  return sim.omega * (60. / (2. * M_PI));
+}
+
+/**
+ *  @brief  sim_setup - Bring bldc.c up as main() would
+ *
+ *  The rotor starts at rest, lined up with the first commutation step, and
+ *  the direction switch is at forward
+ *
+ *  @param cmd  speed command from the pot, 0-255
+ */
+static void sim_setup(unsigned char cmd) {
+  memset(stub_flash, 0xff, sizeof(stub_flash));
+  memset(&sim, 0, sizeof(sim));
+  sim.load = SIM_LOAD;
+  sim.rk = sim.lk = 1.;
+  stub_gpio_in[SW_DIR] = 0;
+  stub_gpio_in[ILIM_COMP] = 1;
+  stub_adc_value[ADC_SPEED] = cmd << 4;
+  stub_adc_value[ADC_VSENSE] = (uint16_t)(SIM_VBUS * 4.) << 4; // 4 counts per volt
+  stub_adc_hook = sim_adc_read;
+  init_analog();
+  init_evlog();
+  init_angle();
+  motor_load(MOTOR_PROFILE);
+  init_timers();
+}
+
+/**
+ *  @brief  sim_start - Start the motor
+ *
+ *  It is first left stopped for a few function loops, which read the bus
+ *  voltage and take up settings that only apply while stopped, and for the
+ *  direction switch filter to settle
+ */
+static void sim_start(void) {
+  sim_run(4 * PWM_FREQ / LOOP_FREQ + 24 * DIR_PERIOD_US / PWM_PERIOD);
+  motor_on = 1;
+}
+
+/**
+ *  @brief  sim_fork - Run one variant of a scenario in a child process
+ *
+ *  bldc.c keeps its state in globals, so each variant starts from a fresh
+ *  copy of the process rather than from whatever the last one left
+ *
+ *  @param fn      runs the variant and fills in its result
+ *  @param arg     variant number passed to fn
+ *  @param result  where the child's result is copied back to
+ *  @param size    size of the result
+ *  @return 0 if the child failed
+ */
+static int sim_fork(void (*fn)(uint, void *), uint arg, void *result, size_t size) {
+  int fd[2], status;
+  pid_t pid;
+  if (pipe(fd)) {
+    return 0;
+  }
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    close(fd[0]);
+    fn(arg, result);
+    _exit(write(fd[1], result, size) == (ssize_t)size ? 0 : 1);
+  }
+  close(fd[1]);
+  status = pid > 0 && read(fd[0], result, size) == (ssize_t)size;
+  close(fd[0]);
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+  return status;
+}
+
+/** @brief  Speed and torque over a run of periods */
+typedef struct {
+  double rpm_mean, rpm_pp, rpm_rms;
+  double torque_mean, torque_pp;
+  double idc_mean;
+  unsigned char ovl_len;
+} sim_ripple_result;
+
+/**
+ *  @brief  sim_measure - Run and collect the speed and torque ripple
+ */
+static sim_ripple_result sim_measure(uint32_t periods) {
+  sim_ripple_result r;
+  double rpm, lo = 1e9, hi = -1e9, tlo = 1e9, thi = -1e9, sum = 0, sum2 = 0, tsum = 0, isum = 0;
+  uint32_t n;
+  for (n = 0; n < periods; ++n) {
+    sim_period();
+    rpm = sim_rpm();
+    sum += rpm;
+    sum2 += rpm * rpm;
+    lo = rpm < lo ? rpm : lo;
+    hi = rpm > hi ? rpm : hi;
+    tsum += sim.torque;
+    tlo = sim.torque < tlo ? sim.torque : tlo;
+    thi = sim.torque > thi ? sim.torque : thi;
+    isum += sim.idc;
+  }
+  r.rpm_mean = sum / periods;
+  r.rpm_rms = sqrt(sum2 / periods - r.rpm_mean * r.rpm_mean);
+  r.rpm_pp = hi - lo;
+  r.torque_mean = tsum / periods;
+  r.torque_pp = thi - tlo;
+  r.idc_mean = isum / periods;
+  r.ovl_len = ovl_len;
+  return r;
+}
+
+/**
+ *  @brief  sim_ripple_run - Run up in the speed loop, settle, then measure
+ *
+ *  The start ramp locks on to the back EMF and the speed loop then runs
+ *  on the speed measured from the zero crossings
+ *
+ *  @param overlap  ovl_enable for the run
+ */
+static void sim_ripple_run(uint overlap, void *result) {
+  sim_setup(SIM_RIPPLE_CMD);
+  ovl_enable = overlap;
+  sim_start();
+  sim_run(5 * PWM_FREQ);
+  *(sim_ripple_result *)result = sim_measure(PWM_FREQ / 2);
+}
+
+/**
+ *  @brief  sim_ripple - Speed ripple with and without the commutation overlap
+ */
+static void sim_ripple(void) {
+  sim_ripple_result r[2];
+  uint k;
+  for (k = 0; k < 2; ++k) {
+    if (!sim_fork(sim_ripple_run, k, &r[k], sizeof(r[k]))) {
+      printf("run failed\n");
+      return;
+    }
+  }
+  printf("%-12s %10s %10s %10s %10s %10s %8s\n", "overlap", "rpm", "ripple pp", "ripple %",
+         "rms rpm", "torque %", "idc A");
+  for (k = 0; k < 2; ++k) {
+    printf("%-12s %10.1f %10.2f %10.3f %10.3f %10.1f %8.3f\n", k ? "on" : "off", r[k].rpm_mean,
+           r[k].rpm_pp, 100. * r[k].rpm_pp / r[k].rpm_mean, r[k].rpm_rms,
+           100. * r[k].torque_pp / r[k].torque_mean, r[k].idc_mean);
+  }
+  printf("ovl_len %u periods, speed ripple %.1f%% lower with the overlap\n", r[1].ovl_len,
+         100. * (1. - r[1].rpm_pp / r[0].rpm_pp));
+}
+
+/** @brief  Current loop step and frequency response */
+typedef struct {
+  double rise_us;                       // 10 to 90% of the step
+  double overshoot;                     // % of the step
+  double gain[SIM_BW_FREQS];            // sine response, relative to the lowest frequency
+  double bw_hz;                         // -3dB, 0 if above the sine frequencies
+} sim_bw_result;
+
+static const char *const sim_mode_name[SIM_BW_MODES] = { "loop", "pwm", "double", "deadbeat" };
+
+static const uint sim_bw_periods[SIM_BW_FREQS] = { // pwm periods per sine cycle
+  400, 200, 100, 50, 40, 25, 20, 16, 10, 8, 5, 4
+};
+
+/**
+ *  @brief  sim_bw_cmd - Run one period at a current command
+ *
+ *  The pot follows the command too, so the next reading leaves it alone
+ *
+ *  @return current in the conducting pair over the period, counts
+ */
+static double sim_bw_cmd(unsigned char cmd) {
+  stub_adc_value[ADC_SPEED] = cmd << 4;
+  current_cmd = input_cmd = cmd;
+  sim_period();
+  return sim.iline * CURRENT_COUNTS_PER_A;
+}
+
+/**
+ *  @brief  sim_bw_setup - Start the torque loop with the rotor held still
+ *
+ *  The angle is stopped too, so there is no back EMF and one pair of
+ *  phases conducts throughout, and there is nothing to align at the
+ *  start. Runs at the command until it has settled
+ *
+ *  @param mode  cur_update for the run
+ *  @param cmd   current command, counts
+ */
+static void sim_bw_setup(uint mode, unsigned char cmd) {
+  uint32_t n;
+  sim_setup(cmd);
+  sim.locked = 1;
+  cur_update = mode;
+  loop_type = loop_type_req = 0;
+  motor.align_periods = 0;
+  bemf_enable = 0;                      // nothing to sense, the angle is held
+  sim_start();
+  sim_run(2);                           // the start and the end of the alignment
+  angle_set_step(0);
+  for (n = 0; n < PWM_FREQ / 5; ++n) {
+    sim_bw_cmd(cmd);
+  }
+}
+
+/**
+ *  @brief  sim_bw_run - Step and sine responses of the torque loop
+ *
+ *  @param mode  cur_update for the run
+ */
+static void sim_bw_run(uint mode, void *result) {
+  sim_bw_result *r = result;
+  double y[PWM_FREQ / 50], lo, hi, peak, re, im, ure, uim, a, ref = 0;
+  uint32_t n, len = PWM_FREQ / 50;      // 20ms of step response
+  uint k, p, cycles;
+
+  sim_bw_setup(mode, SIM_BW_CMD);
+  lo = sim_bw_cmd(SIM_BW_CMD);
+  for (n = 0, peak = 0; n < len; ++n) {
+    y[n] = sim_bw_cmd(SIM_BW_CMD + SIM_BW_STEP);
+    peak = y[n] > peak ? y[n] : peak;
+  }
+  for (n = len * 3 / 4, hi = 0; n < len; ++n) {
+    hi += y[n] / (len / 4);
+  }
+  r->rise_us = 0;
+  for (n = 1, p = 0; n < len && !r->rise_us; ++n) {
+    a = lo + (p ? 0.9 : 0.1) * (hi - lo);
+    if (y[n] >= a) {
+      a = (n - 1 + (a - y[n - 1]) / (y[n] - y[n - 1])) * PWM_PERIOD;
+      if (p) {
+        r->rise_us = a - ref;
+      } else {
+        ref = a;
+        p = 1;
+        n--;
+      }
+    }
+  }
+  r->overshoot = 100. * (peak - hi) / (hi - lo);
+  r->bw_hz = 0;
+  for (k = 0; k < SIM_BW_FREQS; ++k) {
+    p = sim_bw_periods[k];
+    cycles = (PWM_FREQ / 20 + p - 1) / p; // 50ms or more to settle and measure over
+    re = im = ure = uim = 0;
+    for (n = 0; n < 2 * cycles * p; ++n) {
+      double w = 2. * M_PI * (n % p) / p;
+      unsigned char u = (unsigned char)lrint(SIM_BW_CMD + SIM_BW_AMP * sin(w));
+      double out = sim_bw_cmd(u);
+      if (n >= cycles * p) {
+        re += out * cos(w);
+        im += out * sin(w);
+        ure += u * cos(w);
+        uim += u * sin(w);
+      }
+    }
+    r->gain[k] = sqrt((re * re + im * im) / (ure * ure + uim * uim));
+    if (k) {
+      r->gain[k] /= r->gain[0];
+      if (!r->bw_hz && r->gain[k] < M_SQRT1_2) {
+        a = (log(r->gain[k - 1]) - log(M_SQRT1_2)) / (log(r->gain[k - 1]) - log(r->gain[k]));
+        r->bw_hz = PWM_FREQ / exp(log(sim_bw_periods[k - 1])
+                                  + a * (log(sim_bw_periods[k]) - log(sim_bw_periods[k - 1])));
+      }
+    }
+  }
+  r->gain[0] = 1.;
+}
+
+/**
+ *  @brief  sim_bandwidth - Torque loop bandwidth for each current update mode
+ */
+static void sim_bandwidth(void) {
+  sim_bw_result r[SIM_BW_MODES];
+  uint k, f;
+  for (k = 0; k < SIM_BW_MODES; ++k) {
+    if (!sim_fork(sim_bw_run, k, &r[k], sizeof(r[k]))) {
+      printf("run failed\n");
+      return;
+    }
+  }
+  printf("%-12s %10s %10s %10s\n", "cur_update", "rise us", "overshoot", "-3dB Hz");
+  for (k = 0; k < SIM_BW_MODES; ++k) {
+    if (r[k].bw_hz) {
+      printf("%-12s %10.0f %9.1f%% %10.0f\n", sim_mode_name[k], r[k].rise_us, r[k].overshoot,
+             r[k].bw_hz);
+    } else {
+      printf("%-12s %10.0f %9.1f%% %10s\n", sim_mode_name[k], r[k].rise_us, r[k].overshoot, "above");
+    }
+  }
+  printf("%-12s", "gain at Hz");
+  for (k = 0; k < SIM_BW_MODES; ++k) {
+    printf(" %10s", sim_mode_name[k]);
+  }
+  printf("\n");
+  for (f = 0; f < SIM_BW_FREQS; ++f) {
+    printf("%-12u", PWM_FREQ / sim_bw_periods[f]);
+    for (k = 0; k < SIM_BW_MODES; ++k) {
+      printf(" %10.3f", r[k].gain[f]);
+    }
+    printf("\n");
+  }
+  printf("double update bandwidth %.2f times single update\n", r[2].bw_hz / r[1].bw_hz);
+}
+
+/** @brief  Step response in pwm periods */
+typedef struct {
+  double settle[2];                     // periods to settle after each step size, -1 if not
+  double overshoot[2];                  // past the settled mean, % of the step
+  double error;                         // settled mean less the command after the small step
+} sim_db_result;
+
+static const uint sim_db_steps[2] = { 3, 12 }; // within one period's voltage, and past it
+
+/**
+ *  @brief  Plant R and L over the profile's for the sensitivity runs
+ *
+ *  R is kept to what the duty range can still drive the command through
+ */
+static const double sim_db_cases[SIM_DB_CASES][2] = {
+  { 1., 1. }, { .8, 1. }, { 1.25, 1. }, { 1., .5 }, { 1., .8 }, { 1., 1.25 }, { 1., 2. },
+};
+
+/**
+ *  @brief  sim_db_step - Step the current command and time the response
+ *
+ *  The response is averaged over SIM_DB_REPEAT steps up from SIM_DB_CMD
+ *
+ *  @param k  index in sim_db_steps[]
+ */
+static void sim_db_step(sim_db_result *r, uint k) {
+  unsigned char cmd = SIM_DB_CMD + sim_db_steps[k];
+  double y[SIM_DB_PERIODS] = { 0 }, peak = 0, final = 0;
+  uint32_t n, in = 0;
+  uint rep;
+  for (rep = 0; rep < SIM_DB_REPEAT; ++rep) {
+    for (n = 0; n < PWM_FREQ / 100; ++n) {
+      sim_bw_cmd(SIM_DB_CMD);
+    }
+    for (n = 0; n < SIM_DB_PERIODS; ++n) {
+      y[n] += sim_bw_cmd(cmd) / SIM_DB_REPEAT;
+    }
+  }
+  for (n = 0; n < SIM_DB_PERIODS; ++n) {
+    peak = y[n] > peak ? y[n] : peak;
+    if (n >= SIM_DB_PERIODS / 2) {
+      final += y[n] / (SIM_DB_PERIODS / 2);
+    }
+  }
+  r->settle[k] = -1;
+  for (n = 0; n < SIM_DB_PERIODS && r->settle[k] < 0; ++n) {
+    in = fabs(y[n] - final) <= SIM_DB_BAND ? in + 1 : 0;
+    if (in == SIM_DB_HOLD) {
+      r->settle[k] = n + 2 - SIM_DB_HOLD;
+    }
+  }
+  r->overshoot[k] = peak > final ? 100. * (peak - final) / sim_db_steps[k] : 0.;
+  if (!k) {
+    r->error = final - cmd;
+  }
+}
+
+/**
+ *  @brief  sim_db_run - Small and large steps with the rotor held still
+ *
+ *  @param arg  cur_update * SIM_DB_CASES + the plant case
+ */
+static void sim_db_run(uint arg, void *result) {
+  sim_db_result *r = result;
+  uint k;
+  sim_bw_setup(arg / SIM_DB_CASES, SIM_DB_CMD);
+  sim.rk = sim_db_cases[arg % SIM_DB_CASES][0];
+  sim.lk = sim_db_cases[arg % SIM_DB_CASES][1];
+  for (k = 0; k < 2; ++k) {
+    sim_db_step(r, k);
+  }
+}
+
+/** @brief  sim_db_print - One row of the deadbeat tables */
+static void sim_db_print(const char *name, const sim_db_result *r) {
+  uint k;
+  printf("%-12s", name);
+  for (k = 0; k < 2; ++k) {
+    if (r->settle[k] < 0) {
+      printf(" %10s %9.0f%%", "no", r->overshoot[k]);
+    } else {
+      printf(" %10.0f %9.0f%%", r->settle[k], r->overshoot[k]);
+    }
+  }
+  printf(" %10.2f\n", r->error);
+}
+
+/**
+ *  @brief  sim_deadbeat - Deadbeat step response against the PI modes,
+ *          and its sensitivity to the plant's R and L
+ *
+ *  The controller keeps the profile's R and L while the plant's change
+ */
+static void sim_deadbeat(void) {
+  sim_db_result r;
+  char name[24];
+  uint k;
+  printf("%-12s %10s %10s %10s %10s %10s\n", "cur_update", "settle 3", "overshoot", "settle 12",
+         "overshoot", "error");
+  for (k = CUR_UPDATE_PWM; k < SIM_BW_MODES; ++k) {
+    if (!sim_fork(sim_db_run, k * SIM_DB_CASES, &r, sizeof(r))) {
+      printf("run failed\n");
+      return;
+    }
+    sim_db_print(sim_mode_name[k], &r);
+  }
+  printf("deadbeat with the plant's R and L off the profile's:\n");
+  for (k = 1; k < SIM_DB_CASES; ++k) {
+    if (!sim_fork(sim_db_run, CUR_UPDATE_DEADBEAT * SIM_DB_CASES + k, &r, sizeof(r))) {
+      printf("run failed\n");
+      return;
+    }
+    snprintf(name, sizeof(name), "R x%.2g L x%.2g", sim_db_cases[k][0], sim_db_cases[k][1]);
+    sim_db_print(name, &r);
+  }
+  printf("settle in pwm periods to within %.2g counts for %u, error in counts\n", SIM_DB_BAND,
+         SIM_DB_HOLD);
+}
+
+/** @brief  Current tracking and switching over a run */
+typedef struct {
+  double error;                         // mean current less the command, counts
+  double rms;                           // rms of the current about the command, counts
+  double switched;                      // switch transitions per period
+  double down;                          // periods to fall 90% of a step down, -1 if one did not
+  uint32_t flips;                       // leg flips with no dead time, steps included
+} sim_mpc_result;
+
+static const unsigned char sim_mpc_lambdas[SIM_MPC_LAMBDAS] = { 0, 2, 4, 8, 16 };
+
+/**
+ *  @brief  sim_mpc_run - Hold the current command with the rotor still
+ *
+ *  The rms is over every model step, so it takes in the ripple within each
+ *  period as well as between them. Then the command steps down and back,
+ *  where reversing the pair would bring the current down fastest
+ *
+ *  @param arg  cur_update, or SIM_BW_MODES + the index in sim_mpc_lambdas[]
+ */
+static void sim_mpc_run(uint arg, void *result) {
+  sim_mpc_result *r = result;
+  double sum = 0, sum2 = 0, c = SIM_MPC_CMD / CURRENT_COUNTS_PER_A;
+  double y, down = SIM_MPC_CMD - .9 * (SIM_MPC_CMD - SIM_MPC_DOWN);
+  uint32_t n, k, switched;
+  if (arg >= SIM_BW_MODES) {
+    mpc_lambda = sim_mpc_lambdas[arg - SIM_BW_MODES];
+    arg = CUR_UPDATE_MPC;
+  }
+  sim_bw_setup(arg, SIM_MPC_CMD);
+  switched = sim.switched;
+  for (n = 0; n < PWM_FREQ / 5; ++n) {
+    sim_bw_cmd(SIM_MPC_CMD);
+    sum += sim.iline - c;
+    sum2 += sim.iline2 - 2. * c * sim.iline + c * c;
+  }
+  r->error = sum / n * CURRENT_COUNTS_PER_A;
+  r->rms = sqrt(sum2 / n) * CURRENT_COUNTS_PER_A;
+  r->switched = (double)(sim.switched - switched) / n;
+  r->down = 0;
+  for (k = 0; k < SIM_MPC_STEPS && r->down >= 0; ++k) {
+    for (n = 0, y = SIM_MPC_CMD; n < SIM_DB_PERIODS; ++n) {
+      if (y > down) {
+        y = sim_bw_cmd(SIM_MPC_DOWN);
+        r->down += 1. / SIM_MPC_STEPS;
+      } else {
+        sim_bw_cmd(SIM_MPC_DOWN);
+      }
+    }
+    if (y > down) {
+      r->down = -1;
+    }
+    for (n = 0; n < SIM_DB_PERIODS; ++n) {
+      sim_bw_cmd(SIM_MPC_CMD);
+    }
+  }
+  r->flips = sim.flips;
+}
+
+/**
+ *  @brief  sim_mpc - Finite control set mpc against the modulated modes
+ */
+static void sim_mpc(void) {
+  sim_mpc_result r;
+  char name[24];
+  uint k;
+  printf("%-16s %10s %10s %10s %10s %10s\n", "cur_update", "error", "rms", "switched", "down",
+         "flips");
+  for (k = CUR_UPDATE_PWM; k < SIM_BW_MODES + SIM_MPC_LAMBDAS; ++k) {
+    if (!sim_fork(sim_mpc_run, k, &r, sizeof(r))) {
+      printf("run failed\n");
+      return;
+    }
+    if (k < SIM_BW_MODES) {
+      snprintf(name, sizeof(name), "%s", sim_mode_name[k]);
+    } else {
+      snprintf(name, sizeof(name), "mpc lambda %u", sim_mpc_lambdas[k - SIM_BW_MODES]);
+    }
+    printf("%-16s %10.2f %10.2f %10.2f", name, r.error, r.rms, r.switched);
+    if (r.down < 0) {
+      printf(" %10s", "no");
+    } else {
+      printf(" %10.1f", r.down);
+    }
+    printf(" %10lu\n", (unsigned long)r.flips);
+  }
+  printf("current in counts at %u, switch transitions per pwm period\n", SIM_MPC_CMD);
+  printf("down: pwm periods to fall 90%% of a step to %u, no if not within %u\n", SIM_MPC_DOWN,
+         SIM_DB_PERIODS);
+  printf("flips: a leg switched from one side to the other with no dead time, whole run\n");
+}
+
+/** @brief  Speed, bus current and phase error at one advance */
+typedef struct {
+  double rpm, idc, phase;
+  unsigned char deg;
+  uint32_t steps;
+} sim_adv_result;
+
+/**
+ *  @brief  sim_adv_run - Run in the speed loop at a fixed or optimized advance
+ *
+ *  The phase error is the optimizer's mean over its last step, which it
+ *  works out whether or not it is enabled
+ *
+ *  @param arg  index of the fixed advance, or SIM_ADV_FIXED for the optimizer
+ */
+static void sim_adv_run(uint arg, void *result) {
+  sim_adv_result *r = result;
+  sim_ripple_result m;
+  sim_setup(SIM_RIPPLE_CMD);
+  if (arg < SIM_ADV_FIXED) {
+    advance_deg = arg * SIM_ADV_DEG;
+    com_advance = ANGLE_DEG(advance_deg);
+    sim_start();
+    sim_run(3 * PWM_FREQ);
+  } else {
+    adv_enable = 1;
+    sim_start();
+    sim_run((SIM_ADV_SECONDS - 2) * PWM_FREQ);
+  }
+  m = sim_measure(2 * PWM_FREQ);
+  r->rpm = m.rpm_mean;
+  r->idc = m.idc_mean;
+  r->phase = adv_phase / 256.;
+  r->deg = adv_state ? adv_deg : advance_deg;
+  r->steps = adv_steps;
+}
+
+/**
+ *  @brief  sim_advance - Bus current against the advance, and where the optimizer gets to
+ */
+static void sim_advance(void) {
+  sim_adv_result r[SIM_ADV_FIXED + 1];
+  uint k;
+  for (k = 0; k <= SIM_ADV_FIXED; ++k) {
+    if (!sim_fork(sim_adv_run, k, &r[k], sizeof(r[k]))) {
+      printf("run failed\n");
+      return;
+    }
+  }
+  printf("%-16s %10s %10s %10s\n", "advance deg", "rpm", "idc A", "phase deg");
+  for (k = 0; k < SIM_ADV_FIXED; ++k) {
+    printf("%-16u %10.1f %10.4f %10.2f\n", r[k].deg, r[k].rpm, r[k].idc, r[k].phase);
+  }
+  printf("%-16s %10.1f %10.4f %10.2f\n", "optimized", r[k].rpm, r[k].idc, r[k].phase);
+  printf("optimizer at %u deg after %lu steps, bus current %.1f%% below the fixed %u deg\n",
+         r[k].deg, (unsigned long)r[k].steps,
+         100. * (1. - r[k].idc / r[ADVANCE_DEG / SIM_ADV_DEG].idc), ADVANCE_DEG);
+  printf("phase: angle ahead of the rotor at the zero crossings, mean over the last step\n");
+}
+
+/** @brief  Which way the rotor turned */
+typedef struct {
+  double rpm;
+  unsigned char dir, locked;
+  unsigned int lost;
+} sim_dir_result;
+
+static const char *const sim_dir_name[SIM_DIR_RUNS] = {
+  "fwd open loop", "rev open loop", "fwd back EMF", "rev back EMF", "fwd then rev"
+};
+
+/**
+ *  @brief  sim_dir_run - Run up in the speed loop with the direction switch set
+ *
+ *  The last run turns the switch to reverse with the motor running, which
+ *  stops the bridge and starts it again from the alignment
+ *
+ *  @param arg  index in sim_dir_name[]
+ */
+static void sim_dir_run(uint arg, void *result) {
+  sim_dir_result *r = result;
+  sim_setup(SIM_RIPPLE_CMD);
+  bemf_enable = arg >= 2;
+  stub_gpio_in[SW_DIR] = arg == 1 || arg == 3;
+  sim_start();
+  sim_run(3 * PWM_FREQ);
+  if (arg == 4) {
+    stub_gpio_in[SW_DIR] = 1;
+    sim_run(4 * PWM_FREQ);
+  }
+  r->rpm = sim_measure(PWM_FREQ / 2).rpm_mean;
+  r->dir = com_dir;
+  r->locked = com_locked && bemf_active;
+  r->lost = bemf_lost;
+}
+
+/**
+ *  @brief  sim_direction - Rotation sign against the direction switch
+ */
+static void sim_direction(void) {
+  sim_dir_result r;
+  double rpm;
+  uint k;
+  printf("%-16s %10s %10s %10s %10s %10s\n", "run", "rpm", "com_dir", "locked", "lost", "sign");
+  for (k = 0; k < SIM_DIR_RUNS; ++k) {
+    if (!sim_fork(sim_dir_run, k, &r, sizeof(r))) {
+      printf("run failed\n");
+      return;
+    }
+    rpm = k == 1 || k >= 3 ? -r.rpm : r.rpm; // the way the switch says
+    printf("%-16s %10.1f %10s %10s %10u %10s\n", sim_dir_name[k], r.rpm, r.dir == REV ? "rev" : "fwd",
+           r.locked ? "yes" : "no", r.lost, rpm > SIM_DIR_RPM ? "ok" : "WRONG");
+  }
+}
+
+static const sim_scenario scenarios[] = {
+  { "ripple", sim_ripple },
+  { "bandwidth", sim_bandwidth },
+  { "deadbeat", sim_deadbeat },
+  { "mpc", sim_mpc },
+  { "advance", sim_advance },
+  { "direction", sim_direction },
+};
+#define SIM_SCENARIOS   (sizeof(scenarios) / sizeof(scenarios[0]))
+
+int main(int argc, char **argv) {
+  uint k, run = 0;
+  for (k = 0; k < SIM_SCENARIOS; ++k) {
+    if (argc < 2 || !strcmp(argv[1], scenarios[k].name)) {
+      printf("-- %s --\n", scenarios[k].name);
+      scenarios[k].fn();
+      run++;
+    }
+  }
+  if (!run) {
+    fprintf(stderr, "no scenario %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
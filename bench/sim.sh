@@ -0,0 +1,11 @@
+#!/bin/sh
+# Build the host motor simulator of bldc.c and run it
+# Usage: bench/sim.sh [scenario]    (default all of them)
+# CC and CFLAGS may be set in the environment
+set -e
+cd "$(dirname "$0")"
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+$CC $CFLAGS -std=gnu11 -Wall -Wno-int-to-pointer-cast -Wno-pointer-to-int-cast \
+  -Iinclude -o sim sim.c stubs.c -lm
+./sim "$@"
@@ -0,0 +1,231 @@
+/** @file stubs.c
+ *  @brief Host implementations of the Pico SDK stubs used by bldc.c
+ *
+ *  Peripherals are modelled just far enough for the control code to run:
+ *  gpio levels and adc readings come from arrays the benchmark sets,
+ *  flash is a RAM array and the timer is simulated: each pwm interrupt
+ *  (pwm_clear_irq) moves it on one pwm period, or its share of one when
+ *  more slices interrupt, so the timer wheel runs the function loop as
+ *  often per pwm_isr call as on the Pico
+ */
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/adc.h"
+#include "hardware/flash.h"
+#include "hardware/irq.h"
+#include "hardware/pwm.h"
+
+uint32_t stub_timer_regs[16];
+uint32_t stub_sio_regs[64];
+uint32_t stub_ppb_regs[0x1000];
+
+bool stub_gpio_in[30];
+bool stub_gpio_out[30];
+static enum gpio_function stub_gpio_func[30];
+uint stub_gpio_over[30];
+
+uint16_t stub_adc_value[5];
+uint16_t (*stub_adc_hook)(uint input);
+static uint stub_adc_input;
+
+uint16_t stub_pwm_level[30];
+uint16_t stub_pwm_counter[8];
+pwm_config stub_pwm_config[8];
+uint32_t stub_pwm_irq_mask;
+uint32_t stub_pwm_irq_status;
+
+uint8_t stub_flash[PICO_FLASH_SIZE_BYTES];
+
+uint64_t stub_time_us;
+
+/** -- stdio and time -- */
+bool stdio_init_all(void) {
+  return true;
+}
+
+int getchar_timeout_us(uint32_t timeout_us) {
+  (void)timeout_us;
+  return PICO_ERROR_TIMEOUT;
+}
+
+uint64_t time_us_64(void) {
+  return stub_time_us;
+}
+
+uint32_t time_us_32(void) {
+  return (uint32_t)time_us_64();
+}
+
+void sleep_ms(uint32_t ms) {
+  stub_time_us += (uint64_t)ms * 1000;
+}
+
+void sleep_us(uint64_t us) {
+  stub_time_us += us;
+}
+
+void busy_wait_us(uint64_t us) {
+  stub_time_us += us;
+}
+
+/** -- gpio -- */
+void gpio_init(uint gpio) {
+  stub_gpio_func[gpio] = GPIO_FUNC_SIO;
+  stub_gpio_out[gpio] = 0;
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+  (void)gpio;
+  (void)out;
+}
+
+void gpio_set_pulls(uint gpio, bool up, bool down) {
+  (void)down;
+  stub_gpio_in[gpio] = up;
+}
+
+void gpio_put(uint gpio, bool value) {
+  stub_gpio_out[gpio] = value;
+}
+
+bool gpio_get(uint gpio) {
+  return stub_gpio_in[gpio];
+}
+
+void gpio_set_function(uint gpio, enum gpio_function fn) {
+  stub_gpio_func[gpio] = fn;
+}
+
+enum gpio_function gpio_get_function(uint gpio) {
+  return stub_gpio_func[gpio];
+}
+
+void gpio_set_outover(uint gpio, uint value) {
+  stub_gpio_over[gpio] = value;
+}
+
+void gpio_set_irq_enabled(uint gpio, uint32_t event_mask, bool enabled) {
+  (void)gpio;
+  (void)event_mask;
+  (void)enabled;
+}
+
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t event_mask, bool enabled,
+                                        gpio_irq_callback_t callback) {
+  (void)callback;
+  gpio_set_irq_enabled(gpio, event_mask, enabled);
+}
+
+/** -- adc -- */
+void adc_init(void) {
+}
+
+void adc_gpio_init(uint gpio) {
+  (void)gpio;
+}
+
+void adc_select_input(uint input) {
+  stub_adc_input = input;
+}
+
+uint16_t adc_read(void) {
+  if (stub_adc_hook) {
+    return stub_adc_hook(stub_adc_input);
+  }
+  return stub_adc_value[stub_adc_input];
+}
+
+/** -- irq -- */
+void irq_set_exclusive_handler(uint num, irq_handler_t handler) {
+  (void)num;
+  (void)handler;
+}
+
+void irq_set_enabled(uint num, bool enabled) {
+  (void)num;
+  (void)enabled;
+}
+
+void irq_set_priority(uint num, uint8_t hardware_priority) {
+  (void)num;
+  (void)hardware_priority;
+}
+
+/** -- pwm -- */
+void pwm_clear_irq(uint slice_num) {
+  uint n = __builtin_popcount(stub_pwm_irq_mask);
+  stub_pwm_irq_status &= ~(1u << slice_num);
+  stub_time_us += 1000000 / BENCH_PWM_FREQ / (n ? n : 1);
+}
+
+void pwm_set_irq_enabled(uint slice_num, bool enabled) {
+  if (enabled) {
+    stub_pwm_irq_mask |= 1u << slice_num;
+  } else {
+    stub_pwm_irq_mask &= ~(1u << slice_num);
+  }
+}
+
+uint32_t pwm_get_irq_status_mask(void) {
+  return stub_pwm_irq_status & stub_pwm_irq_mask;
+}
+
+pwm_config pwm_get_default_config(void) {
+  pwm_config c = { 0, 16, 0xffff };
+  return c;
+}
+
+void pwm_config_set_clkdiv(pwm_config *c, float div) {
+  c->div = (uint32_t)(div * 16);
+}
+
+void pwm_config_set_wrap(pwm_config *c, uint16_t wrap) {
+  c->top = wrap;
+}
+
+void pwm_config_set_phase_correct(pwm_config *c, bool phase_correct) {
+  c->csr = (c->csr & ~0x2u) | (phase_correct ? 0x2u : 0);
+}
+
+void pwm_init(uint slice_num, pwm_config *c, bool start) {
+  (void)start;
+  stub_pwm_config[slice_num] = *c;
+  stub_pwm_counter[slice_num] = 0;
+}
+
+void pwm_set_gpio_level(uint gpio, uint16_t level) {
+  stub_pwm_level[gpio] = level;
+}
+
+void pwm_config_set_clkdiv_mode(pwm_config *c, enum pwm_clkdiv_mode mode) {
+  c->csr = (c->csr & ~0x30u) | ((uint32_t)mode << 4);
+}
+
+uint16_t pwm_get_counter(uint slice_num) {
+  return stub_pwm_counter[slice_num];
+}
+
+void pwm_set_counter(uint slice_num, uint16_t c) {
+  stub_pwm_counter[slice_num] = c;
+}
+
+void pwm_set_enabled(uint slice_num, bool enabled) {
+  (void)slice_num;
+  (void)enabled;
+}
+
+void pwm_set_mask_enabled(uint32_t mask) {
+  (void)mask;
+}
+
+/** -- flash -- */
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+  memset(stub_flash + flash_offs, 0xff, count);
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    stub_flash[flash_offs + i] &= data[i];  // NOR flash only clears bits
+  }
+}
@@ -7,8 +7,10 @@
  *  This code operates the basic PLL with compensation
  *  Can run in speed control or torque control mode by setting LOOP_TYPE
  *  - 0 for torque (current) loop, 1 for speed loop
+ *  The mode can also be changed while running ('L' command) without a step in duty
  *  The Potentiometer sets current or speed command depending on the mode
  *  Application Board Motor (45ZWN24-30) 24V, 2A, 3 phase, N= 4 poles, 3200rpm
+ *  Other motors are described in motor_profiles[] and selected with 'P'
  *  Back EMF test: Vpeak = Back EMF peak voltage line-to-line = 4.44V
  *  Period = Back EMF period = 0.041 sec
  *  Ke = Vpeak/SQRT(2) * Period/(2*PI()) * N/2 = 0.0410 V/rad/sec (per phase peak value)
@@ -26,19 +28,47 @@
  *  @bug No known bugs
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "hardware/adc.h"
+#include "hardware/flash.h"
+#include "hardware/gpio.h"
 #include "hardware/irq.h"
 #include "hardware/pwm.h"
+#include "hardware/sync.h"
+#if PICO_ON_DEVICE
+#include "hardware/dma.h"
+#include "hardware/i2c.h"
+#include "hardware/interp.h"
+#include "hardware/spi.h"
+#include "hardware/uart.h"
+#include "pico/multicore.h"
+#include "pico/stdio/driver.h"
+#endif
+#if PICO_ON_DEVICE && LIB_PICO_STDIO_UART
+#include "pico/stdio_uart.h"
+#endif
+#if PICO_ON_DEVICE && LIB_PICO_STDIO_USB
+#include "pico/stdio_usb.h"
+#include "tusb.h"
+#endif
+#include <math.h>
 
 /** -- System Parameters -- */
 #define UART            1               // system has a terminal
 
 #define PWM_PERIOD      50              // 50uS is 20kHz
-#define PWM_COUNT_MAX   12              // pwm frequency divider for function loop normally 50
-
-#define BLINK_MAX       800             // function loop divisor
-#define LOOP_TYPE       1			          // 0 = torque control, 1 = speed control
+#define LOOP_PERIOD_US  600             // function loop period, one step per pwm period
+#define LOOP_FREQ       (1000000 / LOOP_PERIOD_US) // function loop frequency in Hz
+#define BLINK_MS        480             // status led blink period
+#define DIR_PERIOD_US   500             // direction switch sample period
+#define POT_PERIOD_US   6600            // potentiometer sample period
+#define UI_POLL_US      1000            // background tasks run while waiting for a key
+#define LOOP_TYPE       1			          // start up mode: 0 = torque control, 1 = speed control
+#ifndef USE_INTERP
+#define USE_INTERP      PICO_ON_DEVICE  // 1 = angle/sine lookup on interpolators, 0 = software
+#endif
 
 /** @brief  Pico registers
  *
@@ -60,6 +90,10 @@
 #define NVIC_ISER   REG(PPB_BASE+0xe100) // interrupt set enable bits
 #define VTOR        REG(PPB_BASE+0xed08)
 
+#define SYST_CSR    REG(PPB_BASE+0xe010) // systick control and status
+#define SYST_RVR    REG(PPB_BASE+0xe014) // systick reload value
+#define SYST_CVR    REG(PPB_BASE+0xe018) // systick current value (counts down)
+
 /** -- GPIO pin definitions -- */
 #define LED_YEL     2
 #define LED_GRN     3
@@ -71,8 +105,26 @@
 #define PWM_2L      13                  // pwm phase 2, Low
 #define PWM_3H      14                  // pwm phase 3, High
 #define PWM_3L      15                  // pwm phase 3, Low
+#define ILIM_COMP   6                   // current limit comparator output, low = over current
+#define SPEED_IN    7                   // rc pulse or frequency speed input, pwm slice 3 B pin
+#define SPI_RX      16                  // spi0 slave: data from the master
+#define SPI_CS      17                  //   chip select, low for a whole frame
+#define SPI_SCK     18                  //   clock
+#define SPI_TX      19                  //   data to the master
+#define I2C_SDA     20                  // i2c0 slave data
+#define I2C_SCL     21                  // i2c0 slave clock
+#define VSENSE_SEL0 8                   // voltage sense mux select bit 0
+#define VSENSE_SEL1 9                   // voltage sense mux select bit 1
 #define POT_SPEED   26
 #define ADC_SPEED   0                   // adc0 is gpio26
+#define CURRENT     27                  // bus current shunt amplifier
+#define ADC_CURRENT 1                   // adc1 is gpio27
+#define VSENSE      28                  // voltage sense mux output
+#define ADC_VSENSE  2                   // adc2 is gpio28
+#define VSENSE_VBUS 0                   // mux inputs: bus voltage divider
+#define VSENSE_VA   1                   //   phase 1 back EMF divider
+#define VSENSE_VB   2                   //   phase 2 back EMF divider
+#define VSENSE_VC   3                   //   phase 3 back EMF divider
 
 /** -- Global constants -- */
 #define ALARM_INT_NUM   1               // alarm interrupt number
@@ -85,9 +137,256 @@
 #define COM_MAG_MAX     250             // maximum pwm modulation Index
 #define PWM_PRESCALER   25              // pwm timer prescaler
 
+// Commutation Angle
+#define SIN_BITS        8               // sine table has 2^SIN_BITS entries
+#define SIN_SIZE        (1u << SIN_BITS)
+#define SIN_SHIFT       (32 - SIN_BITS) // angle is 32-bit, full turn = 2^32
+#define ANGLE_90        0x40000000u     // quarter turn
+#define ANGLE_BENCH_N   1000            // calls per timing run
+
 // Speed Loop Compensation
 #define SPEED_CMD_MIN   50u              // min set speed value
-#define S_LOOP_COUNT_MAX 10             // speed loop update rate
+
+// Timer Wheel
+#define TW_TICK_US      100             // timer resolution
+#define TW_BITS         6               // slots per level = 2^TW_BITS
+#define TW_SLOTS        (1u << TW_BITS)
+#define TW_MASK         (TW_SLOTS - 1)
+#define TW_LEVELS       3               // range 2^(3 * TW_BITS) ticks = 26s, longer timers are re-cascaded
+#define TW_CATCHUP      4               // most ticks processed per call, bounds the ISR time
+#define TW_US(us)       (((us) + TW_TICK_US - 1) / TW_TICK_US) // ticks, rounded up
+#define TW_MS(ms)       TW_US((ms) * 1000u)
+
+// Event Log
+// Entry types - keep in step with EVENT_TYPES in tools/evlog.py
+#define EV_BOOT         1               // power on or reset
+#define EV_ILIM         2               // current limit trips in the last second (arg = count)
+#define EV_LOOP_TYPE    3               // loop type changed (arg = new type)
+#define EV_UI_CONTROL   4               // UI control changed (arg = 1 for UI)
+#define EV_MOTOR        5               // motor started or stopped (arg = 1 for start)
+#define EV_DIRECTION    6               // direction changed (arg = new direction)
+#define EV_SELFTEST     7               // power stage self-test (arg = failed switch bits, 0x40 = open phase)
+#define EV_SPEED_IN     8               // speed input signal (arg = 1 found, 0 lost)
+#define EV_SPI_LINK     9               // spi master control (arg = 1 taken, 0 released or lost)
+#define EV_I2C_LINK     10              // i2c host control (arg = 1 taken, 0 released)
+#define EV_DIAG         11              // vibration warning (arg = harmonics in warning, bit 0 = 1x)
+#define EVLOG_RAM_SIZE  64              // entries in the RAM ring, power of 2
+#define EVLOG_SECTORS   4               // flash sectors in the flash ring
+#define EVLOG_OFFSET    (PICO_FLASH_SIZE_BYTES - EVLOG_SECTORS * FLASH_SECTOR_SIZE)
+#define EVLOG_PER_PAGE  (FLASH_PAGE_SIZE / sizeof(evlog_entry))
+#define EVLOG_PAGES     (EVLOG_SECTORS * FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define EVLOG_CHECK     0xa5            // check byte seed
+
+// Event Bus
+#define EVT_DIRECTION   0               // direction changed (arg = new direction)
+#define EVT_UI_CONTROL  1               // UI control changed (arg = 1 for UI)
+#define EVT_MOTOR       2               // motor started or stopped (arg = 1 for start)
+#define EVT_LOOP_TYPE   3               // loop type changed (arg = new type)
+#define EVT_ILIM        4               // current limit trips in the last second (arg = count)
+#define EVT_SELFTEST    5               // power stage self-test done (arg = as EV_SELFTEST)
+#define EVT_SPEED_IN    6               // speed input signal (arg = 1 found, 0 lost)
+#define EVT_SPI_LINK    7               // spi master control (arg = 1 taken, 0 released or lost)
+#define EVT_I2C_LINK    8               // i2c host control (arg = 1 taken, 0 released)
+#define EVT_DIAG        9               // vibration warning (arg = harmonics in warning, bit 0 = 1x)
+#define EVT_COUNT       10
+#define BUS_QUEUE       8               // events per queue, power of 2
+#define BUS_PRIOS       2               // 0 = urgent, 1 = normal
+#define BUS_MAX_SUBS    2               // subscribers per event
+#define BUS_SRC_CORE0   0               // thread on core 0
+#define BUS_SRC_CORE1   1               // thread on core 1
+#define BUS_SRC_PWM     2               // pwm_isr and timer callbacks
+#define BUS_SRC_GPIO    3               // ilim_isr
+#define BUS_SRCS        4               // each source has its own queues, so posting takes no lock
+
+// Deferred Log
+#define DLOG_SIZE       32              // records in the RAM ring, power of 2
+#ifndef DLOG_RAW
+#define DLOG_RAW        0               // 1 = print records as hex for tools/dlog.py
+#endif
+#define DLOG(...)       DLOG_(__VA_ARGS__, 0, 0, 0)
+#define DLOG_(fmt, a, b, c, ...) dlog_write(fmt, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c))
+
+// Transmit Queue
+#ifndef TX_DMA
+#define TX_DMA          (PICO_ON_DEVICE && LIB_PICO_STDIO_UART) // 1 = stdio output queued and sent by dma
+#endif
+#define TX_BUF_SIZE     2048            // bytes in the transmit ring, power of 2
+#define TX_DMA_IRQ      DMA_IRQ_1
+#define TX_IRQ_PRIORITY 0xc0            // below pwm_isr
+
+// Variable Watch
+#define WATCH_MAX       8               // variables in a watch frame
+#define WATCH_FRAMES    32              // frames in the RAM ring, power of 2
+
+// Parameter Registry
+#define UI_LINE         160             // longest UI command line
+#define PARAM_RO        1               // read only
+#define PARAM_STOPPED   2               // only set while the motor is stopped
+#define PARAM(var, min, max, flags) { #var, (void *)&(var), sizeof(var), flags, min, max }
+
+// Power Stage Self-test
+#define ST_PULSE_US     250             // high side on time, 2.7 x back EMF filter time constant
+#define ST_LOW_US       20              // low side on time, limits the winding current
+#define ST_DECAY_US     400             // wait for phase voltages and currents to decay
+#define ST_VBUS_MIN     40              // bus voltage reading needed to run the test
+#define ST_I_NOISE      8               // current rise allowed with one switch on
+#define ST_I_MIN        4               // current rise expected through a winding
+#define ST_I_MAX        120             // current rise through a winding that means a short
+#define ST_PASS         0               // self-test results per switch
+#define ST_NOT_TESTED   1
+#define ST_NO_VOLTAGE   2
+#define ST_SHOOT_THROUGH 3
+#define ST_NO_CURRENT   4
+#define ST_OVER_CURRENT 5
+
+// Six-step Commutation
+#define COM_FULL        (COM_MAG_MAX + 1) // pwm level for a switch on all period
+#define ANGLE_DEG(d)    ((uint32_t)(d) * 11930465u) // electrical degrees to angle
+#define ADVANCE_DEG     10              // fixed commutation advance, electrical degrees
+#define COM_ALIGN_STEP  4               // start up pair, pulls the rotor to where step 0 starts
+#define BEMF_LOCK       6               // zero crossings in a row that end the start ramp
+#define BEMF_RAMP_MAX   4               // start ramp limit, times start_rpm, before the start fails
+#define BEMF_WAIT       0               // floating phase not yet seen before its crossing this step
+#define BEMF_ARMED      1               //   seen before it
+#define BEMF_SEEN       2               //   crossed
+
+// Commutation Overlap
+#define OVL_MAX         16              // longest overlap, pwm periods
+#define OVL_PROBE       64              // one commutation in OVL_PROBE is left alone to time the decay
+#define OVL_GAIN        2               // duty counts per current count off the reference
+#define OVL_TRIM_MAX    64              // largest duty change either way
+
+// Current Update
+#define CUR_UPDATE_LOOP   0             // current loop in the function loop
+#define CUR_UPDATE_PWM    1             //   every pwm period, at the wrap
+#define CUR_UPDATE_DOUBLE 2             //   at the valley and the peak, centre-aligned pwm
+#define CUR_UPDATE_DEADBEAT 3           //   deadbeat at the valley, centre-aligned pwm
+#define CUR_UPDATE_MPC  4               //   finite control set mpc, one switching state a period
+#define PWM_MID_SLICE   4               // slice timing the peak update, its pins stay sio
+#define PWM_MID_START   ((COM_MAG_MAX + 2) / 2) // its counter at the start, so it wraps at the peak
+#define CF_MARGIN       0.52f           // crossover * loop delay, rad, for 60 degrees phase margin
+#define CF_Q            12              // fast current loop duty fraction bits
+#define MDL_Q           20              // current model fraction bits
+#define DB_OBS_SHIFT    3               // deadbeat model error observer gain, 1 / 2^n per period
+#define DB_DIST_MAX     8               // largest model error it corrects, counts per period
+#define MPC_STATES      7               // six phase pairs fully on, and the pair freewheeling
+#define MPC_FREEWHEEL   6               //   high side off, low side of the last pair on
+#define MPC_LAMBDA      2               // cost of each switch changed, current counts
+
+// Advance Optimizer
+#define ADV_PERIOD_MS   500             // one perturb and observe step
+#define ADV_STEP_DEG    1               // perturbation, electrical degrees
+#define ADV_MIN_DEG     0               // bounds of the search
+#define ADV_MAX_DEG     25              //   the zero crossing leaves the step at 30
+#define ADV_MIN_SAMPLES 256             // current samples for a valid observation
+#define ADV_SPEED_TOL   1               // measured speed off speed_cmd that is still steady, counts
+#define ADV_PHASE_TOL   3               // mean phase error at the crossings for a valid step, degrees
+
+// Pulse-by-pulse Current Limit
+#define ILIM_RATIO      2               // adc current limit as a multiple of rated current
+#define PWM_FREQ        (1000000 / PWM_PERIOD) // pwm periods per second
+
+// Motor Profiles
+#define CURRENT_COUNTS_PER_A 38.8f      // 50mR shunt, gain 10, 3.3V / 256 counts
+#define VBUS_COUNTS_PER_V 4.f           // adc_vbus counts per volt
+#define MOTOR_PROFILE   0               // profile loaded at start up
+#define MOTOR_PROFILES  (sizeof(motor_profiles) / sizeof(motor_profiles[0]))
+
+// Speed Input
+#define SPEED_SRC_POT   0               // speed or current command from the pot
+#define SPEED_SRC_RC    1               //   from a 1-2ms rc servo pulse on SPEED_IN
+#define SPEED_SRC_FREQ  2               //   from a frequency on SPEED_IN
+#define SPEED_SRC_UI    3               //   from the UI (handover only, set by ui_control)
+#define SPEED_SRC_SPI   4               //   from the spi master (handover only, set by spi_control)
+#define SPEED_SRC_I2C   5               //   from the i2c host (handover only, set by i2c_control)
+#define SPEED_SRC       SPEED_SRC_POT   // start up source
+#define RC_CLKDIV       125.f           // slice counts 1us while the pulse is high at 125MHz
+#define RC_SAMPLE_US    1000            // pulse check period, less than the gap between pulses
+#define RC_MIN_US       1000            // pulse width for command 0
+#define RC_MAX_US       2000            // pulse width for command 255
+#define RC_VALID_MIN_US 800             // pulses outside this range are ignored
+#define RC_VALID_MAX_US 2200
+#define FREQ_WINDOW_MS  100             // edge counting window
+#define FREQ_MAX_HZ     1000            // frequency for command 255
+#define SPEED_IN_TIMEOUT_MS 250         // no valid input for this long = signal lost
+
+// SPI Link
+#ifndef SPI_LINK
+#define SPI_LINK        PICO_ON_DEVICE  // 1 = spi0 slave exchanging setpoint and state frames
+#endif
+#define SPI_FRAME       20              // bytes each way per frame
+#define SPI_MAGIC       0xa5            // first byte of every frame
+#define SPI_BAUD        4000000         // highest master clock expected
+#define SPI_DMA_IRQ     DMA_IRQ_0       // tx queue has DMA_IRQ_1
+#define SPI_TIMEOUT_US  20000           // no good frame for this long = link lost
+#define SPI_CONTROL     0x01            // command flags: master has control
+#define SPI_SPEED_LOOP  0x02            //   speed loop, else torque
+#define SPI_ST_CONTROL  0x01            // reply status: master has control
+#define SPI_ST_SPEED    0x02            //   speed loop
+#define SPI_ST_REV      0x04            //   direction reverse
+#define SPI_ST_SLEWING  0x08            //   setpoint handover in progress
+#define SPI_F_ILIM      0x01            // reply faults: current limit tripped in the last second
+#define SPI_F_SPEED_IN  0x02            //   speed input signal lost
+#define SPI_F_LINK      0x04            //   bad frames since the last good one
+
+// I2C Register Map
+#ifndef I2C_LINK
+#define I2C_LINK        PICO_ON_DEVICE  // 1 = i2c0 slave with the register map below
+#endif
+#define I2C_ADDR        0x42            // 7-bit slave address
+#define I2C_BAUD        400000          // fast mode
+#define I2C_IRQ_PRIORITY 0xc0           // below pwm_isr, so state_snapshot() never waits on it
+#define I2C_ID          0xb1            // I2C_REG_ID value
+#define I2C_REG_ID      0x00            // ro  identifies the register map
+#define I2C_REG_CONTROL 0x01            // rw  I2C_CTL_ bits
+#define I2C_REG_CMD     0x02            // rw  speed or current setpoint, 0-255
+#define I2C_REG_DIR     0x03            // rw  direction, FWD or REV
+#define I2C_REG_STATUS  0x04            // ro  I2C_ST_ bits; from here on one snapshot per read
+#define I2C_REG_FAULTS  0x05            // ro  I2C_F_ bits
+#define I2C_REG_SPEED   0x06            // ro  speed
+#define I2C_REG_VBUS    0x07            // ro  bus voltage adc
+#define I2C_REG_CURRENT 0x08            // ro  bus current adc
+#define I2C_REG_SPEED_CMD 0x09          // ro  speed setpoint in use
+#define I2C_REG_CURRENT_CMD 0x0a        // ro  current setpoint in use
+#define I2C_REG_DUTY    0x0b            // ro  com_mag
+#define I2C_REG_ILIM    0x0c            // ro  current limit trips in the last second, max 255
+#define I2C_REG_TIME    0x0d            // ro  time_us_32() of the snapshot, 4 bytes little endian
+#define I2C_REGS        0x11
+#define I2C_CTL_HOST    0x01            // host has control of setpoint and direction
+#define I2C_CTL_RUN     0x02            //   motor run, needs a passed self-test
+#define I2C_CTL_SPEED   0x04            //   speed loop, else torque
+#define I2C_ST_HOST     0x01            // status: host has control
+#define I2C_ST_RUN      0x02            //   motor running
+#define I2C_ST_SPEED    0x04            //   speed loop
+#define I2C_ST_REV      0x08            //   direction reverse
+#define I2C_ST_SLEWING  0x10            //   setpoint handover in progress
+#define I2C_F_ILIM      0x01            // faults: current limit tripped in the last second
+#define I2C_F_SPEED_IN  0x02            //   speed input signal lost
+#define I2C_F_SELFTEST  0x04            //   self-test not passed, run refused
+
+// Vibration Diagnostics
+#ifndef DIAG
+#define DIAG            PICO_ON_DEVICE  // 1 = harmonic analysis on core 1
+#endif
+#define DIAG_N          256             // samples per window, one per function loop
+#define DIAG_HARMONICS  4               // Goertzel filters at 1x to 4x the mechanical frequency
+#define DIAG_CURRENT    0               // diag_signal: bus current
+#define DIAG_SPEED      1               //   speed
+#define DIAG_STEADY     16              // speed may change 1/16 over a window
+#define DIAG_FAST       2               // fast average, shift: 1/4 per window
+#define DIAG_SLOW       10              // baseline, shift: 1/1024 per window, minutes
+#define DIAG_WARMUP     64              // windows before the baseline is trusted
+#define DIAG_WARN_X4    8               // warn when fast > baseline * DIAG_WARN_X4 / 4
+#define DIAG_CLEAR_X4   6               //   clear when below baseline * DIAG_CLEAR_X4 / 4
+#define DIAG_FLOOR      (1 << 8)        // ignore amplitudes below 1 count (Q8)
+#define DIAG_POLL_MS    10              // core 1 checks for a window this often
+
+// Setpoint Handover
+#define HANDOVER_RATE   100             // setpoint slew rate during handover (counts per second)
+#define HANDOVER_PICKUP 1               // 1 = pot must pass the setpoint before it takes over
+
+// Current Loop Compensation
+#define CURRENT_CMD_MIN 0u              // min set current value
 
 
 /** -- Global variables -- */
@@ -97,9 +396,94 @@ unsigned char ui_control = 0;
 unsigned char ui_speed = 0;
 unsigned char ui_direction = FWD;
 #endif
+// Setpoint Handover
+unsigned int  handover_rate = HANDOVER_RATE; // setpoint slew rate (counts per second)
+unsigned char handover_pickup = HANDOVER_PICKUP; // wait for pot to pass the setpoint
+unsigned char handover_active = 0;      // setpoint is slewing to a new source
+unsigned char handover_src = SPEED_SRC_POT; // source in use at last update: SPEED_SRC_
+unsigned char pot_held = 0;             // pot has not yet passed the setpoint
+unsigned char pot_below = 0;            // pot was below the setpoint at handover
+int32_t handover_q8 = 0;                // slewing setpoint (value * 256)
+unsigned char input_cmd = SPEED_CMD_MIN; // latest pot or speed input reading
+// Speed Input
+unsigned char speed_src = SPEED_SRC;    // SPEED_SRC_POT, _RC or _FREQ
+unsigned char speed_in_mode = 0xff;     // source the slice is set up for
+unsigned char speed_in_cmd = 0;         // scaled input, 0-255
+unsigned char speed_in_ok = 0;          // valid input within SPEED_IN_TIMEOUT_MS
+uint16_t speed_in_count = 0;            // slice counter at the last reading
+uint16_t speed_in_width = 0;            // last valid rc pulse, us
+uint16_t speed_in_hz = 0;               // last frequency reading
+uint32_t speed_in_last = 0;             // tw_now of the last valid reading
+// SPI Link
+/** @brief  Frame from the master: setpoint and mode */
+typedef struct __attribute__((packed)) {
+  uint8_t magic;                        // SPI_MAGIC
+  uint8_t seq;                          // echoed in the reply
+  uint8_t flags;                        // SPI_CONTROL, SPI_SPEED_LOOP
+  uint8_t cmd;                          // speed or current setpoint, 0-255
+  uint8_t reserved[SPI_FRAME - 5];
+  uint8_t check;                        // bytes sum to zero
+} spi_cmd_frame;
+/** @brief  Frame to the master: state from the last pwm period */
+typedef struct __attribute__((packed)) {
+  uint8_t  magic;                       // SPI_MAGIC
+  uint8_t  seq;                         // seq of the last frame applied
+  uint8_t  status;                      // SPI_ST_
+  uint8_t  faults;                      // SPI_F_
+  uint32_t time;                        // time_us_32() of the pwm period
+  uint16_t ilim_trips_per_sec;
+  uint16_t latency_us;                  // last frame end to apply in pwm_isr
+  uint8_t  speed;
+  uint8_t  adc_vbus;
+  uint8_t  adc_current;
+  uint8_t  speed_cmd;
+  uint8_t  current_cmd;
+  uint8_t  com_mag;
+  uint8_t  com_step;
+  uint8_t  check;                       // bytes sum to zero
+} spi_reply_frame;
+spi_cmd_frame spi_rx;                   // filled by the rx dma channel
+spi_cmd_frame spi_frame;                // last good frame, waiting for pwm_isr
+spi_reply_frame spi_tx[2];              // one being sent, one being filled
+unsigned char spi_tx_busy = 0;          // spi_tx buffer armed on the tx dma channel
+volatile unsigned char spi_pending = 0; // spi_frame not applied yet
+unsigned char spi_control = 0;          // master has control
+unsigned char spi_cmd = 0;              // master setpoint
+unsigned char spi_seq = 0;              // seq of the last frame applied
+unsigned char spi_bad_since = 0;        // bad frames since the last good one
+uint spi_rx_chan, spi_tx_chan;
+uint32_t spi_frame_time;                // time_us_32() at the end of spi_frame
+uint32_t spi_last;                      // time of the last frame applied
+uint32_t spi_good, spi_bad, spi_resyncs, spi_timeouts;
+uint32_t spi_lat_sum, spi_lat_max;      // frame end to apply, us
+uint16_t spi_lat_last;
+uint32_t spi_isr_cycles, spi_isr_max;   // spi_dma_isr cost, SysTick cycles
+// I2C Register Map
+uint8_t i2c_reg[I2C_REGS] = { [I2C_REG_ID] = I2C_ID, [I2C_REG_DIR] = FWD };
+uint8_t i2c_stage[I2C_REG_STATUS];      // rw registers written in this transaction
+uint8_t i2c_staged = 0;                 // bit per register in i2c_stage
+uint8_t i2c_ptr = 0;                    // register for the next byte
+unsigned char i2c_reading = 0;          // snapshot taken for this read
+volatile unsigned char i2c_written = 0; // rw registers changed, for i2c_apply()
+unsigned char i2c_control = 0;          // host has control
+unsigned char i2c_cmd = 0;              // host setpoint
+uint32_t i2c_transactions = 0;          // stop conditions seen
+// Vibration Diagnostics
+uint8_t diag_buf[2][DIAG_N];            // filled by pwm_isr, analysed on core 1
+uint32_t diag_step[2][2];               // angle_step at the start and end of each window
+uint16_t diag_fill_n = 0;               // samples in the buffer being filled
+uint8_t diag_fill = 0;                  // buffer pwm_isr is filling
+volatile int8_t diag_full = -1;         // buffer waiting for core 1, -1 = none
+unsigned char diag_signal = DIAG_CURRENT; // DIAG_CURRENT or DIAG_SPEED
+uint32_t diag_amp[DIAG_HARMONICS];      // last window amplitude, counts Q8
+uint32_t diag_fast[DIAG_HARMONICS];     // recent average
+uint32_t diag_base[DIAG_HARMONICS];     // long term baseline
+uint8_t diag_warn = 0;                  // harmonics in warning, bit 0 = 1x
+unsigned char diag_trend_signal = DIAG_CURRENT; // signal the trends are for
+uint32_t diag_windows, diag_skipped, diag_dropped;
+uint32_t diag_cycles;                   // core 1 cost of the last window
 // LED variables
-unsigned int  blink = 0;				        // LED blink
-unsigned char blink_count = 0;			    // prevents double blinking
+unsigned char blink_count = 0;			    // led phase: 0 = off, 1 = on
 // Direction Switch
 unsigned char direction_sw = 0;		      // direction switch value
 unsigned char direction_count = 128;	  // Counter for Direction Switch Filter
@@ -107,22 +491,411 @@ unsigned char direction = 0;			      // desired direction
 
 // PWM and Duty Cycle control
 unsigned char com_mag = COM_MAG_MIN;	  // pwm modulation Index
+unsigned char com_step = 0;             // commutation step
+volatile unsigned char motor_on = 0;    // motor has been started
+
+// Event Log
+/** @brief  Event log entry - 16 bytes, 16 to a flash page */
+typedef struct {
+  uint32_t time;                        // time_us_32() when logged
+  uint16_t seq;                         // RAM: index + 1 when complete, flash: sequence
+  uint8_t  type;                        // EV_ type
+  uint8_t  arg;                         // type specific value
+  uint8_t  com_step;
+  uint8_t  direction;
+  uint8_t  speed;
+  uint8_t  adc_vbus;
+  uint8_t  adc_current;
+  uint8_t  com_mag;
+  uint8_t  speed_cmd;
+  uint8_t  check;                       // EVLOG_CHECK ^ all other bytes
+} evlog_entry;
+/** @brief  Drive state logged with an event, taken when it happens */
+typedef struct {
+  uint8_t  com_step;
+  uint8_t  direction;
+  uint8_t  speed;
+  uint8_t  adc_vbus;
+  uint8_t  adc_current;
+  uint8_t  com_mag;
+  uint8_t  speed_cmd;
+} evlog_state;
+evlog_entry evlog_ram[EVLOG_RAM_SIZE];  // RAM ring written from any context
+volatile uint32_t evlog_head = 0;       // next RAM index to reserve
+volatile uint32_t evlog_tail = 0;       // next RAM index to flush
+unsigned int  evlog_dropped = 0;        // entries lost to a full RAM ring
+evlog_entry evlog_page[EVLOG_PER_PAGE]; // flash page being filled
+unsigned int  evlog_page_num = 0;       // flash page being filled
+unsigned int  evlog_page_fill = 0;      // entries in evlog_page
+bool evlog_page_new = true;             // evlog_page has not been programmed yet
+uint16_t evlog_seq = 0;                 // next flash sequence number
+volatile bool evlog_fault = false;      // a fault entry waits in the RAM ring
+
+// Event Bus
+/** @brief  Bus event */
+typedef struct {
+  uint32_t time;                        // time_us_32() when posted
+  uint32_t arg;                         // event specific value
+  uint8_t  id;                          // EVT_ id
+  evlog_state state;                    // drive state when posted, for the event log
+} bus_event;
+/** @brief  Single producer, single consumer event queue */
+typedef struct {
+  volatile uint32_t head;               // written by the source only
+  volatile uint32_t tail;               // written by bus_dispatch() only
+  uint32_t dropped;                     // events lost to a full queue
+  bus_event ev[BUS_QUEUE];
+} bus_queue;
+/** @brief  Dispatch statistics of one event */
+typedef struct {
+  uint32_t count;
+  uint32_t latency_sum;                 // us from post to dispatch
+  uint32_t latency_max;
+} bus_stat;
+bus_queue bus_q[BUS_PRIOS][BUS_SRCS];
+bus_stat bus_stats[EVT_COUNT];
+unsigned int  bus_bad_source = 0;       // posts from a context with no queue
+unsigned int  bus_bad_id = 0;           // posts with an id past EVT_COUNT
+unsigned char bus_trace = 0;            // 1 = DLOG every event
+
+// Deferred Log
+/** @brief  Deferred log record - formatted later by dlog_flush() or tools/dlog.py */
+typedef struct {
+  const char *volatile fmt;             // format string in flash, NULL while free or being written
+  uint32_t time;                        // time_us_32() when logged
+  uint32_t arg[3];                      // integer arguments
+} dlog_record;
+dlog_record dlog_ring[DLOG_SIZE];       // RAM ring written from any context
+volatile uint32_t dlog_head = 0;        // next ring index to reserve
+volatile uint32_t dlog_tail = 0;        // next ring index to format
+unsigned int  dlog_dropped = 0;         // records lost to a full ring
+
+// Transmit Queue
+char tx_buf[TX_BUF_SIZE];               // stdio output waiting to be sent
+volatile uint32_t tx_head = 0;          // next byte to write
+volatile uint32_t tx_tail = 0;          // next byte to send on the uart
+volatile uint32_t tx_dma_len = 0;       // bytes in the running dma transfer, 0 = idle
+uint32_t tx_usb_tail = 0;               // next byte to send on usb
+int tx_dma_chan = -1;
+volatile uint32_t tx_dma_start = 0;     // time_us_32() when the running transfer started
+volatile uint32_t tx_sent = 0;          // bytes sent on the uart
+volatile uint32_t tx_active_us = 0;     // time the dma has been sending
+uint32_t tx_queued = 0;                 // bytes written to the ring
+uint32_t tx_cpu_cycles = 0;             // cpu cycles spent queueing and in tx_dma_isr
+unsigned int  tx_stalls = 0;            // writes that waited for room in the ring
+
+// Power Stage Self-test
+unsigned char selftest_result[6];       // ST_ result for 1H, 1L, 2H, 2L, 3H, 3L
+unsigned char selftest_open = 0;        // phases with no voltage through the motor, bit 0 = phase 1
+unsigned char selftest_ok = 0;          // all switches and phases passed
+uint32_t selftest_us = 0;               // time taken by the last self-test
+
+// Motor Profiles
+/** @brief  Motor data and tuning, in engineering units */
+typedef struct {
+  const char *name;
+  uint8_t pole_pairs;
+  float ke;                             // back EMF V/rad/s, per phase peak
+  float r;                              // phase resistance, ohm
+  float l;                              // phase inductance, H
+  float rated_current;                  // A
+  float rated_speed;                    // rpm, speed command 255
+  float align_duty;                     // start up: rotor alignment duty 0-1
+  uint16_t align_ms;                    //   alignment time
+  uint16_t start_rpm;                   //   open loop ramp start speed
+  uint16_t ramp_rpm_s;                  //   open loop ramp rate
+  float speed_kp;                       // duty per 1000 rpm error
+  float speed_ki;                       // duty per 1000 rpm error per second
+  float current_kp;                     // duty per A error
+  float current_ki;                     // duty per A error per second
+} motor_profile;
+
+const motor_profile motor_profiles[] = {
+  // Application board motor. R and L are PLACEHOLDERS, typical for its size - the data
+  // sheet has neither. cur_update 1-4 take their gains and models from them, so
+  // measure them (line to line with the rotor still, halved) before relying on those
+  { "45ZWN24-30", 2, 0.0410f, 1.6f, 0.0012f, 2.0f, 3200.f,
+    0.15f, 200, 300, 2000, 0.08f, 16.f, 0.08f, 16.f },
+  // Generic examples - replace with the data for your motors
+  { "Generic 24V 8P", 4, 0.0300f, 0.8f, 0.0006f, 4.0f, 4000.f,
+    0.10f, 300, 200, 1500, 0.06f, 12.f, 0.05f, 12.f },
+  { "Generic 12V 2P", 1, 0.0150f, 0.4f, 0.0002f, 3.0f, 8000.f,
+    0.12f, 100, 600, 4000, 0.05f, 10.f, 0.04f, 20.f },
+};
+
+/** @brief  Control constants derived from the loaded profile */
+typedef struct {
+  const motor_profile *profile;
+  int32_t s_kp;                         // speed loop gains, duty * 256 per speed count
+  int32_t s_ki;
+  int32_t c_kp;                         // current loop gains, duty * 256 per current count
+  int32_t c_ki;
+  unsigned char ilim_adc;               // adc current reading that also trips the limit
+  uint32_t step_per_count;              // angle_step per speed count
+  uint32_t align_periods;               // start up alignment time in pwm periods
+  unsigned char align_mag;              // start up alignment duty
+  uint32_t start_step;                  // angle_step at start_rpm
+  uint32_t ramp_step;                   // angle_step increase per pwm period * 256
+  int32_t cf_kp_v;                      // fast current loop gains * adc_vbus, updates every period
+  int32_t cf_ki_v;
+  int32_t mdl_kv;                       // current change over half a period, counts << MDL_Q,
+  int32_t mdl_kr;                       //   per duty count * adc_vbus, per current count
+  int32_t mdl_ke;                       //   and per angle_step >> 12 of back EMF
+  int32_t start_ke;                     // start ramp duty * adc_vbus per angle_step >> 12
+} motor_params;
+
+motor_params motor;                     // loaded by motor_load()
+unsigned char motor_index = MOTOR_PROFILE;
+
+// Six-step Commutation
+unsigned char com_on = 0;               // bridge driven - follows motor_on in pwm_isr
+unsigned char com_dir = FWD;            // direction driven - direction when the bridge started
+uint32_t com_align = 0;                 // start up alignment periods left
+unsigned char com_locked = 0;           // past the start ramp, the regulators set the duty
+unsigned char advance_deg = ADVANCE_DEG; // fixed advance, and the optimizer's start
+uint32_t com_advance = ANGLE_DEG(ADVANCE_DEG); // advance in use, angle units
+/** @brief  Switches on in each commutation step: high side pwm phase, low side on phase */
+const uint8_t com_high[6] = { 0, 0, 1, 1, 2, 2 };
+const uint8_t com_low[6]  = { 1, 2, 2, 0, 0, 1 };
+
+// Commutation Overlap
+unsigned char ovl_enable = 0;           // hold the dc link current through commutations
+unsigned char ovl_len = 4;              // overlap in pwm periods, from the measured decay
+unsigned char ovl_t = 0xff;             // periods since the last commutation, 0xff = idle
+unsigned char ovl_probing = 0;          // this commutation times the natural decay
+unsigned char ovl_upset = 0;            // the probed current has left ovl_ref +-1/8
+unsigned char ovl_ref = 0;              // dc link current to hold, from ovl_avg_q4
+uint16_t ovl_avg_q4 = 0;                // average dc link current, Q4
+unsigned char ovl_count = 0;            // commutations, for OVL_PROBE
+uint16_t ovl_decay_q4 = 4 << 4;         // average decay periods, Q4
+
+// Current Update
+unsigned char cur_update = CUR_UPDATE_LOOP; // CUR_UPDATE_ mode, applied while stopped
+unsigned char pwm_mode = CUR_UPDATE_LOOP; // mode the slices are set up for
+int32_t cf_kp = 0;                      // fast current loop gains, duty << CF_Q per current count
+int32_t cf_ki = 0;                      //   for adc_vbus when the motor started
+int32_t cf_integral = COM_MAG_MIN << CF_Q;
+unsigned char cf_sample = 0;            // current at the last valley, mid pulse
+unsigned char cf_duty = 0;              // duty the slices latched there
+int32_t db_inv = 0;                     // deadbeat duty per model current change, 1 / (2 mdl_kv adc_vbus) << 24
+int32_t db_pred = 0;                    // current predicted for this valley, counts << MDL_Q
+int32_t db_dist = 0;                    // model error per period, counts << MDL_Q
+unsigned char mpc_lambda = MPC_LAMBDA;  // switching cost against current error
+unsigned char mpc_state = MPC_FREEWHEEL; // state the slices latched at the last wrap
+unsigned char mpc_pair = 0;             // commutation step of the last pair on
+unsigned char mpc_bits = 0;             // switches on, bit 2p = high of phase p, 2p + 1 = low
+int32_t mpc_i = 0;                      // pair current predicted for the last wrap, counts << MDL_Q
+uint32_t mpc_changes = 0;               // switches changed
+
+// Advance Optimizer
+unsigned char adv_enable = 0;           // perturb and observe the advance
+unsigned char adv_step = ADV_STEP_DEG;  // perturbation, electrical degrees
+unsigned char adv_min = ADV_MIN_DEG;    // search bounds, electrical degrees
+unsigned char adv_max = ADV_MAX_DEG;
+unsigned char adv_deg = ADVANCE_DEG;    // advance the optimizer has reached
+signed char adv_dir = 1;                // direction of the next perturbation
+unsigned char adv_state = 0;            // ADV_ state
+unsigned char adv_speed = 0;            // speed_cmd being optimized
+uint32_t adv_sum = 0, adv_n = 0;        // current samples this step
+uint32_t adv_speed_sum = 0;             // measured speed, same samples
+int32_t adv_phase_sum = 0;              // angle less the rotor's at each crossing, ANGLE_DEG >> 16
+uint32_t adv_phase_n = 0;               // crossings this step
+int32_t adv_phase = 0;                  // mean phase error of the last step, degrees Q8
+uint32_t adv_last = 0;                  // mean current of the last step, Q8
+uint32_t adv_fixed = 0;                 // mean current at advance_deg, Q8
+uint32_t adv_avg = 0;                   // average current while seeking, Q8
+int64_t adv_saved = 0;                  // current * vbus saved, counts Q8 * steps
+uint32_t adv_steps = 0;                 // steps with the optimizer running
+#define ADV_IDLE        0               // stopped, torque loop or disabled
+#define ADV_FIXED       1               // measuring the current at the fixed advance
+#define ADV_SEEK        2               // perturbing
+
+// Pulse-by-pulse Current Limit
+volatile unsigned char ilim_cut = 0;    // high side outputs forced off for this period
+volatile unsigned int ilim_trips = 0;   // trips counted in the present second
+unsigned int ilim_trips_per_sec = 0;    // trips in the last full second
+
+// Control Loop Selection
+unsigned char loop_type = LOOP_TYPE;    // 0 = torque control, 1 = speed control
+unsigned char loop_type_req = LOOP_TYPE; // requested loop type, applied by pwm_isr
+
+// Commutation Angle
+int16_t  sin_table[SIN_SIZE];           // Q15 sine, one full turn
+uint32_t angle_step = 0;                // electrical angle advance per pwm period
+uint32_t elec_angle = 0;                // electrical angle, wraps at 2^32
+uint32_t sw_angle = 0;                  // accumulator for software angle_update
+int16_t  elec_sin = 0;                  // sine of elec_angle
 
 // Back EMF Sensing
 unsigned char adc_vbus = 0;				      // bus voltage measurement (Neutral = 1/2*Vbus)
 unsigned char adc_vdc = 0;				      // bus voltage
 unsigned char adc_vbemf = 0;			      // back EMF voltage measurement
+unsigned char bemf_enable = 1;          // commutate from the floating phase's zero crossings
+unsigned char bemf_active = 0;          // sensing this run, not with cur_update 4
+unsigned char bemf_step = 0;            // commutation step being watched
+unsigned char bemf_armed = BEMF_WAIT;   // BEMF_ state of the floating phase
+unsigned char bemf_good = 0;            // crossings in a row, up to BEMF_LOCK
+int32_t bemf_prev = 0;                  // last reading before the crossing, 12-bit less half Vbus
+uint32_t bemf_t = 0;                    // pwm periods since the last crossing was seen
+uint32_t bemf_late = 0;                 // periods it was seen after it happened, Q8
+uint32_t bemf_span[2] = { 0, 0 };       // last two crossing intervals, periods Q8
+unsigned int bemf_lost = 0;             // runs stopped: no lock on the start ramp, or lost after
 // Speed Sensing and Command
 unsigned char speed_cmd = SPEED_CMD_MIN;     // set speed
 unsigned char speed = 0;                // speed
 
 // Speed Loop Compensation
-unsigned int  s_loop_count = 0;			    // Counter for speed loop functions update rate
+volatile unsigned char pot_due = 1;     // time to read the potentiometer again
+int32_t s_integral = COM_MAG_MIN << 8;  // speed loop integrator (duty * 256)
+
+// Current Sensing and Command
+unsigned char adc_current = 0;          // bus current measurement
+unsigned char current_cmd = CURRENT_CMD_MIN; // set current
+int32_t c_integral = COM_MAG_MIN << 8;  // current loop integrator (duty * 256)
+
+// Variable Watch
+/** @brief  Watch frame - sampled by pwm_isr, sent by watch_send() */
+typedef struct {
+  uint32_t time;                        // time_us_32() when sampled
+  uint32_t value[WATCH_MAX];            // zero extended
+} watch_frame;
+const volatile void *watch_addr[WATCH_MAX]; // variables to sample
+uint8_t watch_size[WATCH_MAX];          // 1, 2 or 4 bytes
+volatile uint8_t watch_count = 0;       // variables in use, 0 = watch stopped
+unsigned int  watch_div = 1;            // sample every watch_div pwm periods
+unsigned int  watch_tick = 0;           // pwm periods since the last sample
+watch_frame watch_ring[WATCH_FRAMES];   // written by pwm_isr, read by main()
+volatile uint32_t watch_head = 0;       // next frame to sample
+volatile uint32_t watch_tail = 0;       // next frame to send
+unsigned int  watch_dropped = 0;        // samples lost to a full ring
 
 // Function Loop Updates
-unsigned char pwm_count = 0;				    // count pwm interrupts per loop
-unsigned char pwm_step = 0; 		        // loop sequence step
+unsigned char pwm_step = 0; 		        // loop sequence step, restarted by loop_timer
+
+// Timer Wheel
+/** @brief  Software timer - statically allocated by its owner, see timer_start() */
+typedef struct sw_timer {
+  struct sw_timer *next;
+  struct sw_timer **pprev;              // link to this timer, NULL when not running
+  uint32_t expires;                     // tw_now when it fires
+  uint32_t period;                      // ticks, 0 = one shot
+  void (*fn)(void);                     // called from pwm_isr
+} sw_timer;
+sw_timer *tw_slot[TW_LEVELS][TW_SLOTS]; // level 0 by tick, levels 1 and 2 by 2^TW_BITS ticks
+uint32_t tw_now = 0;                    // ticks since init_timers(), the monotonic timebase
+uint32_t tw_last_us = 0;                // time_us_32() of tick tw_now
+sw_timer loop_timer;                    // restarts the function loop
+sw_timer blink_timer;
+sw_timer dir_timer;
+sw_timer pot_timer;
+sw_timer ilim_timer;                    // current limit trips per second
+sw_timer speed_in_timer;                // speed input sampling
+sw_timer advance_timer;                 // commutation advance optimizer
+
+// ISR Shared State
+/** @brief  State published by pwm_isr for main() and core 1 - read with state_snapshot() */
+typedef struct __attribute__((packed)) {
+  uint32_t time;                        // time_us_32() when published
+  uint16_t ilim_trips_per_sec;
+  uint8_t  speed_cmd;
+  uint8_t  current_cmd;
+  uint8_t  speed;
+  uint8_t  adc_vbus;
+  uint8_t  adc_current;
+  uint8_t  com_mag;
+  uint8_t  com_step;
+  uint8_t  direction;
+  uint8_t  loop_type;
+  uint8_t  handover;                    // 0 = done, 1 = slewing, 2 = waiting for pot
+} isr_state;
+isr_state state_pub;                    // written only by state_publish()
+volatile uint32_t state_seq = 0;        // odd while state_pub is being written
+
+// Parameter Registry
+/** @brief  Named parameter for get and set from the UI - signed if min < 0 */
+typedef struct {
+  const char *name;
+  void *addr;
+  uint8_t size;                         // 1, 2 or 4 bytes
+  uint8_t flags;                        // PARAM_ flags
+  int32_t min;
+  int32_t max;
+} param_def;
+
+// Adding a line here is all that is needed to make a variable tunable,
+// then run tools/param_hash.py to regenerate the hash below
+const param_def params[] = {
+  PARAM(ui_speed,            0, 255,    0),
+  PARAM(ui_direction,        0, 1,      0),
+  PARAM(loop_type_req,       0, 1,      0),
+  PARAM(handover_rate,       1, 10000,  0),
+  PARAM(handover_pickup,     0, 1,      0),
+  PARAM(motor.s_kp,          0, 65535,  0),
+  PARAM(motor.s_ki,          0, 65535,  0),
+  PARAM(motor.c_kp,          0, 65535,  0),
+  PARAM(motor.c_ki,          0, 65535,  0),
+  PARAM(motor.ilim_adc,      1, 255,    PARAM_STOPPED),
+  PARAM(watch_div,           1, 20000,  0),
+  PARAM(bus_trace,           0, 1,      0),
+  PARAM(speed_src,           0, 2,      0),
+  PARAM(diag_signal,         0, 1,      0),
+  PARAM(advance_deg,         0, 25,     0),
+  PARAM(ovl_enable,          0, 1,      0),
+  PARAM(ovl_len,             0, 0,      PARAM_RO),
+  PARAM(cur_update,          0, 4,      PARAM_STOPPED),
+  PARAM(mpc_lambda,          0, 64,     0),
+  PARAM(adv_enable,          0, 1,      0),
+  PARAM(adv_step,            1, 10,     0),
+  PARAM(adv_min,             0, 25,     0),
+  PARAM(adv_max,             0, 25,     0),
+  PARAM(adv_deg,             0, 0,      PARAM_RO),
+  PARAM(bemf_enable,         0, 1,      PARAM_STOPPED),
+  PARAM(com_locked,          0, 0,      PARAM_RO),
+  PARAM(bemf_lost,           0, 0,      PARAM_RO),
+  PARAM(diag_warn,           0, 0,      PARAM_RO),
+  PARAM(speed_in_cmd,        0, 255,    PARAM_RO),
+  PARAM(speed_in_width,      0, 0,      PARAM_RO),
+  PARAM(speed_in_hz,         0, 0,      PARAM_RO),
+  PARAM(speed,               0, 255,    PARAM_RO),
+  PARAM(speed_cmd,           0, 255,    PARAM_RO),
+  PARAM(current_cmd,         0, 255,    PARAM_RO),
+  PARAM(com_mag,             0, 255,    PARAM_RO),
+  PARAM(adc_vbus,            0, 255,    PARAM_RO),
+  PARAM(adc_current,         0, 255,    PARAM_RO),
+  PARAM(motor_index,         0, 255,    PARAM_RO),
+  PARAM(selftest_ok,         0, 1,      PARAM_RO),
+  PARAM(ilim_trips_per_sec,  0, 0,      PARAM_RO),
+  PARAM(evlog_dropped,       0, 0,      PARAM_RO),
+  PARAM(dlog_dropped,        0, 0,      PARAM_RO),
+  PARAM(tx_stalls,           0, 0,      PARAM_RO),
+  PARAM(watch_dropped,       0, 0,      PARAM_RO),
+};
+#define PARAMS          (sizeof(params) / sizeof(params[0]))
+
+// -- Generated by tools/param_hash.py from params[], do not edit --
+#define PARAM_SEED      0x811ca161u
+#define PARAM_HASH_BITS 7
+const int8_t param_slot[1 << PARAM_HASH_BITS] = { // index in params[], -1 = empty
+  -1,  2, 31, -1, -1, -1, -1, -1, -1, 39, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, 23, -1, -1, -1,  1, -1, 22, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, 21, -1, 33,  4, 37, -1, -1, 18, 40,
+  -1, -1, 14, -1, -1, -1, -1, 42, -1, -1, 38,  8, -1, -1, 27,  7,
+  -1, -1, 17, 10, -1, -1, -1,  3, 25, -1, 32, -1, -1, 12, -1, -1,
+  30, -1, 34, -1, 13, 24, -1, 16, -1,  9, -1, -1, -1, -1, -1, -1,
+  -1,  0, -1, -1, -1, -1,  5, 28, -1, -1, -1, -1, 20, 36, -1, -1,
+  -1,  6, 19, 29, -1, 15, 35, -1, 43, 26, -1, -1, -1, -1, 41, 11
+};
+// -- End of generated code --
+
 
+/** @brief  init_systick - Free run this core's SysTick at the processor clock
+ *
+ *  Each core has its own SysTick; cycle counts take (t0 - SYST_CVR) & 0x00ffffff
+ */
+void init_systick(void) {
+  SYST_RVR = 0x00ffffff;
+  SYST_CSR = 5;                         // processor clock, no interrupt, enabled
+}
 
 /** @brief  init_in - Switch setup
  *
@@ -134,170 +907,3034 @@ void init_in(void) {
   gpio_set_pulls(SW_DIR, 1, 0);         // set pullup
 }
 
-/** @brief init_led - LED setup
+/** @brief init_led - LED setup
+ *
+ *  Use pico sdk function to initialise pins
+ *  Delete led on/off functions - use gpio_put(led, state)
+ */
+void init_led(void) {                   // need to set up pins before using them
+  gpio_init(LED_YEL);
+  gpio_set_dir(LED_YEL, GPIO_OUT);
+  gpio_init(LED_GRN);
+  gpio_set_dir(LED_GRN, GPIO_OUT);
+  gpio_init(LED_RED);
+  gpio_set_dir(LED_RED, GPIO_OUT);
+}
+
+/**
+ *  @brief  init_analog - Enable analog channels and set up ADC
+ *
+ *  Analog Channels are
+ *  Back EMF Signals VA(PB0/ANA0), VB(PB1/ANA1), and VC(PB2/ANA2)
+ *  Current signal (PB3/ANA3)
+ *  DC bus voltage V+ (PB4/ANA4)
+ *  Speed or Torque Command Potentiometer (PB6/ANA6)
+ *  The Pico only brings out three ADC inputs, so on the Pico:
+ *  ADC0 potentiometer, ADC1 current, ADC2 4:1 mux of V+, VA, VB and VC
+ */
+void init_analog(void) {
+  /*
+	PBAF0 |= 0x5F;			// 0101 1111 Alternate Function PB0, PB1, PB2, PB3, PB4, PB6
+	PBAF1 &= 0xA0;			// 1010 0000 
+	ADCCTL0 = 0x30;			// 0011 0000 Enable Reference and ADC
+	ADCSST = 10;			// ADC Channels select Mux Settling Time 0.5us min, number of clock cycles
+	ADCST = 20;				// ADC Sample and Hold Settling Time 1us min, number of clock cycles
+	ADCCP = 0;				// ADC clock Prescaler
+  */
+  adc_init();                           // Make sure GPIO is high-impedance, no pullups etc
+  adc_gpio_init(POT_SPEED);             // Select ADC input 0 (POT_SPEED)
+  adc_gpio_init(CURRENT);               // Select ADC input 1 (CURRENT)
+  adc_gpio_init(VSENSE);                // Select ADC input 2 (VSENSE)
+  gpio_init(VSENSE_SEL0);               // voltage sense mux select
+  gpio_set_dir(VSENSE_SEL0, GPIO_OUT);
+  gpio_init(VSENSE_SEL1);
+  gpio_set_dir(VSENSE_SEL1, GPIO_OUT);
+}
+
+/**
+ *  @brief  alarm_isr - Alarm interrupt handler
+ *
+ *  Implement delay using alarm interrupt
+ *  Every interrupt toggles led
+ */
+void alarm_isr(){
+  ALARM1 = TIMELR + PWM_PERIOD;         // arm timer
+  INTR = 1 << ALARM_INT_NUM;            // clear interrupt
+}
+
+
+/**
+ *  @brief  evlog_capture - Take the drive state to log with an event
+ */
+static inline void evlog_capture(evlog_state *s) {
+  s->com_step = com_step;
+  s->direction = direction;
+  s->speed = speed;
+  s->adc_vbus = adc_vbus;
+  s->adc_current = adc_current;
+  s->com_mag = com_mag;
+  s->speed_cmd = speed_cmd;
+}
+
+/**
+ *  @brief  evlog_is_fault - Entry is a fault, flushed to flash even with the motor running
+ */
+static inline bool evlog_is_fault(unsigned char type, unsigned char arg) {
+  switch (type) {
+    case EV_ILIM:
+    case EV_SELFTEST:
+    case EV_DIAG:
+      return arg != 0;
+    case EV_SPEED_IN:
+    case EV_SPI_LINK:
+      return arg == 0;                  // lost, or the spi master let go
+    default:
+      return false;
+  }
+}
+
+/**
+ *  @brief  evlog_record - Log an event with the drive state taken when it happened
+ *
+ *  Safe from any context and O(1): a slot is reserved with interrupts held
+ *  off for a few instructions, then filled in, and marked complete by
+ *  writing its seq last, so nothing ever waits for another context
+ *  If the RAM ring is full the entry is dropped and counted
+ *
+ *  @param time  time_us_32() of the event
+ *  @param s     drive state from evlog_capture() at that time
+ */
+void evlog_record(unsigned char type, unsigned char arg, uint32_t time, const evlog_state *s) {
+  uint32_t irq = save_and_disable_interrupts();
+  uint32_t idx = evlog_head;
+  if (idx - evlog_tail >= EVLOG_RAM_SIZE) {
+    evlog_dropped++;
+    restore_interrupts(irq);
+    return;
+  }
+  evlog_head = idx + 1;
+  restore_interrupts(irq);
+
+  evlog_entry *e = &evlog_ram[idx & (EVLOG_RAM_SIZE - 1)];
+  e->time = time;
+  e->type = type;
+  e->arg = arg;
+  e->com_step = s->com_step;
+  e->direction = s->direction;
+  e->speed = s->speed;
+  e->adc_vbus = s->adc_vbus;
+  e->adc_current = s->adc_current;
+  e->com_mag = s->com_mag;
+  e->speed_cmd = s->speed_cmd;
+  __compiler_memory_barrier();
+  e->seq = (uint16_t)(idx + 1);         // complete
+  if (evlog_is_fault(type, arg)) {
+    evlog_fault = true;
+  }
+}
+
+/**
+ *  @brief  evlog_write - Log an event with a snapshot of the drive state now
+ */
+void evlog_write(unsigned char type, unsigned char arg) {
+  evlog_state s;
+  evlog_capture(&s);
+  evlog_record(type, arg, time_us_32(), &s);
+}
+
+/**
+ *  @brief  evlog_check - Check byte of a log entry
+ */
+static uint8_t evlog_check(const evlog_entry *e) {
+  const uint8_t *b = (const uint8_t *)e;
+  uint8_t check = EVLOG_CHECK;
+  uint i;
+  for (i = 0; i < sizeof(evlog_entry) - 1; ++i) {
+    check ^= b[i];
+  }
+  return check;
+}
+
+/**
+ *  @brief  evlog_flash_entry - Entry n of the flash ring, read through XIP
+ */
+static inline const evlog_entry *evlog_flash_entry(uint n) {
+  return (const evlog_entry *)(XIP_BASE + EVLOG_OFFSET) + n;
+}
+
+/**
+ *  @brief  evlog_valid - Entry holds a logged event rather than erased flash
+ */
+static inline bool evlog_valid(const evlog_entry *e) {
+  return e->type != 0xff && e->check == evlog_check(e);
+}
+
+/**
+ *  @brief  init_evlog - Find where the flash ring left off
+ *
+ *  Entries are written in sequence round the ring, so the newest is the
+ *  valid entry not followed by its successor
+ *  A part filled page is reloaded so it can be programmed again
+ */
+void init_evlog(void) {
+  uint n, total = EVLOG_PAGES * EVLOG_PER_PAGE, next = 0;
+  for (n = 0; n < total; ++n) {
+    const evlog_entry *e = evlog_flash_entry(n);
+    const evlog_entry *f = evlog_flash_entry((n + 1) % total);
+    if (evlog_valid(e) && !(evlog_valid(f) && f->seq == (uint16_t)(e->seq + 1))) {
+      evlog_seq = e->seq + 1;
+      next = (n + 1) % total;
+      break;
+    }
+  }
+  evlog_page_num = next / EVLOG_PER_PAGE;
+  evlog_page_fill = next % EVLOG_PER_PAGE;
+  evlog_page_new = (evlog_page_fill == 0);
+  memset(evlog_page, 0xff, sizeof(evlog_page));
+  memcpy(evlog_page, evlog_flash_entry(evlog_page_num * EVLOG_PER_PAGE),
+         evlog_page_fill * sizeof(evlog_entry));
+  evlog_write(EV_BOOT, 0);
+}
+
+/**
+ *  @brief  evlog_program - Program the page buffer into the flash ring
+ *
+ *  NOR flash bits only go from 1 to 0, so a part filled page can be
+ *  programmed again as more entries arrive - the unused slots stay 0xff
+ *  The sector is erased when the first entry goes into it, which moves
+ *  the ring on round the sectors and spreads the wear evenly
+ *  Flash is not readable while it is written, so interrupts are held off
+ *  and core 1 is paused. pwm_isr() cannot run meanwhile, so if the bridge
+ *  is driven its high sides are cut for the write, and the motor coasts
+ *  until ilim_release() gives them back in the next period
+ */
+static void evlog_program(void) {
+  uint32_t offset = EVLOG_OFFSET + evlog_page_num * FLASH_PAGE_SIZE;
+#if DIAG
+  bool core1 = multicore_lockout_victim_is_initialized(1);
+  if (core1) {
+    multicore_lockout_start_blocking(); // core 1 runs from flash too
+  }
+#endif
+  uint32_t irq = save_and_disable_interrupts();
+  if (com_on) {
+    gpio_set_outover(PWM_1H, GPIO_OVERRIDE_LOW);
+    gpio_set_outover(PWM_2H, GPIO_OVERRIDE_LOW);
+    gpio_set_outover(PWM_3H, GPIO_OVERRIDE_LOW);
+    ilim_cut = 1;                       // not a trip - the cut just ends the same way
+  }
+  if (evlog_page_new && (offset % FLASH_SECTOR_SIZE) == 0) {
+    flash_range_erase(offset, FLASH_SECTOR_SIZE);
+  }
+  evlog_page_new = false;
+  flash_range_program(offset, (const uint8_t *)evlog_page, FLASH_PAGE_SIZE);
+  restore_interrupts(irq);
+#if DIAG
+  if (core1) {
+    multicore_lockout_end_blocking();
+  }
+#endif
+}
+
+/**
+ *  @brief  evlog_flush - Move completed entries from the RAM ring to flash
+ *
+ *  Runs as a background task from the main loop, never from an ISR
+ *  Entries stay in RAM while the motor is running, until a fault is logged:
+ *  then everything up to it goes to flash at once, for a coast of a page
+ *  program, or of a sector erase when the ring moves on to a new sector.
+ *  Other entries logged during a run are lost if the power goes first
+ */
+void evlog_flush(void) {
+  bool dirty = false;
+  if (motor_on && !evlog_fault) {
+    return;
+  }
+  evlog_fault = false;
+  while (evlog_tail != evlog_head) {
+    evlog_entry *e = &evlog_ram[evlog_tail & (EVLOG_RAM_SIZE - 1)];
+    if (e->seq != (uint16_t)(evlog_tail + 1)) {
+      break;                            // still being written
+    }
+    evlog_entry *p = &evlog_page[evlog_page_fill++];
+    *p = *e;
+    p->seq = evlog_seq++;
+    p->check = evlog_check(p);
+    evlog_tail++;
+    dirty = true;
+    if (evlog_page_fill == EVLOG_PER_PAGE) {
+      evlog_program();
+      evlog_page_fill = 0;
+      evlog_page_num = (evlog_page_num + 1) % EVLOG_PAGES;
+      evlog_page_new = true;
+      memset(evlog_page, 0xff, sizeof(evlog_page));
+      dirty = false;
+    }
+  }
+  if (dirty) {
+    evlog_program();
+  }
+}
+
+/**
+ *  @brief  evlog_dump - Print the event log, oldest first
+ *
+ *  One line per entry: "E" and the 16 entry bytes in hex
+ *  Decode with tools/evlog.py
+ *  Entries not yet flushed (motor running) follow with "R"
+ */
+void evlog_dump(void) {
+  uint n, i, total = EVLOG_PAGES * EVLOG_PER_PAGE;
+  uint start = evlog_page_num * EVLOG_PER_PAGE + evlog_page_fill;
+  uint32_t idx;
+
+  evlog_flush();
+  printf("\nEVENT LOG:\n");
+  for (n = 0; n < total; ++n) {
+    const evlog_entry *e = evlog_flash_entry((start + n) % total);
+    if (evlog_valid(e)) {
+      printf("E ");
+      for (i = 0; i < sizeof(evlog_entry); ++i) {
+        printf("%02x", ((const uint8_t *)e)[i]);
+      }
+      printf("\n");
+    }
+  }
+  for (idx = evlog_tail; idx != evlog_head; ++idx) {
+    const evlog_entry *e = &evlog_ram[idx & (EVLOG_RAM_SIZE - 1)];
+    printf("R ");
+    for (i = 0; i < sizeof(evlog_entry); ++i) {
+      printf("%02x", ((const uint8_t *)e)[i]);
+    }
+    printf("\n");
+  }
+  printf("%-16s: %u\n", "Dropped", evlog_dropped);
+}
+
+/**
+ *  @brief  dlog_write - Log a message without formatting it
+ *
+ *  Use through DLOG(fmt, ...) with up to 3 integer arguments - no %s or %f
+ *  Only the format string address and the raw arguments are stored, so it
+ *  costs a few dozen cycles and is safe from any context, ISRs included
+ *  The slot is reserved like evlog_write() and marked complete by writing fmt last
+ */
+void dlog_write(const char *fmt, uint32_t a, uint32_t b, uint32_t c) {
+  uint32_t irq = save_and_disable_interrupts();
+  uint32_t idx = dlog_head;
+  if (idx - dlog_tail >= DLOG_SIZE) {
+    dlog_dropped++;
+    restore_interrupts(irq);
+    return;
+  }
+  dlog_head = idx + 1;
+  restore_interrupts(irq);
+
+  dlog_record *r = &dlog_ring[idx & (DLOG_SIZE - 1)];
+  r->time = time_us_32();
+  r->arg[0] = a;
+  r->arg[1] = b;
+  r->arg[2] = c;
+  __compiler_memory_barrier();
+  r->fmt = fmt;                         // complete
+}
+
+/**
+ *  @brief  dlog_flush - Format and print completed log records
+ *
+ *  Runs as a background task from the main loop, never from an ISR
+ *  With DLOG_RAW the records are printed as "L" lines of hex for
+ *  tools/dlog.py, which reads the format strings from the ELF file
+ */
+void dlog_flush(void) {
+  while (dlog_tail != dlog_head) {
+    dlog_record *r = &dlog_ring[dlog_tail & (DLOG_SIZE - 1)];
+    const char *fmt = r->fmt;
+    if (fmt == NULL) {
+      break;                            // still being written
+    }
+#if DLOG_RAW
+    printf("L %08lx %08lx %08lx %08lx %08lx\n", (unsigned long)(uintptr_t)fmt,
+           (unsigned long)r->time, (unsigned long)r->arg[0],
+           (unsigned long)r->arg[1], (unsigned long)r->arg[2]);
+#else
+    printf("[%10lu] ", (unsigned long)r->time);
+    printf(fmt, r->arg[0], r->arg[1], r->arg[2]);
+#endif
+    r->fmt = NULL;
+    __compiler_memory_barrier();
+    dlog_tail++;
+  }
+}
+
+/**
+ *  @brief  tx_service - Pass queued output to the TinyUSB cdc buffer
+ *
+ *  Runs as a background task. Only as much as the cdc buffer has room
+ *  for is passed on, so the usb stdio driver never waits
+ */
+void tx_service(void) {
+#if TX_DMA && LIB_PICO_STDIO_USB
+  uint32_t n = tx_head - tx_usb_tail;
+  if (!tud_cdc_connected()) {
+    tx_usb_tail += n;                   // nobody listening
+    return;
+  }
+  uint32_t pos = tx_usb_tail & (TX_BUF_SIZE - 1);
+  uint32_t room = tud_cdc_write_available();
+  if (n > TX_BUF_SIZE - pos) {
+    n = TX_BUF_SIZE - pos;
+  }
+  if (n > room) {
+    n = room;
+  }
+  if (n) {
+    stdio_usb.out_chars(&tx_buf[pos], n);
+    tx_usb_tail += n;
+  }
+#endif
+}
+
+#if TX_DMA
+/**
+ *  @brief  tx_dma_start_next - Send the next contiguous block of the ring
+ *
+ *  Call with interrupts disabled, or from tx_dma_isr
+ */
+static void tx_dma_start_next(void) {
+  uint32_t tail = tx_tail, n = tx_head - tail;
+  uint32_t room = TX_BUF_SIZE - (tail & (TX_BUF_SIZE - 1));
+  if (tx_dma_len || n == 0) {
+    return;
+  }
+  if (n > room) {
+    n = room;                           // rest goes when this block is done
+  }
+  tx_dma_len = n;
+  tx_dma_start = time_us_32();
+  dma_channel_transfer_from_buffer_now(tx_dma_chan, &tx_buf[tail & (TX_BUF_SIZE - 1)], n);
+}
+
+/**
+ *  @brief  tx_dma_isr - A dma block has gone to the uart, start the next
+ */
+void tx_dma_isr(void) {
+  uint32_t t0 = SYST_CVR;
+  dma_irqn_acknowledge_channel(TX_DMA_IRQ - DMA_IRQ_0, tx_dma_chan);
+  tx_active_us += time_us_32() - tx_dma_start;
+  tx_sent += tx_dma_len;
+  tx_tail += tx_dma_len;
+  tx_dma_len = 0;
+  tx_dma_start_next();
+  tx_cpu_cycles += (t0 - SYST_CVR) & 0x00ffffff;
+}
+
+/**
+ *  @brief  tx_room - Free bytes in the ring
+ *
+ *  USB output has its own tail, which is pulled along when nothing is
+ *  listening so a closed port does not hold up the uart
+ */
+static inline uint32_t tx_room(void) {
+  uint32_t used = tx_head - tx_tail;
+#if LIB_PICO_STDIO_USB
+  if (tx_head - tx_usb_tail > used) {
+    used = tx_head - tx_usb_tail;
+  }
+#endif
+  return TX_BUF_SIZE - used;
+}
+
+/**
+ *  @brief  tx_write - Queue bytes for the uart and usb, return without waiting for them to go
+ *
+ *  stdio out_chars, so every printf ends up here. Only waits if the ring
+ *  is full. Never call it from an ISR - use DLOG() there
+ */
+void tx_write(const char *buf, int len) {
+  while (len > 0) {
+    uint32_t room, n, pos, first, irq, t0;
+    if ((room = tx_room()) == 0) {
+      tx_stalls++;
+      while ((room = tx_room()) == 0) {
+        tight_loop_contents();          // tx_dma_isr and tx_service make room
+#if LIB_PICO_STDIO_USB
+        tx_service();
+#endif
+      }
+    }
+    t0 = SYST_CVR;
+    n = (uint32_t)len < room ? (uint32_t)len : room;
+    pos = tx_head & (TX_BUF_SIZE - 1);
+    first = TX_BUF_SIZE - pos < n ? TX_BUF_SIZE - pos : n;
+    memcpy(&tx_buf[pos], buf, first);
+    memcpy(tx_buf, buf + first, n - first);
+    irq = save_and_disable_interrupts();
+    tx_head += n;
+    tx_dma_start_next();
+    restore_interrupts(irq);
+    tx_queued += n;
+    buf += n;
+    len -= n;
+    tx_cpu_cycles += (t0 - SYST_CVR) & 0x00ffffff;
+  }
+}
+
+/**
+ *  @brief  tx_flush - Wait until the queue has been sent
+ */
+void tx_flush(void) {
+  while (tx_room() != TX_BUF_SIZE || tx_dma_len) {
+    tight_loop_contents();
+#if LIB_PICO_STDIO_USB
+    tx_service();
+#endif
+  }
+}
+
+/**
+ *  @brief  tx_read - stdio in_chars, reads the uart and usb directly
+ */
+static int tx_read(char *buf, int len) {
+  int n = 0;
+  while (n < len && uart_is_readable(uart_default)) {
+    buf[n++] = uart_getc(uart_default);
+  }
+#if LIB_PICO_STDIO_USB
+  if (n < len) {
+    int m = stdio_usb.in_chars(buf + n, len - n);
+    if (m > 0) {
+      n += m;
+    }
+  }
+#endif
+  return n ? n : PICO_ERROR_NO_DATA;
+}
+
+stdio_driver_t tx_stdio = {
+  .out_chars = tx_write,
+  .out_flush = tx_flush,
+  .in_chars = tx_read,
+#if PICO_STDIO_ENABLE_CRLF_SUPPORT
+  .crlf_enabled = PICO_STDIO_DEFAULT_CRLF,
+#endif
+};
+#endif
+
+/**
+ *  @brief  init_tx - Send stdio output through the transmit queue
+ *
+ *  Replaces the uart and usb stdio drivers with tx_stdio, which copies
+ *  output into tx_buf and lets a dma channel feed the uart
+ *  SysTick free runs to measure the cpu time spent on output
+ */
+void init_tx(void) {
+#if TX_DMA
+  init_systick();
+  tx_dma_chan = dma_claim_unused_channel(true);
+  dma_channel_config c = dma_channel_get_default_config(tx_dma_chan);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_read_increment(&c, true);
+  channel_config_set_write_increment(&c, false);
+  channel_config_set_dreq(&c, uart_get_dreq(uart_default, true));
+  dma_channel_configure(tx_dma_chan, &c, &uart_get_hw(uart_default)->dr, tx_buf, 0, false);
+  dma_irqn_set_channel_enabled(TX_DMA_IRQ - DMA_IRQ_0, tx_dma_chan, true);
+  irq_set_exclusive_handler(TX_DMA_IRQ, tx_dma_isr);
+  irq_set_priority(TX_DMA_IRQ, TX_IRQ_PRIORITY);
+  irq_set_enabled(TX_DMA_IRQ, true);
+  stdio_flush();
+  stdio_set_driver_enabled(&stdio_uart, false);
+#if LIB_PICO_STDIO_USB
+  stdio_set_driver_enabled(&stdio_usb, false);
+#endif
+  stdio_set_driver_enabled(&tx_stdio, true);
+#endif
+}
+
+/**
+ *  @brief  tx_report - Transmit queue throughput and cpu cost
+ */
+void tx_report(void) {
+#if TX_DMA
+  uint32_t sent = tx_sent, active_us = tx_active_us;
+  printf("\nTRANSMIT QUEUE:\n");
+  printf("%-16s: %lu\n", "Bytes queued", (unsigned long)tx_queued);
+  printf("%-16s: %lu\n", "Bytes sent", (unsigned long)sent);
+  printf("%-16s: %lu\n", "Sending bytes/s", active_us ?
+         (unsigned long)((uint64_t)sent * 1000000 / active_us) : 0ul);
+  printf("%-16s: %lu\n", "CPU cyc/KB", tx_queued ?
+         (unsigned long)((uint64_t)tx_cpu_cycles * 1024 / tx_queued) : 0ul);
+  printf("%-16s: %u\n", "Ring full waits", tx_stalls);
+#else
+  printf("\nTransmit queue not in use");
+#endif
+}
+
+/**
+ *  @brief  bus_evlog - Event bus subscriber: record the event in the event log
+ *
+ *  With the time and drive state from when it was posted, not dispatched
+ */
+void bus_evlog(const bus_event *e) {
+  static const unsigned char ev_type[EVT_COUNT] = {
+    [EVT_DIRECTION] = EV_DIRECTION, [EVT_UI_CONTROL] = EV_UI_CONTROL, [EVT_MOTOR] = EV_MOTOR,
+    [EVT_LOOP_TYPE] = EV_LOOP_TYPE, [EVT_ILIM] = EV_ILIM, [EVT_SELFTEST] = EV_SELFTEST,
+    [EVT_SPEED_IN] = EV_SPEED_IN, [EVT_SPI_LINK] = EV_SPI_LINK, [EVT_I2C_LINK] = EV_I2C_LINK,
+    [EVT_DIAG] = EV_DIAG,
+  };
+  evlog_record(ev_type[e->id], e->arg > 255 ? 255 : e->arg, e->time, &e->state);
+}
+
+/**
+ *  @brief  bus_log - Event bus subscriber: trace events through the deferred log
+ */
+void bus_log(const bus_event *e) {
+  if (bus_trace) {
+    DLOG("event %u arg %u posted %u\n", e->id, e->arg, e->time);
+  }
+}
+
+/** @brief  Event priority, name and subscribers - fixed at compile time */
+const struct {
+  uint8_t prio;
+  const char *name;
+  void (*sub[BUS_MAX_SUBS])(const bus_event *e);
+} bus_events[EVT_COUNT] = {
+  [EVT_DIRECTION]  = { 1, "direction",  { bus_evlog, bus_log } },
+  [EVT_UI_CONTROL] = { 1, "ui control", { bus_evlog, bus_log } },
+  [EVT_MOTOR]      = { 0, "motor",      { bus_evlog, bus_log } },
+  [EVT_LOOP_TYPE]  = { 1, "loop type",  { bus_evlog, bus_log } },
+  [EVT_ILIM]       = { 0, "ilim",       { bus_evlog, bus_log } },
+  [EVT_SELFTEST]   = { 0, "self-test",  { bus_evlog, bus_log } },
+  [EVT_SPEED_IN]   = { 0, "speed input", { bus_evlog, bus_log } },
+  [EVT_SPI_LINK]   = { 0, "spi link",   { bus_evlog, bus_log } },
+  [EVT_I2C_LINK]   = { 0, "i2c link",   { bus_evlog, bus_log } },
+  [EVT_DIAG]       = { 0, "vibration",  { bus_evlog, bus_log } },
+};
+
+/**
+ *  @brief  bus_source - Queue set of the calling context
+ *
+ *  Exception numbers are 16 + irq number, 0 in thread mode
+ */
+static inline uint bus_source(void) {
+  switch (__get_current_exception()) {
+    case 0:                   return get_core_num() ? BUS_SRC_CORE1 : BUS_SRC_CORE0;
+    case 16 + PWM_IRQ_WRAP:   return BUS_SRC_PWM;
+    case 16 + IO_IRQ_BANK0:   return BUS_SRC_GPIO;
+    default:                  return BUS_SRCS;
+  }
+}
+
+/**
+ *  @brief  bus_post - Post an event for the subscribers in bus_events[]
+ *
+ *  Lock free and safe from any context with a BUS_SRC_ queue: each source
+ *  only ever writes the head of its own queues, bus_dispatch() the tail
+ *  The drive state is taken here for the event log, as the event happens
+ *  Returns false if the queue was full (counted in its dropped)
+ */
+bool bus_post(uint8_t id, uint32_t arg) {
+  uint src = bus_source();
+  if (id >= EVT_COUNT) {
+    bus_bad_id++;
+    return false;
+  }
+  if (src >= BUS_SRCS) {
+    bus_bad_source++;
+    return false;
+  }
+  bus_queue *q = &bus_q[bus_events[id].prio][src];
+  uint32_t head = q->head;
+  if (head - q->tail >= BUS_QUEUE) {
+    q->dropped++;
+    return false;
+  }
+  bus_event *e = &q->ev[head & (BUS_QUEUE - 1)];
+  e->time = time_us_32();
+  e->arg = arg;
+  e->id = id;
+  evlog_capture(&e->state);
+  __dmb();                              // event visible before the head, core 1 may dispatch
+  q->head = head + 1;
+  return true;
+}
+
+/**
+ *  @brief  bus_dispatch - Deliver posted events to their subscribers
+ *
+ *  Urgent events go first, then the oldest event of any source. After each
+ *  event the search starts again, so an urgent event posted by a subscriber
+ *  or an ISR overtakes normal ones still queued
+ *  Runs as a background task from the main loop, or from core 1 - but only
+ *  ever from one of them
+ */
+void bus_dispatch(void) {
+  while (true) {
+    bus_queue *next = NULL;
+    uint prio, src, n;
+    for (prio = 0; prio < BUS_PRIOS && !next; ++prio) {
+      for (src = 0; src < BUS_SRCS; ++src) {
+        bus_queue *q = &bus_q[prio][src];
+        if (q->head != q->tail && (!next || (int32_t)(q->ev[q->tail & (BUS_QUEUE - 1)].time -
+            next->ev[next->tail & (BUS_QUEUE - 1)].time) < 0)) {
+          next = q;
+        }
+      }
+    }
+    if (!next) {
+      return;
+    }
+    __dmb();
+    bus_event e = next->ev[next->tail & (BUS_QUEUE - 1)];
+    __dmb();
+    next->tail++;                       // free the slot before the subscribers run
+    uint32_t latency = time_us_32() - e.time;
+    bus_stat *st = &bus_stats[e.id];
+    st->count++;
+    st->latency_sum += latency;
+    if (latency > st->latency_max) {
+      st->latency_max = latency;
+    }
+    for (n = 0; n < BUS_MAX_SUBS && bus_events[e.id].sub[n]; ++n) {
+      bus_events[e.id].sub[n](&e);
+    }
+  }
+}
+
+/**
+ *  @brief  bus_report - Event bus statistics
+ */
+void bus_report(void) {
+  uint id, prio, src, dropped = 0;
+  for (prio = 0; prio < BUS_PRIOS; ++prio) {
+    for (src = 0; src < BUS_SRCS; ++src) {
+      dropped += bus_q[prio][src].dropped;
+    }
+  }
+  printf("\nEVENT BUS:\n");
+  printf("%-16s  %8s %8s %8s\n", "event", "count", "avg us", "max us");
+  for (id = 0; id < EVT_COUNT; ++id) {
+    const bus_stat *st = &bus_stats[id];
+    printf("%-16s: %8lu %8lu %8lu\n", bus_events[id].name, (unsigned long)st->count,
+           (unsigned long)(st->count ? st->latency_sum / st->count : 0),
+           (unsigned long)st->latency_max);
+  }
+  printf("%-16s: %u\n", "Dropped", dropped);
+  printf("%-16s: %u\n", "Bad source", bus_bad_source);
+  printf("%-16s: %u\n", "Bad id", bus_bad_id);
+}
+
+/** @brief  init_commute - Commutator setup
+ *
+ *  Timer and alarm 1 used for commuatiation
+ *  Generates the clock for the Back EMF sensing PLL
+ *  When the timer reaches it's end count an interrupt is generated
+ */
+void init_commute(void) {
+  /*
+  // The timer Prescaler value is should be set by the maximum commutation frequency
+  // of the target motor. 
+	T0CTL1 = (0x01 | (T0_prescaler << 3));	// Disable Timer and Set Prescaler
+	T0H = 0x00;				// Set Initial Counter Value
+	T0L = 0x01;				//
+	T0CTL0 = 0x20;			// Continuous Mode, Interrupt
+	T0RH = Com_period_High;	// Set Maximum Count
+	T0RL = Com_period_Low;	//
+  */
+  DLOG("Commutation setup: %x\n", 1);
+}
+
+/**
+ *  @brief  init_angle - Set up electrical angle accumulator and sine table
+ *
+ *  The angle is a 32-bit fraction of a turn so wrap-around is free
+ *  With USE_INTERP the SIO interpolators do the lookups in the ISR:
+ *  interp0 lane 0 adds angle_step to the accumulator (pop writes it back)
+ *  interp0 lane 1 reads lane 0 (cross input) and gives the sine table address
+ *  interp1 lanes 0 and 1 give the sine and cosine table addresses of any angle
+ *  The software versions give identical results and are used on the host
+ */
+void init_angle(void) {
+  uint i;
+  for (i = 0; i < SIN_SIZE; ++i) {
+    sin_table[i] = (int16_t)lrintf(32767.f * sinf(2.f * (float)M_PI * i / SIN_SIZE));
+  }
+#if USE_INTERP
+  interp_config cfg = interp_default_config(); // lane 0: plain 32-bit accumulate
+  interp_set_config(interp0, 0, &cfg);
+  interp_config_set_cross_input(&cfg, true);   // lane 1: table address of lane 0
+  interp_config_set_shift(&cfg, SIN_SHIFT - 1);
+  interp_config_set_mask(&cfg, 1, SIN_BITS);   // index * 2 for int16_t entries
+  interp_set_config(interp0, 1, &cfg);
+  interp0->accum[0] = 0;
+  interp0->base[0] = angle_step;
+  interp0->base[1] = (uint32_t)sin_table;
+
+  cfg = interp_default_config();               // both lanes: table address of own accum
+  interp_config_set_shift(&cfg, SIN_SHIFT - 1);
+  interp_config_set_mask(&cfg, 1, SIN_BITS);
+  interp_set_config(interp1, 0, &cfg);
+  interp_set_config(interp1, 1, &cfg);
+  interp1->base[0] = (uint32_t)sin_table;
+  interp1->base[1] = (uint32_t)sin_table;
+#endif
+}
+
+/**
+ *  @brief  angle_set_step - Set electrical angle advance per pwm period
+ */
+void angle_set_step(uint32_t step) {
+  angle_step = step;
+#if USE_INTERP
+  interp0->base[0] = step;
+#endif
+}
+
+/**
+ *  @brief  angle_set - Move the electrical angle, the next update steps on from here
+ */
+void angle_set(uint32_t angle) {
+  sw_angle = angle;
+#if USE_INTERP
+  interp0->accum[0] = angle;
+#endif
+}
+
+/**
+ *  @brief  angle_update_sw - Advance angle and look up its sine in software
+ */
+static inline uint32_t angle_update_sw(int16_t *sine) {
+  sw_angle += angle_step;
+  *sine = sin_table[sw_angle >> SIN_SHIFT];
+  return sw_angle;
+}
+
+/**
+ *  @brief  angle_sincos_sw - Look up sine and cosine of angle in software
+ */
+static inline void angle_sincos_sw(uint32_t angle, int16_t *sine, int16_t *cosine) {
+  *sine = sin_table[angle >> SIN_SHIFT];
+  *cosine = sin_table[(angle + ANGLE_90) >> SIN_SHIFT];
+}
+
+#if USE_INTERP
+/**
+ *  @brief  angle_update_interp - Advance angle and look up its sine on interp0
+ */
+static inline uint32_t angle_update_interp(int16_t *sine) {
+  uint32_t angle = interp0->pop[0];
+  *sine = *(int16_t *)interp0->peek[1];
+  return angle;
+}
+
+/**
+ *  @brief  angle_sincos_interp - Look up sine and cosine of angle on interp1
+ */
+static inline void angle_sincos_interp(uint32_t angle, int16_t *sine, int16_t *cosine) {
+  interp1->accum[0] = angle;
+  interp1->accum[1] = angle + ANGLE_90;
+  *sine = *(int16_t *)interp1->peek[0];
+  *cosine = *(int16_t *)interp1->peek[1];
+}
+
+#define angle_update  angle_update_interp
+#define angle_sincos  angle_sincos_interp
+#else
+#define angle_update  angle_update_sw
+#define angle_sincos  angle_sincos_sw
+#endif
+
+/**
+ *  @brief  angle_bench - Compare interpolator and software angle lookups
+ *
+ *  Runs ANGLE_BENCH_N steps of each version from the same start angle,
+ *  checks that the results are identical and reports cycles per call
+ *  Cycles are counted with systick at the processor clock
+ *  Interrupts are held off so the ISR's interpolator state is not disturbed
+ */
+void angle_bench(void) {
+  uint32_t i, t0, sw_cycles, hw_cycles = 0, errors = 0, step = angle_step;
+  int16_t sine, cosine;
+  volatile int32_t sink = 0;            // keep results live
+
+  init_systick();
+  uint32_t irq = save_and_disable_interrupts();
+  uint32_t saved_angle = sw_angle;
+  angle_step = 0x01234567;              // awkward step to exercise the wrap
+  sw_angle = 0;
+  t0 = SYST_CVR;
+  for (i = 0; i < ANGLE_BENCH_N; ++i) {
+    angle_sincos_sw(angle_update_sw(&sine), &sine, &cosine);
+    sink += sine + cosine;
+  }
+  sw_cycles = (t0 - SYST_CVR) & 0x00ffffff;
+#if USE_INTERP
+  interp_hw_save_t save0, save1;
+  interp_save(interp0_hw, &save0);
+  interp_save(interp1_hw, &save1);
+  interp0->accum[0] = 0;
+  interp0->base[0] = angle_step;
+  t0 = SYST_CVR;
+  for (i = 0; i < ANGLE_BENCH_N; ++i) {
+    angle_sincos_interp(angle_update_interp(&sine), &sine, &cosine);
+    sink += sine + cosine;
+  }
+  hw_cycles = (t0 - SYST_CVR) & 0x00ffffff;
+  // run both again in lockstep to check they agree
+  interp0->accum[0] = 0;
+  sw_angle = 0;
+  for (i = 0; i < ANGLE_BENCH_N; ++i) {
+    int16_t s_hw, c_hw, s_sw, c_sw;
+    uint32_t a_hw = angle_update_interp(&s_hw);
+    uint32_t a_sw = angle_update_sw(&s_sw);
+    errors += (a_hw != a_sw) + (s_hw != s_sw);
+    angle_sincos_interp(a_hw, &s_hw, &c_hw);
+    angle_sincos_sw(a_sw, &s_sw, &c_sw);
+    errors += (s_hw != s_sw) + (c_hw != c_sw);
+  }
+  interp_restore(interp0_hw, &save0);
+  interp_restore(interp1_hw, &save1);
+#endif
+  angle_step = step;
+  sw_angle = saved_angle;
+  restore_interrupts(irq);
+
+  printf("\nANGLE LOOKUP (%d calls):\n", ANGLE_BENCH_N);
+  printf("%-16s: %lu\n", "Software cyc/10", (unsigned long)(sw_cycles * 10 / ANGLE_BENCH_N));
+  printf("%-16s: %lu\n", "Interp cyc/10", (unsigned long)(hw_cycles * 10 / ANGLE_BENCH_N));
+  printf("%-16s: %lu\n", "Mismatches", (unsigned long)errors);
+}
+
+/**
+ *  @brief handover_start - Start slewing the setpoint from its present value
+ *
+ *  Called on a change of command source or of loop type
+ */
+void handover_start(unsigned char cmd) {
+  handover_active = 1;
+  handover_q8 = (int32_t)cmd << 8;
+  pot_held = (handover_src == SPEED_SRC_POT) && handover_pickup;
+  pot_below = input_cmd < cmd;
+}
+
+/**
+ *  @brief handover_update - Follow the command source without steps
+ *
+ *  The source is the UI setting when the UI has control, then the spi
+ *  master's or the i2c host's setpoint when they have control, otherwise
+ *  the pot or the speed input, as chosen by speed_src
+ *  When the source changes the setpoint slews from its present value to the
+ *  new source at handover_rate, after which it follows the source directly
+ *  With handover_pickup the pot is ignored until it reaches or passes the
+ *  present setpoint, so the operator has to "pick up" the running value
+ *
+ *  @param cmd  present setpoint
+ *  @return     new setpoint
+ */
+unsigned char handover_update(unsigned char cmd) {
+  unsigned char src = speed_src;
+  int32_t target = input_cmd;
+  int32_t step;
+
+  if (i2c_control) {
+    src = SPEED_SRC_I2C;
+    target = i2c_cmd;
+  }
+  if (spi_control) {
+    src = SPEED_SRC_SPI;
+    target = spi_cmd;
+  }
+  #if UART
+  if (ui_control) {                     // the operator overrides the master
+    src = SPEED_SRC_UI;
+    target = ui_speed;
+  }
+  #endif
+  if (src != handover_src) {            // new source - start slewing from here
+    handover_src = src;
+    handover_start(cmd);
+  }
+  if (pot_held) {
+    if ((pot_below && input_cmd < cmd) || (!pot_below && input_cmd > cmd)) {
+      return cmd;                       // not picked up yet - hold the setpoint
+    }
+    pot_held = 0;
+  }
+  if (!handover_active) {
+    return target;
+  }
+  step = ((int32_t)handover_rate << 8) / LOOP_FREQ;
+  if (step < 1) {
+    step = 1;
+  }
+  target <<= 8;
+  if (handover_q8 + step < target) {
+    handover_q8 += step;
+  } else if (handover_q8 - step > target) {
+    handover_q8 -= step;
+  } else {
+    handover_q8 = target;
+    handover_active = 0;                // arrived - follow the source directly
+  }
+  return handover_q8 >> 8;
+}
+
+/**
+ *  @brief  speed_input - Reading of the selected hardware command source, 0-255
+ */
+static inline unsigned char speed_input(void) {
+  if (speed_src == SPEED_SRC_POT) {
+    adc_select_input(ADC_SPEED);        // select adc 0
+    return adc_read() >> 4;             // scale adc 0-255
+  }
+  return speed_in_cmd;                  // 0 while the signal is lost
+}
+
+/**
+ *  @brief speed_cmd - Get speed command from speed potentiomenter
+ *
+ *  Connected to POT_SPEED
+ *  The pot is read when pot_timer has set pot_due, every POT_PERIOD_US
+ *  ADC is 12-bit - shift value right by 4 bits to get speed command in range 0-255
+ *  With speed_src set to the speed input, its reading is taken instead
+ *  Changes between pot and UI control go through handover_update()
+ */
+void get_speed_cmd(void) {
+	if (pot_due) {
+    pot_due = 0;
+    input_cmd = speed_input();
+		if (input_cmd < SPEED_CMD_MIN) {
+			input_cmd = SPEED_CMD_MIN;
+		}
+	}
+  speed_cmd = handover_update(speed_cmd);
+}
+
+/**
+ *  @brief current_cmd - Get current command from speed potentiometer
+ *
+ *  In torque mode the potentiometer sets the current instead of the speed
+ *  Runs at the same rate as get_speed_cmd()
+ */
+void get_current_cmd(void) {
+	if (pot_due) {
+    pot_due = 0;
+    input_cmd = speed_input();          // CURRENT_CMD_MIN is 0, no clamp needed
+	}
+  current_cmd = handover_update(current_cmd);
+}
+
+/**
+ *  @brief  ilim_cutoff - Turn off the high side switches for the rest of the period
+ *
+ *  GPIO output override forces the pins low whatever the pwm is doing
+ *  Only the active high side is switching, but forcing all three is as quick
+ */
+void ilim_cutoff(void) {
+  gpio_set_outover(PWM_1H, GPIO_OVERRIDE_LOW);
+  gpio_set_outover(PWM_2H, GPIO_OVERRIDE_LOW);
+  gpio_set_outover(PWM_3H, GPIO_OVERRIDE_LOW);
+  if (!ilim_cut) {
+    ilim_cut = 1;
+    ilim_trips++;
+  }
+}
+
+/**
+ *  @brief  ilim_isr - Current limit comparator interrupt handler
+ *
+ *  Falling edge on ILIM_COMP - cut the pwm pulse immediately
+ *  Runs at a higher priority than pwm_isr() so it is never delayed by it
+ */
+void ilim_isr(uint gpio, uint32_t events) {
+  (void)events;                         // only the falling edge is enabled
+  if (gpio == ILIM_COMP) {
+    ilim_cutoff();
+  }
+}
+
+/**
+ *  @brief  ilim_release - Give the high side switches back to the pwm
+ *
+ *  Called by pwm_isr() at the start of each period
+ *  If the comparator is still tripped the cut carries on for another period
+ */
+static inline void ilim_release(void) {
+  if (ilim_cut) {
+    uint32_t irq = save_and_disable_interrupts(); // keep ilim_isr() out for a few cycles
+    ilim_cut = 0;
+    if (gpio_get(ILIM_COMP)) {
+      gpio_set_outover(PWM_1H, GPIO_OVERRIDE_NORMAL);
+      gpio_set_outover(PWM_2H, GPIO_OVERRIDE_NORMAL);
+      gpio_set_outover(PWM_3H, GPIO_OVERRIDE_NORMAL);
+    } else {
+      ilim_cutoff();
+    }
+    restore_interrupts(irq);
+  }
+}
+
+/**
+ *  @brief  ilim_second - Latch the current limit trips of the last second
+ *
+ *  ilim_timer callback
+ */
+void ilim_second(void) {
+  ilim_trips_per_sec = ilim_trips;
+  ilim_trips = 0;
+  if (ilim_trips_per_sec) {
+    bus_post(EVT_ILIM, ilim_trips_per_sec);
+  }
+}
+
+/**
+ *  @brief  advance_observe - Add the current and speed samples to the optimizer's averages
+ *
+ *  Called by pwm_isr once per function loop, after current_sample()
+ */
+static inline void advance_observe(void) {
+  adv_sum += adc_current;
+  adv_speed_sum += speed;
+  adv_n++;
+}
+
+/**
+ *  @brief  overlap_observe - Average the dc link current for overlap_update()
+ *
+ *  Called by pwm_isr once per function loop, after current_sample()
+ *  The average has a time constant of about 10ms, a step or more above 1000rpm
+ */
+static inline void overlap_observe(void) {
+  ovl_avg_q4 += (int32_t)((adc_current << 4) - ovl_avg_q4) >> 4;
+}
+
+/**
+ *  @brief  advance_update - Perturb and observe step for the commutation advance
+ *
+ *  Commutating from the back EMF in the speed loop, with the mean measured
+ *  speed over the last step within ADV_SPEED_TOL of speed_cmd, the mean bus
+ *  current over the step is compared with the one before: if it went up the
+ *  direction of the perturbation is reversed, then the advance moves adv_step
+ *  degrees, within adv_min and adv_max. At each new speed the current is
+ *  first measured at the fixed advance_deg, which the savings are reported
+ *  against. A step where the angle was more than ADV_PHASE_TOL off the
+ *  rotor at the crossings, on average, ran at some other advance, and is
+ *  left out
+ *  Anything else - stopped, open loop, torque loop, ramping, disabled - puts
+ *  the fixed advance back
+ *  advance_timer callback every ADV_PERIOD_MS
+ */
+void advance_update(void) {
+  uint32_t mean, n = adv_n, m = adv_phase_n;
+  int32_t off;
+  mean = n ? (adv_sum << 8) / n : 0;
+  off = n ? (int32_t)((adv_speed_sum << 8) / n) - (speed_cmd << 8) : 0;
+  adv_phase = m ? (int32_t)((int64_t)adv_phase_sum * (65536 << 8) / ANGLE_DEG(1) / (int32_t)m) : 0;
+  adv_sum = adv_speed_sum = 0;
+  adv_n = 0;
+  adv_phase_sum = 0;
+  adv_phase_n = 0;
+  if (!adv_enable || !com_locked || !bemf_active || !loop_type || !n ||
+      off > ADV_SPEED_TOL << 8 || off < -(ADV_SPEED_TOL << 8)) {
+    adv_state = ADV_IDLE;
+    com_advance = ANGLE_DEG(advance_deg);
+    return;
+  }
+  if (adv_state == ADV_IDLE || speed_cmd != adv_speed) {
+    adv_state = ADV_FIXED;              // new operating point - measure the fixed advance
+    adv_speed = speed_cmd;
+    adv_deg = advance_deg;
+    com_advance = ANGLE_DEG(advance_deg);
+    return;                             // this step's current was before the change
+  }
+  if (n < ADV_MIN_SAMPLES || !m ||
+      adv_phase > ADV_PHASE_TOL << 8 || adv_phase < -(ADV_PHASE_TOL << 8)) {
+    return;
+  }
+  if (adv_state == ADV_FIXED) {
+    adv_fixed = adv_avg = adv_last = mean;
+    adv_state = ADV_SEEK;
+  } else {
+    if (mean > adv_last) {
+      adv_dir = -adv_dir;               // worse - go back the other way
+    }
+    adv_avg += ((int32_t)mean - (int32_t)adv_avg) >> 3;
+    adv_last = mean;
+    adv_saved += (int64_t)((int32_t)adv_fixed - (int32_t)mean) * adc_vbus;
+    adv_steps++;
+  }
+  if (adv_dir > 0) {
+    adv_deg = adv_deg + adv_step > adv_max ? adv_max : adv_deg + adv_step;
+  } else {
+    adv_deg = adv_deg < adv_min + adv_step ? adv_min : adv_deg - adv_step;
+  }
+  com_advance = ANGLE_DEG(adv_deg);
+}
+
+/**
+ *  @brief  init_comp - Enable pulse-by-pulse current limiting
+ *
+ *  An external comparator on the current shunt amplifier drives ILIM_COMP low
+ *  when the current is over the limit
+ *  The RP2040 has no pwm fault input, so the comparator edge interrupts and
+ *  the high side outputs are overridden low until the next pwm period
+ */
+void init_comp(void) {
+  gpio_init(ILIM_COMP);
+  gpio_set_dir(ILIM_COMP, GPIO_IN);
+  gpio_set_pulls(ILIM_COMP, 1, 0);      // set pullup, open collector comparator
+  irq_set_priority(IO_IRQ_BANK0, PICO_HIGHEST_IRQ_PRIORITY);
+  gpio_set_irq_enabled_with_callback(ILIM_COMP, GPIO_IRQ_EDGE_FALL, true, &ilim_isr);
+}
+
+/**
+ *  @brief current_read - Read bus current
+ *
+ *  ADC is 12-bit - shift value right by 4 bits to get current in range 0-255
+ */
+static inline unsigned char current_read(void) {
+  adc_select_input(ADC_CURRENT);        // select adc 1
+  return adc_read() >> 4;
+}
+
+/**
+ *  @brief ilim_check - Cut the rest of the period if a reading is over motor.ilim_adc
+ *
+ *  Same cut as the comparator, and ilim_release() gives it back next period
+ */
+static inline void ilim_check(unsigned char i) {
+  if (i > motor.ilim_adc) {
+    ilim_cutoff();
+  }
+}
+
+/**
+ *  @brief ilim_sample - Read the current at the wrap and check it against the limit
+ *
+ *  Called by pwm_isr() every period the bridge is driven, so the adc limit
+ *  holds to a period in all modes. The fast current loops use the reading
+ */
+static inline void ilim_sample(void) {
+  cf_sample = current_read();
+  ilim_check(cf_sample);
+}
+
+/**
+ *  @brief current_sample - Sample bus current for the torque loop
+ */
+void current_sample(void) {
+  adc_current = current_read();
+  ilim_check(adc_current);
+}
+
+/**
+ *  @brief vsense_raw - Read one of the voltage sense mux inputs, 12-bit
+ *
+ *  @param input  VSENSE_VBUS, VSENSE_VA, VSENSE_VB or VSENSE_VC
+ */
+static inline uint16_t vsense_raw(uint input) {
+  gpio_put(VSENSE_SEL0, input & 1);
+  gpio_put(VSENSE_SEL1, (input >> 1) & 1);
+  adc_select_input(ADC_VSENSE);         // select adc 2
+  return adc_read();
+}
+
+/**
+ *  @brief vsense_read - Read one of the voltage sense mux inputs
+ *
+ *  The dividers have their filter capacitors ahead of the mux so the
+ *  mux output settles straight away
+ *  ADC is 12-bit - shift value right by 4 bits to get voltage in range 0-255
+ *
+ *  @param input  VSENSE_VBUS, VSENSE_VA, VSENSE_VB or VSENSE_VC
+ */
+unsigned char vsense_read(uint input) {
+  return vsense_raw(input) >> 4;
+}
+
+/**
+ *  @brief vbus_sample - Read bus voltage
+ */
+void vbus_sample(void) {
+  adc_vbus = vsense_read(VSENSE_VBUS);
+}
+
+/**
+ *  @brief  com_apply - Load the pwm levels for commutation step com_step
+ *
+ *  The high side of one phase switches at com_mag, the low side of another
+ *  is on, the third phase floats. A phase never goes straight from low to
+ *  high between neighbouring steps, and the slices latch all six levels at
+ *  the same wrap, so the legs need no extra dead time here
+ */
+void com_apply(void) {
+  uint p;
+  for (p = 0; p < 3; ++p) {
+    pwm_set_gpio_level(PWM_1H + 2 * p, com_on && p == com_high[com_step] ? com_mag : 0);
+    pwm_set_gpio_level(PWM_1L + 2 * p, com_on && p == com_low[com_step] ? COM_FULL : 0);
+  }
+}
+
+/**
+ *  @brief  com_lock - Hand the duty to the regulators, starting from com_mag
+ */
+static void com_lock(void) {
+  int32_t duty = com_mag < COM_MAG_MIN ? COM_MAG_MIN : com_mag;
+  com_locked = 1;
+  s_integral = c_integral = duty << 8;
+  cf_integral = duty << CF_Q;
+  db_pred = (int32_t)adc_current << MDL_Q;
+}
+
+/**
+ *  @brief  commutate - Six-step commutation from the electrical angle
+ *
+ *  Called by pwm_isr every period after angle_update(). elec_angle runs
+ *  the way the motor turns. Forward the step is the sixth of a turn that
+ *  elec_angle + com_advance is in, so a larger advance switches each phase
+ *  earlier. In reverse the rotor angle is -elec_angle: the steps run
+ *  backwards from the rotor angle less the advance, each with its pair
+ *  swapped round. The direction is taken when the bridge starts, and a
+ *  new one stops it for a period and starts it again from the
+ *  alignment. Starting the motor first drives the COM_ALIGN_STEP pair at
+ *  align_mag for align_periods, which pulls the rotor to angle 0, turns
+ *  it off for a period as the first step turns one of its legs round,
+ *  then sets the angle going from there at start_step. With
+ *  back EMF sensing com_start() ramps it until bemf_sample() locks on,
+ *  without it the regulators take over straight away and the angle runs
+ *  open loop. Stopping it turns the bridge off
+ */
+static inline void commutate(void) {
+  uint32_t step;
+  if (com_dir == REV) {
+    step = ((-(elec_angle + com_advance) >> 16) * 6) >> 16;
+    step = step < 3 ? step + 3 : step - 3;
+  } else {
+    step = ((elec_angle + com_advance) >> 16) * 6 >> 16;
+  }
+  if (motor_on != com_on || (com_on && direction != com_dir)) {
+    com_on = !com_on;                   // start, stop, or stop to turn round
+    if (com_on) {
+      com_dir = direction;
+    }
+    com_align = com_on ? motor.align_periods + 1 : 0;
+    com_locked = 0;
+    bemf_active = com_on && bemf_enable && pwm_mode != CUR_UPDATE_MPC; // mpc drives every phase
+    bemf_step = COM_ALIGN_STEP;
+    bemf_armed = BEMF_SEEN;             // nothing to see until step 0
+    bemf_good = 0;
+    bemf_t = bemf_late = bemf_span[0] = bemf_span[1] = 0;
+    speed = 0;
+    angle_set_step(0);
+    angle_set(0);
+    com_step = COM_ALIGN_STEP;
+    com_apply();
+    if (com_on) {
+      pwm_set_gpio_level(PWM_1H + 2 * com_high[COM_ALIGN_STEP], motor.align_mag);
+    }
+  } else if (com_align) {
+    if (--com_align == 0) {
+      pwm_set_gpio_level(PWM_1H + 2 * com_high[COM_ALIGN_STEP], 0); // a period off first: the
+      pwm_set_gpio_level(PWM_1L + 2 * com_low[COM_ALIGN_STEP], 0);  //   first step turns a leg round
+      angle_set_step(motor.start_step); // first step from the next period
+      if (bemf_active) {
+        com_mag = motor.align_mag;      // com_start() ramps it up
+      } else {
+        com_mag = COM_MAG_MIN;
+        com_lock();
+      }
+    }
+  } else if (step != com_step) {
+    com_step = step;
+    com_apply();
+    if (ovl_enable) {
+      ovl_t = 0;                        // overlap_update() takes it from here
+      ovl_probing = (++ovl_count & (OVL_PROBE - 1)) == 0;
+      ovl_upset = 0;
+    }
+  }
+}
+
+/**
+ *  @brief  overlap_update - Hold the dc link current through a commutation
+ *
+ *  The outgoing phase's current freewheels through a diode and stops
+ *  passing through the shunt while the incoming phase's current builds
+ *  up, so the dc link current and the torque dip at every commutation -
+ *  or overshoot at high speed, where the incoming current rises the
+ *  faster. For ovl_len periods the active high side runs off com_mag in
+ *  proportion to the error from the average current, which also gives a
+ *  full duty drive a way down. ovl_len is the time the current takes to
+ *  come back unaided, timed on one commutation in OVL_PROBE
+ *  Called by pwm_isr after the function loop step, so it has the last word
+ *  on the duty. The current is only read in the periods after a commutation
+ */
+static inline void overlap_update(void) {
+  unsigned char i, t = ovl_t;
+  int32_t duty;
+  if (t == 0xff) {
+    return;
+  }
+  i = current_read();
+  ilim_check(i);
+  ovl_t = t + 1;
+  if (t == 0) {
+    ovl_ref = ovl_avg_q4 >> 4;          // new levels latch at the next wrap - nothing to do yet
+    return;
+  }
+  if (ovl_probing) {
+    if (abs((int)i - ovl_ref) * 8 > ovl_ref) {
+      ovl_upset = 1;
+      if (t < OVL_MAX) {
+        return;
+      }
+    } else if (!ovl_upset && t < 3) {
+      return;                           // not moved yet
+    }
+    ovl_decay_q4 += (int32_t)(((ovl_upset ? t : 1) << 4) - ovl_decay_q4) >> 2;
+    duty = (ovl_decay_q4 + 15) >> 4;
+    if (angle_step && duty > (int32_t)(0x15555555u / angle_step)) {
+      duty = 0x15555555u / angle_step;  // at most half a commutation step
+    }
+    ovl_len = duty < 1 ? 1 : duty;
+    ovl_t = 0xff;
+    return;
+  }
+  if (t > ovl_len || !com_on) {
+    pwm_set_gpio_level(PWM_1H + 2 * com_high[com_step], com_mag);
+    ovl_t = 0xff;
+    return;
+  }
+  duty = ((int32_t)ovl_ref - i) * OVL_GAIN;
+  duty = duty < -OVL_TRIM_MAX ? -OVL_TRIM_MAX : duty > OVL_TRIM_MAX ? OVL_TRIM_MAX : duty;
+  duty += com_mag;
+  pwm_set_gpio_level(PWM_1H + 2 * com_high[com_step], duty > COM_MAG_MAX ? COM_MAG_MAX : duty);
+}
+
+/**
+ *  @brief set_com_mag - Clamp the duty and load it into the active high side
+ *
+ *  @param duty  duty * 256 from a loop regulator
+ */
+void set_com_mag(int32_t duty) {
+  duty >>= 8;
+  if (duty < COM_MAG_MIN) {
+    duty = COM_MAG_MIN;
+  }
+  if (duty > COM_MAG_MAX) {
+    duty = COM_MAG_MAX;
+  }
+  com_mag = duty;
+  if (com_locked) {
+    pwm_set_gpio_level(PWM_1H + 2 * com_high[com_step], com_mag);
+  }
+}
+
+/**
+ *  @brief clamp_integral - Limit a loop integrator to the duty range
+ */
+static inline int32_t clamp_integral(int32_t integral) {
+  if (integral < (COM_MAG_MIN << 8)) {
+    return COM_MAG_MIN << 8;
+  }
+  if (integral > (COM_MAG_MAX << 8)) {
+    return COM_MAG_MAX << 8;
+  }
+  return integral;
+}
+
+/**
+ *  @brief  bemf_stop - Stop a run whose zero crossings failed, from pwm_isr
+ */
+static void bemf_stop(void) {
+  bemf_lost++;
+  bemf_active = 0;
+  motor_on = 0;                         // commutate() turns the bridge off next period
+  bus_post(EVT_MOTOR, 0);
+}
+
+/**
+ *  @brief  bemf_sample - Time the floating phase's back EMF zero crossings
+ *
+ *  Read at the wrap with the high side on, where the floating phase sits at
+ *  half the bus plus its back EMF, which falls through half the bus in the
+ *  even steps and rises in the odd ones, and the other way round in
+ *  reverse, where the steps have their pairs swapped round. It has to be
+ *  seen on the near side first, which passes over the diode clamp the
+ *  outgoing phase leaves on it just after a commutation. The crossing in
+ *  step s is at rotor angle 60 s + 30 degrees, or 60 s + 210 in reverse.
+ *  Once locked the angle is put there, plus the part of a period since,
+ *  and steps at 120 degrees over the last two intervals.
+ *  commutate() then switches 30 degrees less com_advance after each one.
+ *  On the start ramp BEMF_LOCK crossings in a row, one each step, lock it,
+ *  and no crossing for two intervals after that stops the motor
+ *  Called by pwm_isr between angle_update() and commutate()
+ */
+static inline void bemf_sample(void) {
+  uint fl = 3 - com_high[com_step] - com_low[com_step]; // floating phase
+  uint32_t late, span, angle, n;
+  int32_t d;
+  if (com_step != bemf_step) {
+    if (bemf_armed != BEMF_SEEN && !com_locked) {
+      bemf_good = 0;                    // a step went by without one
+    }
+    bemf_step = com_step;
+    bemf_armed = BEMF_WAIT;
+  }
+  bemf_t++;
+  if (com_locked && bemf_t > (bemf_span[0] + bemf_span[1]) >> 8) {
+    bemf_stop();
+    return;
+  }
+  if (bemf_armed == BEMF_SEEN) {
+    return;
+  }
+  d = vsense_raw(VSENSE_VA + fl);
+  adc_vbemf = d >> 4;
+  d = 2 * d - (adc_vbus << 4) - 8;      // from half the bus, 12-bit
+  if ((com_step ^ com_dir) & 1) {
+    d = -d;                             // rising: before the crossing is below
+  }
+  if (d > 0) {
+    bemf_armed = BEMF_ARMED;
+    bemf_prev = d;
+    return;
+  }
+  if (bemf_armed == BEMF_WAIT) {
+    return;
+  }
+  bemf_armed = BEMF_SEEN;
+  late = ((uint32_t)-d << 8) / (uint32_t)(bemf_prev - d); // straight line between the readings
+  span = (bemf_t << 8) - late + bemf_late;
+  bemf_t = 0;
+  bemf_late = late;
+  bemf_span[1] = bemf_span[0];
+  bemf_span[0] = span;
+  if (!com_locked) {
+    if (++bemf_good < BEMF_LOCK) {
+      return;
+    }
+    com_lock();
+  }
+  angle_set_step((ANGLE_DEG(120) / (bemf_span[0] + bemf_span[1])) << 8);
+  angle = ANGLE_DEG(60 * com_step + 30);
+  if (com_dir == REV) {
+    angle = ANGLE_DEG(180) - angle;     // the pair is swapped round, and the angle is -rotor
+  }
+  angle += (angle_step >> 8) * late;
+  adv_phase_sum += (int32_t)(elec_angle - angle) >> 16; // ahead of the rotor is positive
+  adv_phase_n++;
+  elec_angle = angle;
+  angle_set(angle);
+  n = angle_step / motor.step_per_count;
+  speed = n > 255 ? 255 : n;
+}
+
+/**
+ *  @brief  speed_ramp - Move the commutation rate towards speed_cmd
+ *
+ *  Without back EMF sensing the angle is not measured, so the motor runs
+ *  synchronously at the rate the angle is stepped. It ramps at the
+ *  profile's ramp rate, and speed is that rate in speed command counts
+ */
+static inline void speed_ramp(void) {
+  uint32_t target, ramp;
+  target = speed_cmd * motor.step_per_count;
+  ramp = (motor.ramp_step * (LOOP_PERIOD_US / PWM_PERIOD)) >> 8;
+  if (angle_step + ramp < target) {
+    angle_set_step(angle_step + ramp);
+  } else if (angle_step > target + ramp) {
+    angle_set_step(angle_step - ramp);
+  } else {
+    angle_set_step(target);
+  }
+  speed = angle_step / motor.step_per_count;
+}
+
+/**
+ *  @brief  com_start - Open loop ramp from the alignment to the back EMF lock
+ *
+ *  The angle steps up from start_step at the profile's ramp rate, at the
+ *  alignment duty plus the line to line back EMF at the ramp's speed,
+ *  until bemf_sample() locks on. Past BEMF_RAMP_MAX times start_rpm the
+ *  start has failed and the motor stops
+ *  Called by pwm_isr in place of the regulators
+ */
+static inline void com_start(void) {
+  uint32_t ramp = (motor.ramp_step * (LOOP_PERIOD_US / PWM_PERIOD)) >> 8, n;
+  int32_t duty;
+  if (angle_step + ramp > BEMF_RAMP_MAX * motor.start_step) {
+    bemf_stop();
+    return;
+  }
+  angle_set_step(angle_step + ramp);
+  n = angle_step / motor.step_per_count;
+  speed = n > 255 ? 255 : n;
+  duty = motor.align_mag + (int32_t)(angle_step >> 12) * motor.start_ke / (adc_vbus ? adc_vbus : 1);
+  com_mag = duty > COM_MAG_MAX ? COM_MAG_MAX : duty;
+  pwm_set_gpio_level(PWM_1H + 2 * com_high[com_step], com_mag);
+}
+
+/**
+ *  @brief speed_reg - Speed loop PI regulator
+ *
+ *  Sets com_mag from the error between speed_cmd and the measured speed
+ *  Open loop the error is only the ramp's lag behind speed_cmd
+ */
+void speed_reg(void) {
+  int32_t error;
+  if (!bemf_active) {
+    speed_ramp();                       // otherwise bemf_sample() measures it
+  }
+  error = (int32_t)speed_cmd - speed;
+  s_integral = clamp_integral(s_integral + motor.s_ki * error);
+  set_com_mag(s_integral + motor.s_kp * error);
+}
+
+/**
+ *  @brief current_reg - Current (torque) loop PI regulator
+ *
+ *  Sets com_mag from the error between current_cmd and the measured current
+ */
+void current_reg(void) {
+  int32_t error = (int32_t)current_cmd - adc_current;
+  c_integral = clamp_integral(c_integral + motor.c_ki * error);
+  set_com_mag(c_integral + motor.c_kp * error);
+}
+
+/**
+ *  @brief current_fast - Current loop PI regulator run from pwm_isr
+ *
+ *  Used in place of current_reg() by the CUR_UPDATE_PWM and _DOUBLE modes
+ *  Its gains are set for the bus voltage by current_gains()
+ *
+ *  Not inlined, so tools/wcet.py counts only the longest cur_update mode
+ *
+ *  @param i  current at the middle of the pulse, or predicted for the peak
+ */
+static __attribute__((noinline)) void current_fast(int32_t i) {
+  int32_t error = (int32_t)current_cmd - i;
+  cf_integral += cf_ki * error;
+  if (cf_integral < (COM_MAG_MIN << CF_Q)) {
+    cf_integral = COM_MAG_MIN << CF_Q;
+  } else if (cf_integral > (COM_MAG_MAX << CF_Q)) {
+    cf_integral = COM_MAG_MAX << CF_Q;
+  }
+  set_com_mag((cf_integral + cf_kp * error) >> (CF_Q - 8));
+}
+
+/**
+ *  @brief current_deadbeat - Duty that brings the current to current_cmd
+ *
+ *  The duty the slices have just latched runs for this period, so the
+ *  current at the next valley is predicted from the sample with the model
+ *  first, then the duty is found that goes from there to current_cmd over
+ *  the period after: two periods from sample to command. The duty range
+ *  limits the voltage, and the rest follows a period later
+ *  What the last prediction missed by is averaged into db_dist and added
+ *  to the model, which takes out the error an R or back EMF off the
+ *  profile's would otherwise leave
+ *  Not inlined, so tools/wcet.py counts only the longest cur_update mode
+ */
+static __attribute__((noinline)) void current_deadbeat(void) {
+  int32_t e = (int32_t)(angle_step >> 12) * motor.mdl_ke;
+  int32_t i = (cf_sample << MDL_Q) + (1 << (MDL_Q - 1)); // reading truncates, so + 1/2
+  int32_t need;
+  db_dist += (i - db_pred) >> DB_OBS_SHIFT;
+  if (db_dist > (DB_DIST_MAX << MDL_Q)) {
+    db_dist = DB_DIST_MAX << MDL_Q;
+  } else if (db_dist < -(DB_DIST_MAX << MDL_Q)) {
+    db_dist = -(DB_DIST_MAX << MDL_Q);
+  }
+  i += 2 * (cf_duty * adc_vbus * motor.mdl_kv - cf_sample * motor.mdl_kr - e) + db_dist;
+  db_pred = i;                          // next valley
+  need = ((int32_t)current_cmd << MDL_Q) - i + 2 * ((i >> MDL_Q) * motor.mdl_kr + e) - db_dist;
+  set_com_mag(((need >> 12) * db_inv >> 4) + 128); // to the nearest duty count
+}
+
+/**
+ *  @brief mpc_shape - Trapezoidal back EMF of a phase, -128 to 128
+ *
+ *  Flat for 120 electrical degrees either way with 60 degree ramps, lined
+ *  up so that commutation step 0 is the flat top of phase 1 at no advance
+ */
+static inline int32_t mpc_shape(uint32_t angle) {
+  uint32_t x = (angle >> 16) * 6;       // sixths of a turn << 16
+  int32_t ramp = (int32_t)((x & 0xffff) >> 8);
+  switch (x >> 16) {
+  case 2:
+    return 128 - ramp;
+  case 3:
+  case 4:
+    return -128;
+  case 5:
+    return -128 + ramp;
+  default:
+    return 128;
+  }
+}
+
+/**
+ *  @brief mpc_changed - Number of switches that differ between two states
+ */
+static inline uint32_t mpc_changed(uint32_t a, uint32_t b) {
+  uint32_t n = a ^ b;
+  n = (n & 0x15) + ((n >> 1) & 0x15);   // pairs of bits, then the three pairs
+  return (n & 3) + ((n >> 2) & 3) + (n >> 4);
+}
+
+/**
+ *  @brief mpc_update - Finite control set model predictive current control
+ *
+ *  Each period one of MPC_STATES switching states runs for the whole
+ *  period. The model of a phase pair moves the current on through the
+ *  period the slices have just latched, then through each state for the
+ *  period after, and the state is chosen whose phase currents are nearest
+ *  current_cmd in the pair for com_step, plus mpc_lambda for every switch
+ *  it changes. A phase leaving the pair is taken as freewheeled to zero,
+ *  and the shunt only reads the current in a period with a pair on
+ *  A state that would turn on the other switch of a leg that is on now is
+ *  left out, as the slices switch both at the same wrap with no dead time
+ *  The freewheel state only keeps on a low side that is on, so it is never left out
+ *  Not inlined, so tools/wcet.py can bound the loop over the states, and
+ *  counts only the longest cur_update mode
+ */
+static __attribute__((noinline)) void mpc_update(void) {
+  int32_t f[3], e, v, i, x0, x, cost, best_cost = INT32_MAX, best_i = 0;
+  int32_t ref = (int32_t)current_cmd << MDL_Q;
+  uint32_t bits, best_bits = 0;
+  uint s, k, h, l, hp, lp, best = MPC_FREEWHEEL;
+  uint hr = com_high[com_step], lr = com_low[com_step];
+
+  for (k = 0; k < 3; ++k) {
+    if (com_dir == REV) {
+      f[k] = -mpc_shape(-elec_angle - k * ANGLE_DEG(120)); // rotor angle -elec_angle, turning back
+    } else {
+      f[k] = mpc_shape(elec_angle - k * ANGLE_DEG(120));
+    }
+  }
+  e = ((int32_t)(angle_step >> 12) * motor.mdl_ke) >> 7; // pair back EMF per shape difference
+  v = 2 * COM_MAG_MAX * adc_vbus * motor.mdl_kv; // a period fully on
+  hp = com_high[mpc_pair];
+  lp = com_low[mpc_pair];
+  if (mpc_state != MPC_FREEWHEEL) {
+    i = (cf_sample << MDL_Q) + (1 << (MDL_Q - 1)) + v; // reading truncates, so + 1/2
+  } else {
+    i = mpc_i;
+  }
+  i -= 2 * (i >> MDL_Q) * motor.mdl_kr + e * (f[hp] - f[lp]);
+  if (i < 0) {
+    i = 0;                              // diodes stop it
+  }
+  for (s = 0; s < MPC_STATES; ++s) {
+    if (s == MPC_FREEWHEEL) {
+      h = hp;
+      l = lp;
+      x0 = i;
+      bits = 1u << (2 * l + 1);
+      x = x0 - 2 * (x0 >> MDL_Q) * motor.mdl_kr - e * (f[h] - f[l]);
+      if (x < 0) {
+        x = 0;
+      }
+    } else {
+      h = com_high[s];
+      l = com_low[s];
+      x0 = (((h == hp) - (h == lp)) - ((l == hp) - (l == lp))) * i / 2; // the pair's share
+      bits = (1u << (2 * h)) | (1u << (2 * l + 1));
+      x = x0 + v - 2 * (x0 >> MDL_Q) * motor.mdl_kr - e * (f[h] - f[l]);
+    }
+    if (((bits & (mpc_bits >> 1)) | ((bits >> 1) & mpc_bits)) & 0x15) {
+      continue;                         // a leg would go straight from one side to the other
+    }
+    cost = (int32_t)(mpc_lambda * mpc_changed(bits, mpc_bits)) << MDL_Q;
+    for (k = 0; k < 3; ++k) {
+      cost += abs((k == h ? x : k == l ? -x : 0) - (k == hr ? ref : k == lr ? -ref : 0));
+    }
+    if (cost < best_cost) {
+      best_cost = cost;
+      best = s;
+      best_i = x0;
+      best_bits = bits;
+    }
+  }
+  mpc_changes += mpc_changed(best_bits, mpc_bits);
+  mpc_state = best;
+  if (best != MPC_FREEWHEEL) {
+    mpc_pair = best;
+  }
+  mpc_i = best_i;
+  mpc_bits = best_bits;
+  for (k = 0; k < 3; ++k) {
+    pwm_set_gpio_level(PWM_1H + 2 * k, best_bits & (1u << (2 * k)) ? COM_FULL : 0);
+    pwm_set_gpio_level(PWM_1L + 2 * k, best_bits & (1u << (2 * k + 1)) ? COM_FULL : 0);
+  }
+  ovl_t = 0xff;                         // the states take the place of the overlap
+}
+
+/**
+ *  @brief current_wrap - Fast current loop update at the wrap
+ *
+ *  The high side is on here. With centre-aligned pwm this is the middle of
+ *  its pulse, where the current is the period's average
+ */
+static inline void current_wrap(void) {
+  cf_duty = com_mag;                    // just latched by the slices, cf_sample read with it
+  if (pwm_mode == CUR_UPDATE_DEADBEAT) {
+    current_deadbeat();
+  } else if (pwm_mode == CUR_UPDATE_MPC) {
+    mpc_update();
+  } else {
+    current_fast(cf_sample);
+  }
+}
+
+/**
+ *  @brief current_mid - Fast current loop update at the peak
+ *
+ *  The shunt is in the dc link and reads nothing with the high side off,
+ *  so the current is predicted from the valley sample: the latched duty
+ *  across the two phases' R and L, less their back EMF
+ *  Called by pwm_isr for PWM_MID_SLICE's wrap
+ */
+static inline void current_mid(void) {
+  int32_t i = cf_sample + ((cf_duty * adc_vbus * motor.mdl_kv - cf_sample * motor.mdl_kr
+                            - (int32_t)(angle_step >> 12) * motor.mdl_ke) >> MDL_Q);
+  pwm_clear_irq(PWM_MID_SLICE);
+  if (com_locked && !loop_type) {
+    current_fast(i);
+  }
+}
+
+/**
+ *  @brief current_gains - Fast current loop gains for the bus voltage
+ *
+ *  The gains cancel the R/L pole and cross over for 60 degrees of phase
+ *  margin with the 1.5 period delay from a sample at the wrap. The peak's
+ *  prediction takes up to half a period of that and damps the loop, which
+ *  then takes twice the gain for the same overshoot
+ *  Called while the motor is stopped
+ */
+static void current_gains(void) {
+  int32_t v = adc_vbus ? adc_vbus : 1;
+  if (pwm_mode == CUR_UPDATE_DOUBLE) {
+    cf_kp = motor.cf_kp_v * 2 / v;      // twice the crossover, the same zero
+    cf_ki = motor.cf_ki_v / v;          //   at two updates a period
+  } else {
+    cf_kp = motor.cf_kp_v / v;
+    cf_ki = motor.cf_ki_v / v;
+  }
+  db_inv = (1 << 24) / (2 * motor.mdl_kv * v);
+  db_pred = db_dist = 0;                // no current at the first valley
+  mpc_state = MPC_FREEWHEEL;
+  mpc_bits = 0;
+  mpc_i = 0;
+  cf_integral = COM_MAG_MIN << CF_Q;
+}
+
+/**
+ *  @brief  pwm_mode_apply - Set the bridge slices up for cur_update
+ *
+ *  Edge-aligned, or for CUR_UPDATE_DOUBLE and _DEADBEAT centre-aligned at
+ *  half the prescaler, which keeps the period and the levels. The high
+ *  side pulse is then centred on the valley, where the wrap interrupt
+ *  samples it, and for CUR_UPDATE_DOUBLE PWM_MID_SLICE wraps at the peak
+ *  for the second update. The slices only latch levels at the valley, so
+ *  the peak update's are the ones used
+ *  The slices restart in step, with the speed input's if it is running
+ */
+void pwm_mode_apply(void) {
+  uint slice_num = pwm_gpio_to_slice_num(PWM_1H);
+  uint32_t mask = 7u << slice_num;
+  pwm_config config = pwm_get_default_config();
+  bool centred;
+  uint p;
+
+  pwm_mode = cur_update;
+  centred = pwm_mode == CUR_UPDATE_DOUBLE || pwm_mode == CUR_UPDATE_DEADBEAT;
+  if (speed_in_mode == SPEED_SRC_RC || speed_in_mode == SPEED_SRC_FREQ) {
+    mask |= 1u << pwm_gpio_to_slice_num(SPEED_IN);
+  }
+  pwm_set_mask_enabled(mask & ~(7u << slice_num));
+  pwm_config_set_clkdiv(&config, centred ? PWM_PRESCALER / 2.f : PWM_PRESCALER);
+  pwm_config_set_phase_correct(&config, centred);
+  pwm_config_set_wrap(&config, COM_MAG_MAX);
+  for (p = 0; p < 3; ++p) {             // one slice per phase, A = high side, B = low side
+    pwm_init(slice_num + p, &config, false);
+  }
+  com_apply();                          // pwm_init cleared the levels
+  if (pwm_mode == CUR_UPDATE_DOUBLE) {
+    config = pwm_get_default_config();
+    pwm_config_set_clkdiv(&config, PWM_PRESCALER);
+    pwm_config_set_wrap(&config, COM_MAG_MAX);
+    pwm_init(PWM_MID_SLICE, &config, false);
+    pwm_set_counter(PWM_MID_SLICE, PWM_MID_START);
+    mask |= 1u << PWM_MID_SLICE;
+  }
+  pwm_set_irq_enabled(PWM_MID_SLICE, pwm_mode == CUR_UPDATE_DOUBLE);
+  pwm_set_mask_enabled(mask);
+}
+
+/**
+ *  @brief set_loop_type - Request speed or torque control
+ *
+ *  Entry point for the UI and any host protocol
+ *  The change is made by pwm_isr() in loop_type_update() so it never lands
+ *  between a sample and its regulator update
+ *
+ *  @param type  0 = torque control, 1 = speed control
+ */
+void set_loop_type(unsigned char type) {
+  loop_type_req = type ? 1 : 0;
+}
+
+/**
+ *  @brief loop_type_update - Bumpless change between speed and torque control
+ *
+ *  The new loop's command starts from the present speed or current and its
+ *  integrator from the present duty, so the first output equals com_mag
+ *  The command then slews to the pot or UI setting through the handover
+ */
+void loop_type_update(void) {
+  if (loop_type_req == loop_type) {
+    return;
+  }
+  if (loop_type_req) {
+    speed_cmd = speed;
+    s_integral = (int32_t)com_mag << 8;
+    if (pwm_mode == CUR_UPDATE_MPC) {
+      com_apply();                      // six-step levels back from mpc_update()'s
+    }
+    handover_start(speed_cmd);
+  } else {
+    current_sample();
+    current_cmd = adc_current;
+    c_integral = (int32_t)com_mag << 8;
+    cf_integral = (int32_t)com_mag << CF_Q;
+    db_pred = (int32_t)adc_current << MDL_Q;
+    mpc_state = MPC_FREEWHEEL;          // near enough for the first mpc_update()
+    mpc_pair = com_step;
+    mpc_i = db_pred;
+    handover_start(current_cmd);
+  }
+  pot_due = 0;                          // next pot reading a full period on
+  loop_type = loop_type_req;
+  bus_post(EVT_LOOP_TYPE, loop_type);
+}
+
+/**
+ *  @brief motor_load - Load a motor profile
+ *
+ *  All the floating point work is done here so the ISR only ever uses the
+ *  integer constants in motor
+ *  Speed counts are rated_speed / 255, current counts 1 / CURRENT_COUNTS_PER_A
+ *  The regulators run once per function loop at LOOP_FREQ, the fast
+ *  current loop every period and its gains scale with adc_vbus
+ *  The new constants are swapped in with interrupts held off
+ *
+ *  @param index  entry in motor_profiles[]
+ *  @return 0 if index is out of range
+ */
+unsigned char motor_load(uint index) {
+  motor_params m;
+  const motor_profile *mp;
+  float duty = COM_MAG_MAX * 256.f;     // regulator output for 100% duty
+  float rpm_per_count, hz_per_count, ilim, ld, rd, kp, half;
+
+  if (index >= MOTOR_PROFILES) {
+    return 0;
+  }
+  mp = &motor_profiles[index];
+  rpm_per_count = mp->rated_speed / 255.f;
+  hz_per_count = rpm_per_count / 60.f * mp->pole_pairs;
+  m.profile = mp;
+  m.s_kp = lrintf(mp->speed_kp * duty * rpm_per_count / 1000.f);
+  m.s_ki = lrintf(mp->speed_ki * duty * rpm_per_count / 1000.f / LOOP_FREQ);
+  m.c_kp = lrintf(mp->current_kp * duty / CURRENT_COUNTS_PER_A);
+  m.c_ki = lrintf(mp->current_ki * duty / CURRENT_COUNTS_PER_A / LOOP_FREQ);
+  ilim = ILIM_RATIO * mp->rated_current * CURRENT_COUNTS_PER_A;
+  m.ilim_adc = ilim > 255.f ? 255 : (unsigned char)ilim;
+  m.step_per_count = (uint32_t)(hz_per_count * 4294967296.f / PWM_FREQ);
+  m.align_periods = (uint32_t)mp->align_ms * PWM_FREQ / 1000;
+  m.align_mag = (unsigned char)(mp->align_duty * COM_MAG_MAX);
+  m.start_step = (uint32_t)(mp->start_rpm / 60.f * mp->pole_pairs * 4294967296.f / PWM_FREQ);
+  m.ramp_step = (uint32_t)(mp->ramp_rpm_s / 60.f * mp->pole_pairs * 4294967296.f / PWM_FREQ
+                           * 256.f / PWM_FREQ);
+  ld = 2.f * mp->l;                     // two phases conduct, line to line
+  rd = 2.f * mp->r;
+  kp = ld * CF_MARGIN / (1.5f * PWM_PERIOD * 1e-6f); // V per A, sampled at the wrap
+  m.cf_kp_v = lrintf(kp * COM_MAG_MAX * VBUS_COUNTS_PER_V / CURRENT_COUNTS_PER_A * (1 << CF_Q));
+  m.cf_ki_v = lrintf(m.cf_kp_v * rd / ld * PWM_PERIOD * 1e-6f); // zero on the R/L pole
+  half = PWM_PERIOD * 0.5e-6f / ld * CURRENT_COUNTS_PER_A * (1 << MDL_Q); // counts per V
+  m.mdl_kv = lrintf(half / COM_MAG_MAX / VBUS_COUNTS_PER_V);
+  m.mdl_kr = lrintf(half * rd / CURRENT_COUNTS_PER_A);
+  m.mdl_ke = lrintf(half * 2.f * mp->ke * 4096.f / 4294967296.f * PWM_FREQ * 2.f * (float)M_PI
+                    / mp->pole_pairs);
+  m.start_ke = lrintf(2.f * mp->ke * 4096.f / 4294967296.f * PWM_FREQ * 2.f * (float)M_PI
+                      / mp->pole_pairs * COM_MAG_MAX * VBUS_COUNTS_PER_V); // line to line
+
+  uint32_t irq = save_and_disable_interrupts();
+  motor = m;
+  motor_index = index;
+  restore_interrupts(irq);
+  return 1;
+}
+
+/**
+ *  @brief  led_blink - Control blinking of status leds
+ *
+ *  Yel LED blinking: motor is stopped (UART is in Control) but the MCU has power 
+ *  Grn LED blinking: motor is running
+ *  Red LED blinking: fault occured and motor stopped - cleared by
+ *  toggling the "RUN STOP/RESET" switch
+ *  blink_timer callback every BLINK_MS / 2, on for the first half of the period
+ */
+void led_blink(void) {
+	if (blink_count == 0) {               // indicate a FAULT with red led
+		//if ((PWMFSTAT & 0x02) != 0) {
+    //  gpio_put(LED_RED, 1);
+		//}
+		//if ((PWMFSTAT & 0x01) != 0) {     // indicate the motor is in STOP/RESET with yellow led
+    //  gpio_put(LED_YEL, 1);
+		//	PWMFSTAT |= 0x07;
+		//} else {
+    //  gpio_put(LED_GRN, 1); 				  // indicate the motor is in START with green led
+		//}
+    #if UART
+    if (ui_control) {                   // indicate the motor is in UI, thus hardware control is disabled
+      gpio_put(LED_YEL, 1);
+      gpio_put(LED_GRN, 0);
+    } else {
+      gpio_put(LED_YEL, 0);
+      gpio_put(LED_GRN, 1);             // TEMP flash green in hardware mode
+    }
+		#endif
+		blink_count = 1;
+	} else {
+    gpio_put(LED_YEL, 0);
+    gpio_put(LED_RED, 0);
+    gpio_put(LED_GRN, 0);
+		blink_count = 0;
+	}
+}
+
+/**
+ *  @brief direction_update
+ *
+ *  Reads direction switch on SW_DIR
+ *  Switch has to be in same position for 15 readings of the direction switch
+ *  = 500us x 15 = 7.5mS
+ *  dir_timer callback every DIR_PERIOD_US
+ */
+void direction_update(void) {
+  unsigned char last = direction;
+	// Direction Switch update
+  direction_sw = gpio_get(SW_DIR);    // get dir switch value
+	if (direction_count < 5) {
+		direction = FWD;
+		direction_count = 5;
+	}
+	if (direction_count > 20) {
+		direction = REV;
+		direction_count = 20;
+	}
+	if (direction_sw == 0) {
+		direction_count--;
+	} else {
+		direction_count++;
+	}
+if (i2c_control)
+  direction = i2c_reg[I2C_REG_DIR] ? REV : FWD;
+#if UART
+if (ui_control)
+  direction = ui_direction;
+#endif
+  if (direction != last) {
+    bus_post(EVT_DIRECTION, direction);
+  }
+}
+
+/**
+ *  @brief  tw_insert - Put a timer in the wheel slot for its expiry time
+ *
+ *  Level 0 holds the next 2^TW_BITS ticks one per slot, the higher levels
+ *  2^TW_BITS times coarser. A higher level slot is cascaded down when the
+ *  lower level wraps into its block, by then every timer in it is in range
+ */
+static void tw_insert(sw_timer *t) {
+  uint32_t delta = t->expires - tw_now, when = t->expires;
+  sw_timer **head;
+  if (delta < TW_SLOTS) {
+    head = &tw_slot[0][when & TW_MASK];
+  } else if (delta < 1u << (2 * TW_BITS)) {
+    head = &tw_slot[1][(when >> TW_BITS) & TW_MASK];
+  } else {
+    if (delta >= 1u << (3 * TW_BITS)) {
+      when = tw_now + (1u << (3 * TW_BITS)) - 1; // out of range - cascaded round again
+    }
+    head = &tw_slot[2][(when >> (2 * TW_BITS)) & TW_MASK];
+  }
+  t->next = *head;
+  if (t->next) {
+    t->next->pprev = &t->next;
+  }
+  t->pprev = head;
+  *head = t;
+}
+
+static inline void tw_unlink(sw_timer *t) {
+  if (t->pprev) {
+    *t->pprev = t->next;
+    if (t->next) {
+      t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+  }
+}
+
+/**
+ *  @brief  tw_cascade - Move the timers of a higher level slot down a level
+ */
+static void tw_cascade(uint level, uint slot) {
+  sw_timer *t = tw_slot[level][slot], *next;
+  tw_slot[level][slot] = NULL;
+  for (; t; t = next) {
+    next = t->next;
+    tw_insert(t);
+  }
+}
+
+/**
+ *  @brief  timer_start - Start or restart a software timer, O(1)
+ *
+ *  Safe from any context on core 0. fn is called from pwm_isr
+ *
+ *  @param ticks   first expiry, TW_US() or TW_MS() from now, at least 1 tick
+ *  @param period  reload in ticks, 0 for a one shot timer
+ */
+void timer_start(sw_timer *t, uint32_t ticks, uint32_t period, void (*fn)(void)) {
+  uint32_t irq = save_and_disable_interrupts();
+  tw_unlink(t);
+  t->fn = fn;
+  t->period = period;
+  t->expires = tw_now + (ticks ? ticks : 1);
+  tw_insert(t);
+  restore_interrupts(irq);
+}
+
+/**
+ *  @brief  timer_stop - Stop a software timer, O(1)
+ */
+void timer_stop(sw_timer *t) {
+  uint32_t irq = save_and_disable_interrupts();
+  tw_unlink(t);
+  restore_interrupts(irq);
+}
+
+/**
+ *  @brief  timer_service - Advance the timer wheel to time_us_32(), run expired timers
+ *
+ *  Called by pwm_isr every period, so timers are independent of the pwm
+ *  frequency. At most TW_CATCHUP ticks are processed per call; after a long
+ *  stall (flash writes) the wheel catches up over the following periods
+ */
+void timer_service(void) {
+  uint32_t now_us = time_us_32();
+  uint n;
+  sw_timer *t;
+  for (n = 0; n < TW_CATCHUP && now_us - tw_last_us >= TW_TICK_US; ++n) {
+    uint32_t now = ++tw_now;
+    tw_last_us += TW_TICK_US;
+    if ((now & TW_MASK) == 0) {
+      if (((now >> TW_BITS) & TW_MASK) == 0) {
+        tw_cascade(2, (now >> (2 * TW_BITS)) & TW_MASK);
+      }
+      tw_cascade(1, (now >> TW_BITS) & TW_MASK);
+    }
+    while ((t = tw_slot[0][now & TW_MASK])) {
+      tw_unlink(t);
+      if (t->period) {
+        t->expires += t->period;
+        tw_insert(t);
+      }
+      t->fn();
+    }
+  }
+}
+
+/**
+ *  @brief  speed_in_sample - Read the speed input slice
+ *
+ *  RC: when the pin is low, every pulse since the last low sample is in the
+ *  count, and with RC_SAMPLE_US shorter than the gap between pulses that is
+ *  one pulse. Frequency: edges in FREQ_WINDOW_MS
+ *  A valid pulse under RC_MIN_US is a stick at its low end, command 0
+ *  A line stuck high gives no pulses, so it times out like a lost signal
+ *  speed_in_timer callback
+ */
+void speed_in_sample(void) {
+  uint slice = pwm_gpio_to_slice_num(SPEED_IN);
+  uint16_t count, delta;
+  int32_t cmd = 0;
+  bool valid = false;
+
+  if (speed_src == SPEED_SRC_RC) {
+    if (!gpio_get(SPEED_IN)) {          // high is in a pulse - wait for it to end
+      count = pwm_get_counter(slice);
+      delta = count - speed_in_count;
+      speed_in_count = count;
+      if (delta >= RC_VALID_MIN_US && delta <= RC_VALID_MAX_US) {
+        speed_in_width = delta;
+        cmd = ((int32_t)delta - RC_MIN_US) * 255 / (RC_MAX_US - RC_MIN_US);
+        valid = true;
+      }
+    }
+  } else {
+    count = pwm_get_counter(slice);
+    delta = count - speed_in_count;
+    speed_in_count = count;
+    if (delta) {
+      speed_in_hz = (uint32_t)delta * 1000 / FREQ_WINDOW_MS;
+      cmd = (int32_t)speed_in_hz * 255 / FREQ_MAX_HZ;
+      valid = true;
+    }
+  }
+  if (valid) {
+    speed_in_cmd = cmd < 0 ? 0 : cmd > 255 ? 255 : cmd;
+    speed_in_last = tw_now;
+    if (!speed_in_ok) {
+      speed_in_ok = 1;
+      bus_post(EVT_SPEED_IN, 1);
+    }
+  } else if (speed_in_ok && tw_now - speed_in_last > TW_MS(SPEED_IN_TIMEOUT_MS)) {
+    speed_in_ok = 0;
+    speed_in_cmd = 0;                   // lost - fall back to the minimum command
+    bus_post(EVT_SPEED_IN, 0);
+  }
+}
+
+/**
+ *  @brief  speed_in_setup - Set up slice 3 to measure the speed input
+ *
+ *  RC: the counter runs at 1MHz while the B pin is high, so it adds up
+ *  pulse widths. Frequency: the counter counts rising edges on the B pin
+ *  Either way the slice does the measuring, there is no interrupt per edge
+ *  Called again by loop_start when speed_src changes
+ */
+static void speed_in_setup(void) {
+  uint slice = pwm_gpio_to_slice_num(SPEED_IN);
+  pwm_config c = pwm_get_default_config();
+  speed_in_mode = speed_src;
+  speed_in_ok = 0;
+  speed_in_cmd = 0;
+  if (speed_src == SPEED_SRC_POT) {
+    pwm_set_enabled(slice, false);
+    timer_stop(&speed_in_timer);
+    return;
+  }
+  gpio_set_function(SPEED_IN, GPIO_FUNC_PWM);
+  if (speed_src == SPEED_SRC_RC) {
+    pwm_config_set_clkdiv_mode(&c, PWM_DIV_B_HIGH);
+    pwm_config_set_clkdiv(&c, RC_CLKDIV);
+  } else {
+    pwm_config_set_clkdiv_mode(&c, PWM_DIV_B_RISING);
+    pwm_config_set_clkdiv(&c, 1.f);
+  }
+  pwm_init(slice, &c, true);
+  speed_in_count = pwm_get_counter(slice);
+  speed_in_last = tw_now;
+  timer_start(&speed_in_timer, 1, speed_src == SPEED_SRC_RC ? TW_US(RC_SAMPLE_US) :
+              TW_MS(FREQ_WINDOW_MS), speed_in_sample);
+}
+
+/**
+ *  @brief  loop_start - Start the next run of the function loop steps
+ *
+ *  loop_timer callback every LOOP_PERIOD_US
+ */
+void loop_start(void) {
+  pwm_step = 0;
+  if (speed_src != speed_in_mode) {
+    speed_in_setup();                   // speed_src changed
+  }
+  if (!com_on) {
+    if (cur_update != pwm_mode) {
+      pwm_mode_apply();                 // cur_update changed
+    }
+    current_gains();                    // for the bus voltage at start
+  }
+}
+
+/**
+ *  @brief  pot_tick - Ask for a new potentiometer reading
+ *
+ *  pot_timer callback every POT_PERIOD_US
+ */
+void pot_tick(void) {
+  pot_due = 1;
+}
+
+/**
+ *  @brief  init_timers - Start the timebase and the periodic service timers
+ */
+void init_timers(void) {
+  tw_last_us = time_us_32();
+  timer_start(&loop_timer, TW_US(LOOP_PERIOD_US), TW_US(LOOP_PERIOD_US), loop_start);
+  timer_start(&dir_timer, TW_US(DIR_PERIOD_US), TW_US(DIR_PERIOD_US), direction_update);
+  timer_start(&pot_timer, TW_US(POT_PERIOD_US), TW_US(POT_PERIOD_US), pot_tick);
+  timer_start(&blink_timer, TW_MS(BLINK_MS / 2), TW_MS(BLINK_MS / 2), led_blink);
+  timer_start(&ilim_timer, TW_MS(1000), TW_MS(1000), ilim_second);
+  timer_start(&advance_timer, TW_MS(ADV_PERIOD_MS), TW_MS(ADV_PERIOD_MS), advance_update);
+  speed_in_setup();
+}
+
+/**
+ *  @brief  watch_sample - Copy the watched variables into a frame
+ *
+ *  Called once at the end of pwm_isr, samples every watch_div periods
+ */
+static inline void watch_sample(void) {
+  uint n, count = watch_count;
+  if (count == 0 || ++watch_tick < watch_div) {
+    return;
+  }
+  watch_tick = 0;
+  if (watch_head - watch_tail >= WATCH_FRAMES) {
+    watch_dropped++;
+    return;
+  }
+  watch_frame *f = &watch_ring[watch_head & (WATCH_FRAMES - 1)];
+  f->time = time_us_32();
+  for (n = 0; n < count; ++n) {
+    switch (watch_size[n]) {
+      case 1:  f->value[n] = *(const volatile uint8_t *)watch_addr[n]; break;
+      case 2:  f->value[n] = *(const volatile uint16_t *)watch_addr[n]; break;
+      default: f->value[n] = *(const volatile uint32_t *)watch_addr[n]; break;
+    }
+  }
+  __compiler_memory_barrier();
+  watch_head++;
+}
+
+/**
+ *  @brief  watch_send - Print sampled frames for tools/watch.py
+ *
+ *  Runs as a background task. One line per frame:
+ *  "W <time> <value> ..." in hex, values in the order they were given
+ */
+void watch_send(void) {
+  uint n;
+  while (watch_tail != watch_head) {
+    const watch_frame *f = &watch_ring[watch_tail & (WATCH_FRAMES - 1)];
+    printf("W %08lx", (unsigned long)f->time);
+    for (n = 0; n < watch_count; ++n) {
+      printf(" %lx", (unsigned long)f->value[n]);
+    }
+    printf("\n");
+    __compiler_memory_barrier();
+    watch_tail++;
+  }
+}
+
+/**
+ *  @brief  watch_set - Set the watch list from a command line
+ *
+ *  "<divisor> <address>:<size> ..." with the address in hex and the size
+ *  1, 2 or 4. A divisor of 0 or an empty list stops the watch
+ *  Addresses must be aligned and, on the Pico, in SRAM so a typo can't fault
+ *  Returns the number of variables watched, or -1 if the line is bad
+ */
+int watch_set(const char *line) {
+  char *end;
+  uint n = 0;
+  unsigned long div = strtoul(line, &end, 10);
+  watch_count = 0;                      // stop sampling while the list changes
+  __compiler_memory_barrier();
+  while (div && *end) {
+    unsigned long addr = strtoul(end, &end, 16), size;
+    if (*end != ':') {
+      break;
+    }
+    size = strtoul(end + 1, &end, 10);
+    if (n == WATCH_MAX || (size != 1 && size != 2 && size != 4) || addr % size) {
+      return -1;
+    }
+#if PICO_ON_DEVICE
+    if (addr < SRAM_BASE || addr + size > SRAM_END) {
+      return -1;
+    }
+#endif
+    watch_addr[n] = (const volatile void *)(uintptr_t)addr;
+    watch_size[n++] = size;
+    while (*end == ' ') {
+      ++end;
+    }
+  }
+  watch_tick = 0;
+  watch_div = div;
+  watch_tail = watch_head;              // drop frames of the old list
+  __compiler_memory_barrier();
+  watch_count = n;
+  return n;
+}
+
+/**
+ *  @brief  state_publish - Copy the ISR shared state to state_pub
+ *
+ *  Called once at the end of pwm_isr. state_seq is odd while the copy is
+ *  being written so readers can detect and retry a torn read.
+ */
+static inline void state_publish(void) {
+  uint32_t seq = state_seq;
+  state_seq = seq + 1;
+  __dmb();                              // odd count visible before the data changes
+  state_pub.time = time_us_32();
+  state_pub.ilim_trips_per_sec = ilim_trips_per_sec > 0xffff ? 0xffff : ilim_trips_per_sec;
+  state_pub.speed_cmd = speed_cmd;
+  state_pub.current_cmd = current_cmd;
+  state_pub.speed = speed;
+  state_pub.adc_vbus = adc_vbus;
+  state_pub.adc_current = adc_current;
+  state_pub.com_mag = com_mag;
+  state_pub.com_step = com_step;
+  state_pub.direction = direction;
+  state_pub.loop_type = loop_type;
+  state_pub.handover = pot_held ? 2 : handover_active ? 1 : 0;
+  __dmb();                              // data visible before the even count
+  state_seq = seq + 2;
+}
+
+/**
+ *  @brief  state_snapshot - Consistent copy of the ISR shared state
+ *
+ *  Retries while pwm_isr is publishing, never disables interrupts.
+ *  Safe from main() and from core 1.
+ */
+void state_snapshot(isr_state *s) {
+  uint32_t seq;
+  do {
+    while ((seq = state_seq) & 1) {     // writer active on the other core
+      tight_loop_contents();
+    }
+    __dmb();
+    memcpy(s, &state_pub, sizeof(*s));
+    __dmb();
+  } while (state_seq != seq);
+}
+
+/**
+ *  @brief  spi_check - Sum of a frame's bytes, zero for a good frame
+ */
+static inline uint8_t spi_check(const void *frame) {
+  const uint8_t *b = frame;
+  uint8_t sum = 0;
+  uint i;
+  for (i = 0; i < SPI_FRAME; ++i) {
+    sum += b[i];
+  }
+  return sum;
+}
+
+/**
+ *  @brief  spi_frame_in - Take a frame from the master, at the end of its transfer
+ *
+ *  Called by spi_dma_isr with the rx channel stopped. A good frame waits in
+ *  spi_frame for the next pwm_isr, a newer one replaces it
+ */
+void spi_frame_in(void) {
+  if (spi_rx.magic != SPI_MAGIC || spi_check(&spi_rx)) {
+    spi_bad++;
+    if (spi_bad_since < 255) {
+      spi_bad_since++;
+    }
+    return;
+  }
+  spi_frame = spi_rx;
+  spi_frame_time = time_us_32();
+  spi_pending = 1;
+  spi_good++;
+}
+
+/**
+ *  @brief  spi_reply - Fill the spare reply buffer from this period's state
+ *
+ *  Called by pwm_isr after state_publish(), so the master always gets the
+ *  state of the last complete period
+ */
+static inline void spi_reply(void) {
+  spi_reply_frame *r = &spi_tx[spi_tx_busy ^ 1];
+  r->magic = SPI_MAGIC;
+  r->seq = spi_seq;
+  r->status = (spi_control ? SPI_ST_CONTROL : 0) | (state_pub.loop_type ? SPI_ST_SPEED : 0) |
+              (state_pub.direction ? SPI_ST_REV : 0) | (state_pub.handover ? SPI_ST_SLEWING : 0);
+  r->faults = (state_pub.ilim_trips_per_sec ? SPI_F_ILIM : 0) |
+              (speed_src != SPEED_SRC_POT && !speed_in_ok ? SPI_F_SPEED_IN : 0) |
+              (spi_bad_since ? SPI_F_LINK : 0);
+  r->time = state_pub.time;
+  r->ilim_trips_per_sec = state_pub.ilim_trips_per_sec;
+  r->latency_us = spi_lat_last;
+  r->speed = state_pub.speed;
+  r->adc_vbus = state_pub.adc_vbus;
+  r->adc_current = state_pub.adc_current;
+  r->speed_cmd = state_pub.speed_cmd;
+  r->current_cmd = state_pub.current_cmd;
+  r->com_mag = state_pub.com_mag;
+  r->com_step = state_pub.com_step;
+  r->check = 0;
+  r->check = -spi_check(r);
+}
+
+/**
+ *  @brief  spi_apply - Apply the master's frame at the start of a pwm period
+ *
+ *  The setpoint goes to handover_update() and the mode to set_loop_type(),
+ *  so a frame takes effect on the same period boundary as a pot or UI change
+ *  Control is dropped when no good frame arrives for SPI_TIMEOUT_US
+ */
+void spi_apply(void) {
+  uint32_t now, lat;
+  unsigned char ctl;
+  if (spi_pending) {
+    spi_pending = 0;
+    now = time_us_32();
+    lat = now - spi_frame_time;
+    spi_lat_last = lat > 0xffff ? 0xffff : lat;
+    spi_lat_sum += lat;
+    if (lat > spi_lat_max) {
+      spi_lat_max = lat;
+    }
+    spi_last = now;
+    spi_seq = spi_frame.seq;
+    spi_bad_since = 0;
+    ctl = spi_frame.flags & SPI_CONTROL;
+    if (ctl) {
+      set_loop_type(spi_frame.flags & SPI_SPEED_LOOP);
+      spi_cmd = spi_frame.cmd;
+      if ((spi_frame.flags & SPI_SPEED_LOOP) && spi_cmd < SPEED_CMD_MIN) {
+        spi_cmd = SPEED_CMD_MIN;
+      }
+    }
+    if (ctl != spi_control) {
+      spi_control = ctl;
+      bus_post(EVT_SPI_LINK, ctl);
+    }
+  } else if (spi_control && time_us_32() - spi_last > SPI_TIMEOUT_US) {
+    spi_control = 0;                    // link lost - back to the pot
+    spi_timeouts++;
+    bus_post(EVT_SPI_LINK, 0);
+  }
+  spi_reply();
+}
+
+#if SPI_LINK
+/**
+ *  @brief  spi_arm - Set both dma channels up for the next frame
+ */
+static void spi_arm(void) {
+  spi_tx_busy ^= 1;                     // send the reply spi_apply filled last
+  dma_channel_transfer_from_buffer_now(spi_tx_chan, &spi_tx[spi_tx_busy], SPI_FRAME);
+  dma_channel_transfer_to_buffer_now(spi_rx_chan, &spi_rx, SPI_FRAME);
+}
+
+/**
+ *  @brief  spi_dma_isr - A frame has arrived, take it and arm the next one
+ */
+void spi_dma_isr(void) {
+  uint32_t t0 = SYST_CVR, cycles;
+  dma_irqn_acknowledge_channel(SPI_DMA_IRQ - DMA_IRQ_0, spi_rx_chan);
+  spi_frame_in();
+  spi_arm();
+  cycles = (t0 - SYST_CVR) & 0x00ffffff;
+  spi_isr_cycles += cycles;
+  if (cycles > spi_isr_max) {
+    spi_isr_max = cycles;
+  }
+}
+
+/**
+ *  @brief  spi_reset - Set spi0 up as a slave, with empty fifos
+ */
+static void spi_reset(void) {
+  spi_init(spi0, SPI_BAUD);
+  spi_set_slave(spi0, true);
+  spi_set_format(spi0, 8, SPI_CPOL_1, SPI_CPHA_1, SPI_MSB_FIRST); // cs can stay low for the frame
+}
+#endif
+
+/**
+ *  @brief  spi_service - Resynchronise after a frame cut short
+ *
+ *  If chip select is high with part of a frame received, the master gave
+ *  up on it - drop it so the next frame starts at byte 0
+ */
+void spi_service(void) {
+#if SPI_LINK
+  uint32_t left = dma_channel_hw_addr(spi_rx_chan)->transfer_count, irq;
+  if (left == 0 || left == SPI_FRAME || !gpio_get(SPI_CS)) {
+    return;
+  }
+  irq = save_and_disable_interrupts();
+  if (gpio_get(SPI_CS) && dma_channel_hw_addr(spi_rx_chan)->transfer_count == left) {
+    dma_channel_abort(spi_rx_chan);
+    dma_channel_abort(spi_tx_chan);
+    spi_reset();
+    spi_arm();
+    spi_resyncs++;
+  }
+  restore_interrupts(irq);
+#endif
+}
+
+/**
+ *  @brief  init_spi - Start the spi slave link
+ *
+ *  spi0 on SPI_RX, SPI_CS, SPI_SCK and SPI_TX, mode 3. Each frame is
+ *  SPI_FRAME bytes each way, with chip select low for the whole frame
+ *  One dma channel sends the reply while another takes the command, and
+ *  spi_dma_isr runs once per frame
+ */
+void init_spi(void) {
+#if SPI_LINK
+  dma_channel_config c;
+  init_systick();                      // free running for the isr cost
+  spi_reset();
+  gpio_set_function(SPI_RX, GPIO_FUNC_SPI);
+  gpio_set_function(SPI_CS, GPIO_FUNC_SPI);
+  gpio_set_function(SPI_SCK, GPIO_FUNC_SPI);
+  gpio_set_function(SPI_TX, GPIO_FUNC_SPI);
+  spi_tx_chan = dma_claim_unused_channel(true);
+  c = dma_channel_get_default_config(spi_tx_chan);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_dreq(&c, spi_get_dreq(spi0, true));
+  dma_channel_configure(spi_tx_chan, &c, &spi_get_hw(spi0)->dr, spi_tx, 0, false);
+  spi_rx_chan = dma_claim_unused_channel(true);
+  c = dma_channel_get_default_config(spi_rx_chan);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, true);
+  channel_config_set_dreq(&c, spi_get_dreq(spi0, false));
+  dma_channel_configure(spi_rx_chan, &c, &spi_rx, &spi_get_hw(spi0)->dr, 0, false);
+  dma_irqn_set_channel_enabled(SPI_DMA_IRQ - DMA_IRQ_0, spi_rx_chan, true);
+  irq_set_exclusive_handler(SPI_DMA_IRQ, spi_dma_isr);
+  irq_set_enabled(SPI_DMA_IRQ, true);
+  spi_reply();
+  spi_arm();
+#endif
+}
+
+/**
+ *  @brief  spi_report - SPI link statistics
+ */
+void spi_report(void) {
+  uint32_t good = spi_good;
+  printf("\nSPI LINK:\n");
+  printf("%-16s: %s\n", "Control", spi_control ? "master" : "local");
+  printf("%-16s: %lu\n", "Good frames", (unsigned long)good);
+  printf("%-16s: %lu\n", "Bad frames", (unsigned long)spi_bad);
+  printf("%-16s: %lu\n", "Resyncs", (unsigned long)spi_resyncs);
+  printf("%-16s: %lu\n", "Timeouts", (unsigned long)spi_timeouts);
+  printf("%-16s: %lu avg %lu max\n", "Latency us", good ? (unsigned long)(spi_lat_sum / good) : 0ul,
+         (unsigned long)spi_lat_max);
+  printf("%-16s: %lu avg %lu max\n", "ISR cycles", good ? (unsigned long)(spi_isr_cycles / good) : 0ul,
+         (unsigned long)spi_isr_max);
+}
+
+/**
+ *  @brief  i2c_snapshot - Fill the read only registers from one pwm period
+ *
+ *  Taken once at the start of each read, so a block read of the state is
+ *  consistent however slowly the host clocks it out
+ */
+void i2c_snapshot(void) {
+  isr_state st;
+  state_snapshot(&st);
+  i2c_reg[I2C_REG_STATUS] = (i2c_control ? I2C_ST_HOST : 0) | (motor_on ? I2C_ST_RUN : 0) |
+                            (st.loop_type ? I2C_ST_SPEED : 0) | (st.direction ? I2C_ST_REV : 0) |
+                            (st.handover ? I2C_ST_SLEWING : 0);
+  i2c_reg[I2C_REG_FAULTS] = (st.ilim_trips_per_sec ? I2C_F_ILIM : 0) |
+                            (speed_src != SPEED_SRC_POT && !speed_in_ok ? I2C_F_SPEED_IN : 0) |
+                            (selftest_ok ? 0 : I2C_F_SELFTEST);
+  i2c_reg[I2C_REG_SPEED] = st.speed;
+  i2c_reg[I2C_REG_VBUS] = st.adc_vbus;
+  i2c_reg[I2C_REG_CURRENT] = st.adc_current;
+  i2c_reg[I2C_REG_SPEED_CMD] = st.speed_cmd;
+  i2c_reg[I2C_REG_CURRENT_CMD] = st.current_cmd;
+  i2c_reg[I2C_REG_DUTY] = st.com_mag;
+  i2c_reg[I2C_REG_ILIM] = st.ilim_trips_per_sec > 255 ? 255 : st.ilim_trips_per_sec;
+  memcpy(&i2c_reg[I2C_REG_TIME], &st.time, 4);
+}
+
+/**
+ *  @brief  i2c_rx - A byte written by the host
+ *
+ *  The first byte after the address sets the register pointer, the rest
+ *  go to the read/write registers from there on, staged until the stop
+ */
+void i2c_rx(uint8_t byte, bool first) {
+  if (first) {
+    i2c_ptr = byte;
+  } else {
+    if (i2c_ptr > I2C_REG_ID && i2c_ptr < I2C_REG_STATUS) {
+      i2c_stage[i2c_ptr] = byte;
+      i2c_staged |= 1u << i2c_ptr;
+    }
+    i2c_ptr++;
+  }
+}
+
+/**
+ *  @brief  i2c_tx - The next byte the host reads, 0xff past the end of the map
+ */
+uint8_t i2c_tx(void) {
+  uint8_t ptr = i2c_ptr++;
+  if (!i2c_reading) {
+    i2c_reading = 1;
+    i2c_snapshot();
+  }
+  return ptr < I2C_REGS ? i2c_reg[ptr] : 0xff;
+}
+
+/**
+ *  @brief  i2c_stop - End of a transaction
+ *
+ *  Commits the staged writes to the registers, so i2c_apply() only ever
+ *  sees whole transactions. pwm_isr is held off for the copy, or it could
+ *  come in between the control, setpoint and direction bytes
+ */
+void i2c_stop(void) {
+  uint r;
+  if (i2c_staged) {
+    uint32_t irq = save_and_disable_interrupts();
+    for (r = I2C_REG_CONTROL; r < I2C_REG_STATUS; ++r) {
+      if (i2c_staged & (1u << r)) {
+        i2c_reg[r] = i2c_stage[r];
+      }
+    }
+    i2c_written = 1;
+    restore_interrupts(irq);
+    i2c_staged = 0;
+  }
+  i2c_reading = 0;
+  i2c_transactions++;
+}
+
+#if I2C_LINK
+/**
+ *  @brief  i2c_isr - I2C slave interrupt handler
+ *
+ *  Received bytes, read requests and stop conditions are handled one byte
+ *  at a time, the clock is stretched until each read request is answered
+ */
+void i2c_isr(void) {
+  i2c_hw_t *hw = i2c_get_hw(i2c0);
+  uint32_t stat = hw->intr_stat, data;
+  while (hw->rxflr) {
+    data = hw->data_cmd;
+    i2c_rx(data & 0xff, data & I2C_IC_DATA_CMD_FIRST_DATA_BYTE_BITS);
+  }
+  if (stat & I2C_IC_INTR_STAT_R_RD_REQ_BITS) {
+    hw->data_cmd = i2c_tx();
+    (void)hw->clr_rd_req;
+  }
+  if (stat & I2C_IC_INTR_STAT_R_TX_ABRT_BITS) {
+    (void)hw->clr_tx_abrt;
+  }
+  if (stat & I2C_IC_INTR_STAT_R_STOP_DET_BITS) {
+    (void)hw->clr_stop_det;
+    i2c_stop();
+  }
+}
+#endif
+
+/**
+ *  @brief  i2c_apply - Apply the host's register writes at the start of a pwm period
+ *
+ *  Called by pwm_isr after spi_apply(), so a write takes effect on the same
+ *  period boundary as a frame, whatever the main loop is doing
+ *  Control changes post events and a run request is refused until the
+ *  self-test has passed, neither of which belongs in i2c_isr
+ */
+void i2c_apply(void) {
+  uint8_t ctl;
+  unsigned char host;
+  if (!i2c_written) {
+    return;
+  }
+  i2c_written = 0;
+  ctl = i2c_reg[I2C_REG_CONTROL];
+  host = ctl & I2C_CTL_HOST;
+  if (host) {
+    set_loop_type(ctl & I2C_CTL_SPEED);
+    i2c_cmd = i2c_reg[I2C_REG_CMD];
+    if ((ctl & I2C_CTL_SPEED) && i2c_cmd < SPEED_CMD_MIN) {
+      i2c_cmd = SPEED_CMD_MIN;
+    }
+    if ((ctl & I2C_CTL_RUN) && !motor_on && selftest_ok) {
+      motor_on = 1;
+      bus_post(EVT_MOTOR, 1);
+    } else if (!(ctl & I2C_CTL_RUN) && motor_on) {
+      motor_on = 0;
+      bus_post(EVT_MOTOR, 0);
+    }
+  }
+  if (host != i2c_control) {
+    i2c_control = host;
+    bus_post(EVT_I2C_LINK, host);
+  }
+}
+
+/**
+ *  @brief  init_i2c - Start the i2c slave at I2C_ADDR on I2C_SDA and I2C_SCL
+ */
+void init_i2c(void) {
+#if I2C_LINK
+  i2c_hw_t *hw = i2c_get_hw(i2c0);
+  i2c_init(i2c0, I2C_BAUD);
+  i2c_set_slave_mode(i2c0, true, I2C_ADDR);
+  gpio_set_function(I2C_SDA, GPIO_FUNC_I2C);
+  gpio_set_function(I2C_SCL, GPIO_FUNC_I2C);
+  gpio_pull_up(I2C_SDA);
+  gpio_pull_up(I2C_SCL);
+  hw->intr_mask = I2C_IC_INTR_MASK_M_RX_FULL_BITS | I2C_IC_INTR_MASK_M_RD_REQ_BITS |
+                  I2C_IC_INTR_MASK_M_TX_ABRT_BITS | I2C_IC_INTR_MASK_M_STOP_DET_BITS;
+  irq_set_exclusive_handler(I2C0_IRQ, i2c_isr);
+  irq_set_priority(I2C0_IRQ, I2C_IRQ_PRIORITY);
+  irq_set_enabled(I2C0_IRQ, true);
+#endif
+}
+
+/**
+ *  @brief  diag_sample - Add one sample to the vibration window
+ *
+ *  Called once per function loop after current_sample(), so the samples
+ *  are LOOP_PERIOD_US apart
+ *  A full window goes to core 1, or is dropped if core 1 is still busy
+ */
+static inline void diag_sample(void) {
+  uint8_t *buf = diag_buf[diag_fill];
+  uint8_t x;
+  x = diag_signal == DIAG_SPEED ? speed : adc_current;
+  if (diag_fill_n == 0) {
+    diag_step[diag_fill][0] = angle_step;
+  }
+  buf[diag_fill_n++] = x;
+  if (diag_fill_n < DIAG_N) {
+    return;
+  }
+  diag_fill_n = 0;
+  diag_step[diag_fill][1] = angle_step;
+  if (diag_full >= 0) {
+    diag_dropped++;                     // core 1 behind - refill the same buffer
+    return;
+  }
+  __dmb();                              // samples visible before the flag
+  diag_full = diag_fill;
+  diag_fill ^= 1;
+}
+
+/**
+ *  @brief  diag_goertzel - Amplitude at one frequency, counts Q8
+ *
+ *  Fixed point Goertzel filter, coefficient 2cos(w) in Q14
+ *
+ *  @param cycles  frequency in cycles per sample, below 0.5
+ */
+static uint32_t diag_goertzel(const int16_t *x, float cycles) {
+  int32_t coeff = lrintf(2.f * cosf(2.f * (float)M_PI * cycles) * 16384.f);
+  int32_t s0, s1 = 0, s2 = 0;
+  int64_t power;
+  uint i;
+  for (i = 0; i < DIAG_N; ++i) {
+    s0 = x[i] + (int32_t)(((int64_t)coeff * s1) >> 14) - s2;
+    s2 = s1;
+    s1 = s0;
+  }
+  power = (int64_t)s1 * s1 + (int64_t)s2 * s2 - (((int64_t)coeff * s1 >> 14) * s2);
+  return (uint32_t)(sqrtf((float)power) * (2.f * 256.f / DIAG_N));
+}
+
+/**
+ *  @brief  diag_window - Analyse a full window and update the trends
  *
- *  Use pico sdk function to initialise pins
- *  Delete led on/off functions - use gpio_put(led, state)
+ *  Runs on core 1. Windows where the motor is stopped or the speed moves
+ *  by more than 1/DIAG_STEADY are skipped, as the harmonics are only
+ *  comparable at a steady speed. A harmonic warns when its recent average
+ *  reaches DIAG_WARN_X4 / 4 times its baseline, and the baseline holds
+ *  while it warns so a slow rise is not learned away
  */
-void init_led(void) {                   // need to set up pins before using them
-  gpio_init(LED_YEL);
-  gpio_set_dir(LED_YEL, GPIO_OUT);
-  gpio_init(LED_GRN);
-  gpio_set_dir(LED_GRN, GPIO_OUT);
-  gpio_init(LED_RED);
-  gpio_set_dir(LED_RED, GPIO_OUT);
+void diag_window(void) {
+  static int16_t x[DIAG_N];
+  int8_t b = diag_full;
+  const uint8_t *buf = diag_buf[b];
+  uint32_t step0 = diag_step[b][0], step1 = diag_step[b][1], sum = 0, step;
+  uint8_t warn = diag_warn;
+  float cycles;
+  uint i, h;
+
+  if (diag_signal != diag_trend_signal) {
+    diag_trend_signal = diag_signal;    // new signal - learn its baseline again
+    diag_windows = 0;
+    warn = 0;
+  }
+  step = step0 + step1;
+  if (step0 == 0 || (step1 > step0 ? step1 - step0 : step0 - step1) > step0 / DIAG_STEADY) {
+    diag_skipped++;
+    diag_full = -1;
+    return;
+  }
+  for (i = 0; i < DIAG_N; ++i) {
+    sum += buf[i];
+  }
+  for (i = 0; i < DIAG_N; ++i) {
+    x[i] = ((int16_t)buf[i] << 4) - (int16_t)((sum << 4) / DIAG_N); // mean removed, 4 fraction bits
+  }
+  __dmb();
+  diag_full = -1;                       // buffer free for pwm_isr
+  // mechanical cycles per sample = step / 2^32 * PWM_FREQ / pole pairs / LOOP_FREQ
+  cycles = (float)step * 0.5f / 4294967296.f * PWM_FREQ / LOOP_FREQ / motor.profile->pole_pairs;
+  for (h = 0; h < DIAG_HARMONICS; ++h) {
+    uint32_t amp = 0;
+    if (cycles * (h + 1) < 0.5f) {
+      amp = diag_goertzel(x, cycles * (h + 1)) >> 4;
+    }
+    diag_amp[h] = amp;
+    if (diag_windows == 0) {
+      diag_fast[h] = diag_base[h] = amp;
+    }
+    diag_fast[h] += ((int32_t)amp - (int32_t)diag_fast[h]) >> DIAG_FAST;
+    if (!(warn & (1 << h))) {
+      diag_base[h] += ((int32_t)amp - (int32_t)diag_base[h]) >> DIAG_SLOW;
+    }
+    if (diag_windows < DIAG_WARMUP || diag_fast[h] < DIAG_FLOOR) {
+      warn &= ~(1 << h);
+    } else if (diag_fast[h] * 4 > diag_base[h] * DIAG_WARN_X4) {
+      warn |= 1 << h;
+    } else if (diag_fast[h] * 4 < diag_base[h] * DIAG_CLEAR_X4) {
+      warn &= ~(1 << h);
+    }
+  }
+  diag_windows++;
+  if (warn != diag_warn) {
+    diag_warn = warn;
+    bus_post(EVT_DIAG, warn);
+  }
 }
 
+#if DIAG
 /**
- *  @brief  init_analog - Enable analog channels and set up ADC
- *
- *  Analog Channels are
- *  Back EMF Signals VA(PB0/ANA0), VB(PB1/ANA1), and VC(PB2/ANA2)
- *  Current signal (PB3/ANA3)
- *  DC bus voltage V+ (PB4/ANA4)
- *  Speed or Torque Command Potentiometer (PB6/ANA6)
+ *  @brief  diag_core1 - Core 1 main: analyse windows as pwm_isr fills them
  */
-void init_analog(void) {
-  /*
-	PBAF0 |= 0x5F;			// 0101 1111 Alternate Function PB0, PB1, PB2, PB3, PB4, PB6
-	PBAF1 &= 0xA0;			// 1010 0000 
-	ADCCTL0 = 0x30;			// 0011 0000 Enable Reference and ADC
-	ADCSST = 10;			// ADC Channels select Mux Settling Time 0.5us min, number of clock cycles
-	ADCST = 20;				// ADC Sample and Hold Settling Time 1us min, number of clock cycles
-	ADCCP = 0;				// ADC clock Prescaler
-  */
-  adc_init();                           // Make sure GPIO is high-impedance, no pullups etc
-  adc_gpio_init(POT_SPEED);             // Select ADC input 0 (POT_SPEED)
+void diag_core1(void) {
+  multicore_lockout_victim_init();      // let core 0 pause us for flash writes
+  init_systick();                      // this core's SysTick, for diag_cycles
+  while (true) {
+    if (diag_full < 0) {
+      sleep_ms(DIAG_POLL_MS);
+      continue;
+    }
+    uint32_t t0 = SYST_CVR;
+    diag_window();
+    diag_cycles = (t0 - SYST_CVR) & 0x00ffffff;
+  }
 }
+#endif
 
 /**
- *  @brief  alarm_isr - Alarm interrupt handler
- *
- *  Implement delay using alarm interrupt
- *  Every interrupt toggles led
+ *  @brief  init_diag - Start the vibration diagnostics on core 1
  */
-void alarm_isr(){
-  ALARM1 = TIMELR + PWM_PERIOD;         // arm timer
-  INTR = 1 << ALARM_INT_NUM;            // clear interrupt
+void init_diag(void) {
+#if DIAG
+  multicore_launch_core1(diag_core1);
+#endif
 }
 
+/**
+ *  @brief  diag_report - Harmonic amplitudes and trends
+ */
+void diag_report(void) {
+  uint h;
+  printf("\nVIBRATION (%s, 1x = mechanical frequency):\n",
+         diag_signal == DIAG_SPEED ? "speed" : "current");
+  printf("%-16s: %lu, %lu skipped, %lu dropped\n", "Windows", (unsigned long)diag_windows,
+         (unsigned long)diag_skipped, (unsigned long)diag_dropped);
+  printf("%-16s: %lu\n", "Core 1 cycles", (unsigned long)diag_cycles);
+  for (h = 0; h < DIAG_HARMONICS; ++h) {
+    printf("%ux%-14s: %4lu.%02lu now %4lu.%02lu avg %4lu.%02lu base%s\n", h + 1, "",
+           (unsigned long)(diag_amp[h] >> 8), (unsigned long)((diag_amp[h] & 0xff) * 100 >> 8),
+           (unsigned long)(diag_fast[h] >> 8), (unsigned long)((diag_fast[h] & 0xff) * 100 >> 8),
+           (unsigned long)(diag_base[h] >> 8), (unsigned long)((diag_base[h] & 0xff) * 100 >> 8),
+           diag_warn & (1 << h) ? "  WARNING" : "");
+  }
+}
 
-/** @brief  init_commute - Commutator setup
- *
- *  Timer and alarm 1 used for commuatiation
- *  Generates the clock for the Back EMF sensing PLL
- *  When the timer reaches it's end count an interrupt is generated
+/**
+ *  @brief  advance_report - Commutation advance optimizer results
  */
-void init_commute(void) {
-  /*
-  // The timer Prescaler value is should be set by the maximum commutation frequency
-  // of the target motor. 
-	T0CTL1 = (0x01 | (T0_prescaler << 3));	// Disable Timer and Set Prescaler
-	T0H = 0x00;				// Set Initial Counter Value
-	T0L = 0x01;				//
-	T0CTL0 = 0x20;			// Continuous Mode, Interrupt
-	T0RH = Com_period_High;	// Set Maximum Count
-	T0RL = Com_period_Low;	//
-  */
-  printf("%s: %x\n", "Commutation setup", 1);
+void advance_report(void) {
+  float fixed = adv_fixed * 1000.f / 256.f / CURRENT_COUNTS_PER_A; // mA
+  float seek = adv_avg * 1000.f / 256.f / CURRENT_COUNTS_PER_A;
+  float joules = adv_saved / 256.f / CURRENT_COUNTS_PER_A / 4.f * ADV_PERIOD_MS / 1000.f;
+  long phase = lrintf(adv_phase * 100.f / 256.f); // hundredths of a degree
+  printf("\nADVANCE OPTIMIZER:\n");
+  printf("%-16s: %s\n", "State", adv_state == ADV_SEEK ? "seeking" : adv_state == ADV_FIXED ?
+         "measuring fixed" : "idle");
+  printf("%-16s: %u deg, fixed %u deg\n", "Advance", adv_state ? adv_deg : advance_deg, advance_deg);
+  printf("%-16s: %u deg, %u-%u deg\n", "Step, bounds", adv_step, adv_min, adv_max);
+  printf("%-16s: %s%ld.%02ld deg ahead of the rotor at the crossings\n", "Phase error",
+         phase < 0 ? "-" : "", labs(phase) / 100, labs(phase) % 100);
+  if (adv_fixed) {
+    printf("%-16s: %ld mA fixed, %ld mA optimized\n", "Bus current", lrintf(fixed), lrintf(seek));
+    printf("%-16s: %ld %%, %ld mW\n", "Saving", lrintf(100.f * (fixed - seek) / fixed),
+           lrintf((fixed - seek) * adc_vbus / 4.f)); // volts as 'V'
+    printf("%-16s: %ld J\n", "Energy saved", lrintf(joules));
+  }
 }
 
 /**
- *  @brief speed_cmd - Get speed command from speed potentiomenter
+ *  @brief  loop_begin - Function loop step 0
  *
- *  Connected to POT_SPEED
- *  This loop runs at 1/10th the rate of the current loop so S_loop_count
- *  Counts to 10 before updating speed loop
- *  ADC is 12-bit - shift value right by 4 bits to get speed command in range 0-255
+ *  The function loop steps run one per pwm period, so none of them is
+ *  inlined: tools/wcet.py then counts only the longest in pwm_isr
  */
-void get_speed_cmd(void) {
-	s_loop_count++;
-	if (s_loop_count > S_LOOP_COUNT_MAX) {
-    s_loop_count = 0;                   // NEED TO MOVE THIS TO LAST SPEED FUNCTION
-    adc_select_input(ADC_SPEED);        // select adc 0
-    speed_cmd = adc_read() >> 4;        // scale adc 0-255
-  		if (speed_cmd < SPEED_CMD_MIN) {
-			speed_cmd = SPEED_CMD_MIN;
-		}
-	}
-  #if UART
-  // If UI has control overide the speed with UI speed setting not speed pot setting
-  if (ui_control) {
-    speed_cmd = ui_speed;
+static __attribute__((noinline)) void loop_begin(void) {
+  loop_type_update();                   // change loop type between regulator updates
+  vbus_sample();
+}
+
+/**
+ *  @brief  loop_command - Function loop step 1, the speed or current command
+ */
+static __attribute__((noinline)) void loop_command(void) {
+  if (loop_type) {
+    get_speed_cmd();
+  } else {
+    get_current_cmd();
   }
-  #endif
 }
 
 /**
- *  @brief  led_blink - Control blinking of status leds
- *
- *  Yel LED blinking: motor is stopped (UART is in Control) but the MCU has power 
- *  Grn LED blinking: motor is running
- *  Red LED blinking: fault occured and motor stopped - cleared by
- *  toggling the "RUN STOP/RESET" switch
- *  blink freq = 1E6 / PWM_PERIOD / PWM_COUNT_MAX / BLINK_MAX
+ *  @brief  loop_measure - Function loop step 2, the current and the observers
  */
-void led_blink(void) {
-	if ((++blink == 1) & (blink_count == 0)) {  // indicate a FAULT with red led
-		//if ((PWMFSTAT & 0x02) != 0) {
-    //  gpio_put(LED_RED, 1);
-		//}
-		//if ((PWMFSTAT & 0x01) != 0) {     // indicate the motor is in STOP/RESET with yellow led
-    //  gpio_put(LED_YEL, 1);
-		//	PWMFSTAT |= 0x07;
-		//} else {
-    //  gpio_put(LED_GRN, 1); 				  // indicate the motor is in START with green led
-		//}
-    #if UART
-    if (ui_control) {                   // indicate the motor is in UI, thus hardware control is disabled
-      gpio_put(LED_YEL, 1);
-      gpio_put(LED_GRN, 0);
-    } else {
-      gpio_put(LED_YEL, 0);
-      gpio_put(LED_GRN, 1);             // TEMP flash green in hardware mode
-    }
-		#endif
-		blink_count = 1;
-	}
-	if ((blink == BLINK_MAX/2) & (blink_count == 1)) {
-    gpio_put(LED_YEL, 0);
-    gpio_put(LED_RED, 0);
-    gpio_put(LED_GRN, 0);
-		blink_count = 2;
-	}
-	if (blink > BLINK_MAX) {
-		blink = 0;
-		blink_count = 0;
-	}
+static __attribute__((noinline)) void loop_measure(void) {
+  current_sample();                     // both loops - the speed loop's advance optimizer uses it
+  advance_observe();
+  overlap_observe();
+  diag_sample();
 }
 
 /**
- *  @brief direction_update
- *
- *  Reads direction switch on SW_DIR
- *  Switch has to be in same position for 15 readings of the direction switch
- *  = 500us x 15 = 7.5mS
+ *  @brief  loop_regulate - Function loop step 3, the speed or current regulator
  */
-void direction_update(void) {
-	// Direction Switch update
-  direction_sw = gpio_get(SW_DIR);    // get dir switch value
-	if (direction_count < 5) {
-		direction = FWD;
-		direction_count = 5;
-	}
-	if (direction_count > 20) {
-		direction = REV;
-		direction_count = 20;
-	}
-	if (direction_sw == 0) {
-		direction_count--;
-	} else {
-		direction_count++;
-	}
-#if UART
-if (ui_control)
-  direction = ui_direction;
-#endif
+static __attribute__((noinline)) void loop_regulate(void) {
+  if (!com_locked) {
+    if (com_on && !com_align) {
+      com_start();                      // open loop until the back EMF locks
+    }                                   // the duty is align_mag while the rotor lines up
+  } else if (loop_type) {
+    speed_reg();
+  } else if (pwm_mode == CUR_UPDATE_LOOP) {
+    current_reg();
+  }
 }
 
 /**
@@ -306,65 +3943,64 @@ if (ui_control)
  *  This interrupt serves as a function loop called every PWM cycle.
  *  An initial check is made to make sure that this ISR does not conflict with
  *  the Back EMF sensing ISR which should always have priority
- *  pwm_count is a software counter that allows multiple loops to be serviced
- *  at a freq = 1E6 / PWM_PERIOD / PWM_COUNT_MAX
+ *  loop_timer restarts the steps every LOOP_PERIOD_US, one step per period
  *  The different service loops are:
  *  The Watch Dog Timer is Reset
- *  The update of the motor direction
- *  The blinking of the LEDs
  *  The Torque or Speed Loop
- *  More user functions can be added to this loop as required
+ *  Direction switch, LEDs and other timed work run from the timer wheel
+ *  More user functions can be added with timer_start() as required
  */
 void pwm_isr() {
+  if (pwm_mode == CUR_UPDATE_DOUBLE && (pwm_get_irq_status_mask() & (1u << PWM_MID_SLICE))) {
+    current_mid();                      // peak of the period, the wrap is still to come
+    return;
+  }
   pwm_clear_irq(pwm_gpio_to_slice_num(PWM_1H)); // clear the interrupt flag that brought us here
-
-	pwm_count++;
-	if (pwm_count >= PWM_COUNT_MAX) {	    // max number of steps
-		pwm_count = 0;
-		pwm_step = 0;
-	}
+  ilim_release();                       // end of any current limit cut in the last period
+  if (com_on) {
+    ilim_sample();                      // adc current limit, every period
+  }
+  elec_angle = angle_update(&elec_sin); // advance commutation angle every period
+  if (bemf_active && !com_align) {
+    bemf_sample();                      // zero crossings put the angle on the rotor
+  }
+  commutate();                          // six-step switches for the angle
+  if (pwm_mode != CUR_UPDATE_LOOP && com_locked && !loop_type) {
+    current_wrap();                     // fast current loop in place of current_reg()
+  }
+  timer_service();                      // software timers, may restart the steps
   // Check for Back EMF Sensing collision if timer within T0_interrupt_delay of Com_period
 	//T0_high = T0H;
 	//T0_count = T0L + (T0_high << 8) + T0_interrupt_delay;
 	//if (T0_count < Com_period)
 	{
-		if (pwm_step == 5) {
-			if (LOOP_TYPE) {
-				//speed_reg();
-			} else {
-				//current_reg();
-			}
-			pwm_step++;
-		}
-		if (pwm_step == 4) {
-			if (LOOP_TYPE) {
-				//speed_sample();
-			} else {
-				//current_sample();
-			}
-			pwm_step++;
-		}
 		if (pwm_step == 3) {
-			if (LOOP_TYPE) {
-				get_speed_cmd();
-			} else {
-				//current_cmd();
-			}
+			loop_regulate();
 			pwm_step++;
 		}
 		if (pwm_step == 2) {
-			led_blink();
+			loop_measure();
 			pwm_step++;
 		}
 		if (pwm_step == 1) {
-			direction_update();
+			loop_command();
 			pwm_step++;
 		}
 		if (pwm_step == 0) {
 			//asm("WDT");				// Refresh Watch Dog Timer
+			loop_begin();
 			pwm_step++;
 		}
 	}
+  overlap_update();                     // after the loop step, which may set com_mag
+  watch_sample();                       // live variable watch
+  state_publish();                      // consistent copy for main() and core 1
+#if SPI_LINK
+  spi_apply();                          // master setpoint in, state reply out
+#endif
+#if I2C_LINK
+  i2c_apply();                          // host register writes in
+#endif
 }
 
 /**
@@ -390,19 +4026,20 @@ void init_alarm() {
  *  Prescaler:        25
  *  Wrap value:       250
  *  pwm freq:         125MHz / 25 / 255 = 20kHz
+ *  Slices 5, 6 and 7 drive phases 1, 2 and 3 and run in step, so their
+ *  levels change on the same wrap
+ *  CUR_UPDATE_DOUBLE and _DEADBEAT halve the prescaler for centre-aligned pwm, see
+ *  pwm_mode_apply()
  */
 void init_pwm(void) {
-  printf("%s: %x\n", "PWM setup", 1);
-  gpio_set_function(PWM_1H, GPIO_FUNC_PWM); // set pin for pwm
-  uint slice_num = pwm_gpio_to_slice_num(PWM_1H); // get slice of pwm pin
-
+  DLOG("PWM setup: %x\n", 1);
+  uint p;
 
-  
-  pwm_config config = pwm_get_default_config(); // get defaults for the slice configuration
-  pwm_config_set_clkdiv(&config, 25.f);   // set pwm prescaler
-  pwm_config_set_wrap (&config, COM_MAG_MAX);  // set pwm reload value 
-  pwm_init(slice_num, &config, true);     // load configuration into pwm slice, and set it running
-  pwm_set_gpio_level(PWM_1H, com_mag);    // set duty cycle
+  for (p = 0; p < 3; ++p) {
+    gpio_set_function(PWM_1H + 2 * p, GPIO_FUNC_PWM);
+    gpio_set_function(PWM_1L + 2 * p, GPIO_FUNC_PWM);
+  }
+  pwm_mode_apply();                     // all off until the motor starts
 }
 
 /**
@@ -426,25 +4063,315 @@ void init_pwmint(void)	//
  *
  */
 void display_status() {
+  static const char *const handover_name[] = { "done", "slewing", "waiting for pot" };
+  isr_state st;
+  state_snapshot(&st);                  // all lines from the same pwm period
   printf("\nSYSTEM STATUS:\n");
   //printf("%-16s: %x\n", "PPB_BASE", PPB_BASE);
   //printf("%-16s: %x\n", "NVIC_ISER", NVIC_ISER);
-  printf("%-16s: %x\n", "Direction", direction);
-  printf("%-16s: %d\n", "Set Speed", speed_cmd);
+  printf("%-16s: %x\n", "Direction", st.direction);
+  printf("%-16s: %u %s\n", "Motor", motor_index, motor.profile->name);
+  printf("%-16s: %s\n", "Loop Type", st.loop_type ? "speed" : "torque");
+  printf("%-16s: %d\n", "Set Speed", st.speed_cmd);
+  printf("%-16s: %d\n", "Set Current", st.current_cmd);
+  printf("%-16s: %d\n", "Duty", st.com_mag);
+  printf("%-16s: %u\n", "Ilim trips/s", st.ilim_trips_per_sec);
+  printf("%-16s: %u\n", "Log dropped", dlog_dropped);
+  printf("%-16s: %s\n", "Handover", handover_name[st.handover]);
+  if (pwm_mode == CUR_UPDATE_MPC) {
+    printf("%-16s: mpc, %lu switch changes\n", "Current Update", (unsigned long)mpc_changes);
+  } else {
+    printf("%-16s: %s\n", "Current Update", pwm_mode == CUR_UPDATE_DEADBEAT ? "deadbeat" :
+           pwm_mode == CUR_UPDATE_DOUBLE ? "valley and peak" :
+           pwm_mode == CUR_UPDATE_PWM ? "every period" : "function loop");
+  }
+  printf("%-16s: %s, %u lost\n", "Commutation", !bemf_active ? (com_on ? "open loop" : "off") :
+         com_locked ? "back EMF" : "start ramp", bemf_lost);
+  if (speed_src == SPEED_SRC_POT) {
+    printf("%-16s: pot\n", "Speed Input");
+  } else if (!speed_in_ok) {
+    printf("%-16s: %s lost\n", "Speed Input", speed_src == SPEED_SRC_RC ? "rc" : "freq");
+  } else if (speed_src == SPEED_SRC_RC) {
+    printf("%-16s: rc %u us\n", "Speed Input", speed_in_width);
+  } else {
+    printf("%-16s: freq %u Hz\n", "Speed Input", speed_in_hz);
+  }
+  printf("%-16s: %s, %lu transactions\n", "I2C Link", i2c_control ? "host" : "local",
+         (unsigned long)i2c_transactions);
+}
+
+/**
+ *  @brief  background_tasks - Work that must stay out of the ISRs
+ *
+ *  Called from the main loop while it waits for a UI key
+ */
+void background_tasks(void) {
+  bus_dispatch();
+  tx_service();
+  spi_service();
+  watch_send();
+  dlog_flush();
+  evlog_flush();
 }
 
-void test_pwm_leds() {
-  uint8_t led;
-  for (led = PWM_1H; led < PWM_3L + 1; ++led) {
-  gpio_init(led);
-  gpio_set_dir(led, GPIO_OUT);
+/**
+ *  @brief  ui_getchar - Wait for a UI key, running background tasks meanwhile
+ */
+int ui_getchar(void) {
+  int ch;
+  while ((ch = getchar_timeout_us(UI_POLL_US)) == PICO_ERROR_TIMEOUT) {
+    background_tasks();
   }
-  for (led = PWM_1H; led < PWM_3L + 1; ++led) {
-    gpio_put(led, 1);
-    sleep_ms(250);
-    gpio_put(led, 0);
-    sleep_ms(250);
+  return ch;
+}
+
+/**
+ *  @brief  ui_getline - Read a line of UI input, without the line ending
+ *
+ *  Leading line endings are skipped, characters past len - 1 are dropped
+ */
+void ui_getline(char *buf, uint len) {
+  uint n = 0;
+  int ch;
+  while ((ch = ui_getchar()) == '\r' || ch == '\n') {
+  }
+  while (ch != '\r' && ch != '\n') {
+    if (n < len - 1) {
+      buf[n++] = ch;
+    }
+    ch = ui_getchar();
+  }
+  buf[n] = 0;
+}
+
+/**
+ *  @brief  param_hash - Hash of a parameter name
+ *
+ *  FNV-1a with PARAM_SEED as the start value. tools/param_hash.py picks the
+ *  seed so every name in params[] lands in its own slot of param_slot[]
+ */
+static uint32_t param_hash(const char *name) {
+  uint32_t h = PARAM_SEED;
+  while (*name) {
+    h = (h ^ (uint8_t)*name++) * 16777619u;
+  }
+  return h;
+}
+
+/**
+ *  @brief  param_find - Look up a parameter by name in constant time
+ *
+ *  @return NULL if there is no such parameter
+ */
+const param_def *param_find(const char *name) {
+  int i = param_slot[param_hash(name) >> (32 - PARAM_HASH_BITS)];
+  if (i < 0 || strcmp(params[i].name, name)) {
+    return NULL;
+  }
+  return &params[i];
+}
+
+/**
+ *  @brief  param_get - Present value of a parameter
+ */
+int64_t param_get(const param_def *p) {
+  bool sign = p->min < 0;
+  switch (p->size) {
+    case 1:  return sign ? *(volatile int8_t *)p->addr : *(volatile uint8_t *)p->addr;
+    case 2:  return sign ? *(volatile int16_t *)p->addr : *(volatile uint16_t *)p->addr;
+    default: return sign ? (int64_t)*(volatile int32_t *)p->addr : (int64_t)*(volatile uint32_t *)p->addr;
+  }
+}
+
+/**
+ *  @brief  param_set - Change a parameter
+ *
+ *  The store is made with interrupts held off so pwm_isr never sees
+ *  part of a new value
+ *
+ *  @return NULL if the value was set, otherwise why not
+ */
+const char *param_set(const param_def *p, int64_t value) {
+  if (p->flags & PARAM_RO) {
+    return "read only";
+  }
+  if ((p->flags & PARAM_STOPPED) && motor_on) {
+    return "stop the motor first";
+  }
+  if (value < p->min || value > p->max) {
+    return "out of range";
+  }
+  uint32_t irq = save_and_disable_interrupts();
+  switch (p->size) {
+    case 1:  *(volatile uint8_t *)p->addr = (uint8_t)value; break;
+    case 2:  *(volatile uint16_t *)p->addr = (uint16_t)value; break;
+    default: *(volatile uint32_t *)p->addr = (uint32_t)value; break;
+  }
+  restore_interrupts(irq);
+  return NULL;
+}
+
+/**
+ *  @brief  param_print - One line of "list" and "get" output
+ */
+static void param_print(const param_def *p) {
+  printf("%-20s: %-10lld", p->name, (long long)param_get(p));
+  if (p->flags & PARAM_RO) {
+    printf(" read only\n");
+  } else {
+    printf(" %ld..%ld%s\n", (long)p->min, (long)p->max,
+           (p->flags & PARAM_STOPPED) ? " when stopped" : "");
+  }
+}
+
+/**
+ *  @brief  param_command - "list", "get <name>" or "set <name> <value>"
+ *
+ *  Values are decimal, or hex with 0x
+ */
+void param_command(char *line) {
+  const char *cmd = strtok(line, " ");
+  const char *name = strtok(NULL, " ");
+  const char *arg = strtok(NULL, " ");
+  const param_def *p = name ? param_find(name) : NULL;
+  const char *err;
+  char *end;
+
+  if (!cmd) {
+    printf("\nlist, get <name> or set <name> <value>");    // only spaces typed
+  } else if (!strcmp(cmd, "list")) {
+    printf("\n");
+    for (uint n = 0; n < PARAMS; ++n) {
+      param_print(&params[n]);
+    }
+  } else if (strcmp(cmd, "get") && strcmp(cmd, "set")) {
+    printf("\nCommand not recognised");
+  } else if (!p) {
+    printf("\nNo such parameter");
+  } else if (cmd[0] == 'g') {
+    printf("\n");
+    param_print(p);
+  } else if (!arg || (strtoll(arg, &end, 0), *end)) {
+    printf("\nset %s <value>", p->name);
+  } else if ((err = param_set(p, strtoll(arg, NULL, 0)))) {
+    printf("\n%s: %s", p->name, err);
+  } else {
+    printf("\n");
+    param_print(p);
+  }
+}
+
+/**
+ *  @brief  selftest_power_stage - Gate driver and power stage self-test
+ *
+ *  Replaces the old test_pwm_leds() walk along the pwm pins
+ *  With the bridge pins under software control, all off to start with:
+ *  - each high side is turned on alone: its phase voltage must rise to
+ *    Vbus and the bus current must not (that would be shoot-through in a
+ *    leg or a shorted low side); the other phases follow through the motor
+ *    windings, so a phase that stays low is open
+ *  - each low side is pulsed with another phase's high side: a short
+ *    current ramp through the winding must appear but stay small
+ *  The back EMF dividers are filtered, so the high side pulse is long
+ *  enough for the phase voltage to settle; the low side pulse is read on
+ *  the current, which is not filtered
+ *  Interrupts are held off so the ADC is not shared - about 4ms in all
+ *  Afterwards the pins go back to their pwm or SIO functions, low
+ *
+ *  @return 1 if everything passed
+ */
+unsigned char selftest_power_stage(void) {
+  static const char *result_name[] = {
+    "pass", "not tested", "no voltage", "shoot-through", "no current", "over current"
+  };
+  static const char *switch_name[] = { "1H", "1L", "2H", "2L", "3H", "3L" };
+  uint func[6];
+  uint p, q, k;
+  unsigned char i0, i, vbus, v[3], high_ok = 0, failed = 0;
+  uint32_t t0 = time_us_32();
+  uint32_t irq = save_and_disable_interrupts();
+
+  for (k = 0; k < 6; ++k) {
+    func[k] = gpio_get_function(PWM_1H + k);
+    gpio_init(PWM_1H + k);              // SIO, low
+    gpio_set_dir(PWM_1H + k, GPIO_OUT);
+    selftest_result[k] = ST_NOT_TESTED;
+  }
+  selftest_open = 0;
+  busy_wait_us(ST_DECAY_US);
+  i0 = current_read();                  // current sense offset
+  vbus = vsense_read(VSENSE_VBUS);
+
+  if (vbus >= ST_VBUS_MIN) {
+    for (p = 0; p < 3; ++p) {           // high sides
+      gpio_put(PWM_1H + 2 * p, 1);
+      busy_wait_us(ST_PULSE_US);
+      i = current_read();
+      for (k = 0; k < 3; ++k) {
+        v[k] = vsense_read(VSENSE_VA + k);
+      }
+      gpio_put(PWM_1H + 2 * p, 0);
+      if (i > i0 + ST_I_NOISE) {
+        selftest_result[2 * p] = ST_SHOOT_THROUGH;
+      } else if (v[p] < vbus / 2) {
+        selftest_result[2 * p] = ST_NO_VOLTAGE;
+      } else {
+        selftest_result[2 * p] = ST_PASS;
+        high_ok |= 1 << p;
+        for (k = 0; k < 3; ++k) {
+          if (v[k] < vbus / 2) {
+            selftest_open |= 1 << k;
+          }
+        }
+      }
+      busy_wait_us(ST_DECAY_US);
+    }
+    for (p = 0; p < 3; ++p) {           // low sides, against a good high side
+      q = (high_ok & (1 << ((p + 1) % 3))) ? (p + 1) % 3 : (p + 2) % 3;
+      if (!(high_ok & (1 << q)) || (selftest_open & ((1 << p) | (1 << q)))) {
+        continue;
+      }
+      gpio_put(PWM_1H + 2 * p + 1, 1);
+      gpio_put(PWM_1H + 2 * q, 1);
+      busy_wait_us(ST_LOW_US);
+      i = current_read();
+      gpio_put(PWM_1H + 2 * q, 0);
+      gpio_put(PWM_1H + 2 * p + 1, 0);
+      if (i > i0 + ST_I_MAX) {
+        selftest_result[2 * p + 1] = ST_OVER_CURRENT;
+      } else if (i < i0 + ST_I_MIN) {
+        selftest_result[2 * p + 1] = ST_NO_CURRENT;
+      } else {
+        selftest_result[2 * p + 1] = ST_PASS;
+      }
+      busy_wait_us(ST_DECAY_US);
+    }
+  }
+
+  for (k = 0; k < 6; ++k) {
+    if (func[k] == GPIO_FUNC_PWM) {
+      gpio_set_function(PWM_1H + k, GPIO_FUNC_PWM);
+    }
+  }
+  restore_interrupts(irq);
+  selftest_us = time_us_32() - t0;
+
+  printf("\nPOWER STAGE SELF-TEST:\n");
+  for (k = 0; k < 6; ++k) {
+    printf("%-16s: %s\n", switch_name[k], result_name[selftest_result[k]]);
+    if (selftest_result[k] != ST_PASS) {
+      failed |= 1 << k;
+    }
+  }
+  for (k = 0; k < 3; ++k) {
+    if (selftest_open & (1 << k)) {
+      printf("Phase %u         : open\n", k + 1);
+    }
   }
+  printf("%-16s: %lu us\n", "Test time", (unsigned long)selftest_us);
+  bus_post(EVT_SELFTEST, failed | (selftest_open ? 0x40 : 0));
+  selftest_ok = !failed && !selftest_open;
+  return selftest_ok;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -453,26 +4380,41 @@ void test_pwm_leds() {
 /** @brief  main - Main program */
 int main() {
   stdio_init_all();
+  init_tx();                            // stdio output through the dma transmit queue
   printf("Welcome to PicoBLDC\n");
   init_in();                            // initialize switch inputs
   init_led();                           // initialise leds
 	//init_amp();		                      // enable op amp for current amplification
-	//init_comp();	                      // enable comparator for pulse-by-pulse current limiting
+	init_comp();	                        // enable comparator for pulse-by-pulse current limiting
 	init_analog();	                      // set up Analog Channels for Back EMF and Bus Voltage Sensing
+  init_evlog();                         // find the end of the event log in flash
+  selftest_power_stage();               // check the bridge before the pwm takes the pins
 	init_commute();	                      // set up timer for commutation period
+  init_angle();                         // set up angle accumulator and sine table
+  motor_load(MOTOR_PROFILE);            // derive control constants for the motor
 	init_pwm();                           // set up 20kHz PWM and BLDC commutation
 	//init_commute_int();	                // enable commutation interrupt
+  init_timers();                        // start the timebase and service timers
+  init_spi();                           // spi slave link
+  init_i2c();                           // i2c slave register map
+  init_diag();                          // vibration diagnostics on core 1
 	init_pwmint();	                      // enable PWM interrupt for loop servicing
+  dlog_flush();                         // print the start up messages
   //display_status();
-  //test_pwm_leds();
 
   while (true) {
+    isr_state st;
     sleep_ms(250);
 
 		#if UART
 		printf("\n\nPress O for options:");
-    char ch = toupper(getchar());
-    getchar();                           // To consume newline
+    char line[UI_LINE];
+    ui_getline(line, sizeof(line));
+    if (strlen(line) > 1) {             // parameter command
+      param_command(line);
+      continue;
+    }
+    char ch = toupper(line[0]);
     switch (ch) {
       case 'O':
         printf("\nD: Display status");
@@ -485,18 +4427,33 @@ int main() {
         printf("\nV: DC Voltage reading");
         printf("\nC: Current speed reading");
         printf("\nM: Set motor speed");
+        printf("\nA: Angle lookup timing");
+        printf("\nL: Toggle speed/torque loop");
+        printf("\nG: Dump event log");
+        printf("\nT: Power stage self-test");
+        printf("\nP: Select motor profile");
+        printf("\nX: Transmit queue statistics");
+        printf("\nW: Watch variables by address");
+        printf("\nB: Event bus statistics");
+        printf("\nY: SPI link statistics");
+        printf("\nN: Vibration diagnostics");
+        printf("\nK: Commutation advance optimizer");
+        printf("\nlist, get <name>, set <name> <value>: Parameters");
         break;
       case 'D':
         display_status();
         break;
       case 'U':
+        state_snapshot(&st);
+        ui_speed = st.loop_type ? st.speed_cmd : st.current_cmd; // start from the running setpoint
+        ui_direction = st.direction;
         ui_control = 1;
-        ui_direction = direction;
-        ui_speed = speed;
+        bus_post(EVT_UI_CONTROL, 1);
         printf("\nUI Enabled, Hardware Control disabled");
         break;
       case 'H':
         ui_control = 0;
+        bus_post(EVT_UI_CONTROL, 0);
         //PWMCTL0 |= 0x80;
         printf("\nHardware Control enabled, UI Disabled");
         break;
@@ -508,11 +4465,19 @@ int main() {
       }
       */
       case 'S':
+        if (!selftest_ok) {
+          printf("\nSelf-test failed - T to test again");
+          break;
+        }
         //PWMCTL0 |= 0x80;
+        motor_on = 1;
+        bus_post(EVT_MOTOR, 1);
         printf("\nMotor Start");
         break;
       case'E':
         //PWMCTL0 &= 0x7F;
+        motor_on = 0;
+        bus_post(EVT_MOTOR, 0);
         printf("\nMotor Stop");
         break;
       case 'F':
@@ -524,15 +4489,85 @@ int main() {
         printf("\nReverse Direction");
         break;
       case 'V':
-        adc_vdc = (adc_vbus / 4);
+        state_snapshot(&st);
+        adc_vdc = (st.adc_vbus / 4);
         printf("\nDC Voltage:%4d Volts", adc_vdc);
         break;
       case 'C':
-        printf("\nCurrent Speed:%4d", speed); // Speed Shown in Decimal although inputting Speed is in HEX
+        state_snapshot(&st);
+        printf("\nCurrent Speed:%4d", st.speed); // Speed Shown in Decimal although inputting Speed is in HEX
         break;
       case 'M':                   // input speed in HEX from 32 - 9B (50~150 in decimal)
         printf("\r\nEnter Speed 32-9B (HEX):  ");
-        //ui_speed= ScanHex(2);
+        ui_getline(line, sizeof(line));
+        {
+          long value = strtol(line, NULL, 16);
+          const char *err = (value < SPEED_CMD_MIN || value > 0x9b) ? "out of range" :
+                            param_set(param_find("ui_speed"), value);
+          if (err) {
+            printf("\nSpeed %s", err);
+          } else {
+            printf("\nSpeed set to %ld%s", value, ui_control ? "" : " - U to give the UI control");
+          }
+        }
+        break;
+      case 'A':
+        angle_bench();
+        break;
+      case 'P':
+        for (uint n = 0; n < MOTOR_PROFILES; ++n) {
+          printf("\n%u: %s", n, motor_profiles[n].name);
+        }
+        printf("\nProfile: ");
+        ui_getline(line, sizeof(line));
+        ch = line[0];
+        if (motor_on) {
+          printf("\nStop the motor first");
+        } else if (motor_load(ch - '0')) {
+          printf("\nLoaded %s", motor.profile->name);
+        } else {
+          printf("\nNo such profile");
+        }
+        break;
+      case 'T':
+        if (motor_on) {
+          printf("\nStop the motor first");
+        } else {
+          selftest_power_stage();
+        }
+        break;
+      case 'G':
+        evlog_dump();
+        break;
+      case 'X':
+        tx_report();
+        break;
+      case 'B':
+        bus_report();
+        break;
+      case 'Y':
+        spi_report();
+        break;
+      case 'N':
+        diag_report();
+        break;
+      case 'K':
+        advance_report();
+        break;
+      case 'W': {                       // tools/watch.py sends the line
+        printf("\nWatch (divisor address:size ...): ");
+        ui_getline(line, sizeof(line));
+        int n = watch_set(line);
+        if (n < 0) {
+          printf("\nBad watch list");
+        } else {
+          printf("\nWatching %d every %u periods", n, watch_div);
+        }
+        break;
+      }
+      case 'L':
+        set_loop_type(!loop_type_req);
+        printf("\n%s Loop", loop_type_req ? "Speed" : "Torque");
         break;
       default:
         printf("\nCommand not recognised");
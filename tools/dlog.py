@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""Decode the bldc deferred log.
+
+With DLOG_RAW set, dlog_flush() prints each record as a line
+
+    L <format address> <time us> <arg 0> <arg 1> <arg 2>
+
+in hex. This reads those lines from a terminal capture, looks the format
+strings up in the ELF file of the same build and prints the messages.
+
+    python3 tools/dlog.py build/bldc.elf capture.txt
+"""
+import argparse
+import re
+import struct
+import sys
+
+SHF_ALLOC = 0x2
+SHT_NOBITS = 8
+
+# printf conversions - the length modifier is dropped, all arguments are 32-bit
+CONVERSION = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(?:hh|h|ll|l|z|t|j)?([diouxXc%])")
+
+
+class Elf:
+    """Allocated sections of a 32-bit little endian ELF file."""
+
+    def __init__(self, data):
+        if data[:4] != b"\x7fELF" or data[4] != 1 or data[5] != 1:
+            raise ValueError("not a 32-bit little endian ELF file")
+        shoff, = struct.unpack_from("<I", data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", data, 0x2E)
+        self.sections = []
+        for n in range(shnum):
+            (_, sh_type, flags, addr, offset, size,
+             _, _, _, _) = struct.unpack_from("<10I", data, shoff + n * shentsize)
+            if flags & SHF_ALLOC and sh_type != SHT_NOBITS and size:
+                self.sections.append((addr, data[offset:offset + size]))
+
+    def string(self, addr):
+        for base, body in self.sections:
+            if base <= addr < base + len(body):
+                end = body.find(b"\0", addr - base)
+                return body[addr - base:end if end >= 0 else None].decode("latin-1")
+        return None
+
+
+def format_message(fmt, args):
+    args = iter(args)
+
+    def convert(m):
+        flags, conv = m.groups()
+        if conv == "%":
+            return "%"
+        value = next(args, 0)
+        if conv in "di":
+            value -= (value & 0x80000000) << 1
+            conv = "d"
+        elif conv == "u":
+            conv = "d"
+        elif conv == "c":
+            return chr(value & 0xFF)
+        return ("%" + flags + conv) % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf", help="ELF file of the running build")
+    parser.add_argument("capture", nargs="?", help="terminal capture (default stdin)")
+    args = parser.parse_args()
+
+    with open(args.elf, "rb") as f:
+        elf = Elf(f.read())
+    lines = open(args.capture, errors="replace") if args.capture else sys.stdin
+    for line in lines:
+        words = line.split()
+        if len(words) != 6 or words[0] != "L":
+            continue
+        try:
+            addr, time, *values = (int(w, 16) for w in words[1:])
+        except ValueError:
+            continue
+        fmt = elf.string(addr)
+        if fmt is None:
+            print("[%10u] <no string at %08x>" % (time, addr))
+        else:
+            sys.stdout.write("[%10u] %s" % (time, format_message(fmt, values)))
+
+
+if __name__ == "__main__":
+    main()
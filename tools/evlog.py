@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""Decode the bldc event log.
+
+Reads the output of the 'G' UI command (lines starting "E " for entries
+from flash and "R " for entries still in RAM) from a terminal capture,
+or a raw image of the event log flash sectors read with e.g.
+picotool save -r, and prints one decoded line per entry.
+
+    python3 tools/evlog.py capture.txt
+    python3 tools/evlog.py --bin evlog.bin
+"""
+import argparse
+import struct
+import sys
+
+# Keep in step with the EV_ defines in bldc.c
+EVENT_TYPES = {
+    1: "BOOT",
+    2: "ILIM",
+    3: "LOOP_TYPE",
+    4: "UI_CONTROL",
+    5: "MOTOR",
+    6: "DIRECTION",
+    7: "SELFTEST",
+    8: "SPEED_IN",
+    9: "SPI_LINK",
+    10: "I2C_LINK",
+    11: "DIAG",
+}
+
+ENTRY = struct.Struct("<IHBBBBBBBBBB")  # evlog_entry in bldc.c
+EVLOG_CHECK = 0xA5
+FIELDS = ("time", "seq", "type", "arg", "com_step", "direction", "speed",
+          "adc_vbus", "adc_current", "com_mag", "speed_cmd", "check")
+
+
+def check_byte(raw):
+    check = EVLOG_CHECK
+    for b in raw[:-1]:
+        check ^= b
+    return check
+
+
+def decode(raw, where):
+    entry = dict(zip(FIELDS, ENTRY.unpack(raw)))
+    entry["where"] = where
+    entry["ok"] = where == "R" or entry["check"] == check_byte(raw)
+    return entry
+
+
+def read_text(lines):
+    for line in lines:
+        line = line.strip()
+        if len(line) > 2 and line[0] in "ER" and line[1] == " ":
+            try:
+                raw = bytes.fromhex(line[2:])
+            except ValueError:
+                continue
+            if len(raw) == ENTRY.size:
+                yield decode(raw, line[0])
+
+
+def read_bin(data):
+    for i in range(0, len(data) - ENTRY.size + 1, ENTRY.size):
+        raw = data[i:i + ENTRY.size]
+        if raw[6] != 0xFF:
+            entry = decode(raw, "E")
+            if entry["ok"]:
+                yield entry
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("file", nargs="?", help="capture or image (default stdin)")
+    parser.add_argument("--bin", action="store_true", help="file is a raw flash image")
+    args = parser.parse_args()
+
+    if args.bin:
+        with open(args.file, "rb") as f:
+            entries = list(read_bin(f.read()))
+        # flash entries carry a 16-bit sequence, oldest follows the largest gap
+        entries.sort(key=lambda e: e["seq"])
+        for i in range(1, len(entries)):
+            if entries[i]["seq"] - entries[i - 1]["seq"] > 0x8000:
+                entries = entries[i:] + entries[:i]
+                break
+    else:
+        f = open(args.file) if args.file else sys.stdin
+        entries = list(read_text(f))
+
+    print("%-2s %6s %12s %-11s %4s %4s %4s %5s %5s %5s %4s %5s" % (
+        "", "seq", "time_us", "type", "arg", "step", "dir", "speed", "vbus",
+        "curr", "duty", "cmd"))
+    for e in entries:
+        print("%-2s %6s %12d %-11s %4d %4d %4s %5d %5d %5d %4d %5d%s" % (
+            e["where"], e["seq"] if e["where"] == "E" else "-", e["time"],
+            EVENT_TYPES.get(e["type"], "?%d" % e["type"]), e["arg"],
+            e["com_step"], "REV" if e["direction"] else "FWD", e["speed"],
+            e["adc_vbus"], e["adc_current"], e["com_mag"], e["speed_cmd"],
+            "" if e["ok"] else "  BAD CHECK"))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Worst case cycles and stack for the ISR call trees of bldc.c
+# Usage: tools/isr_report.sh [build dir]    (default build, need not be configured)
+# Needs PICO_SDK_PATH and arm-none-eabi-gcc, so run it where the firmware is built;
+# writes <build dir>/wcet/report.json
+set -e
+cd "$(dirname "$0")/.."
+BUILD=${1:-build}
+SDK=${PICO_SDK_PATH:?PICO_SDK_PATH is not set}
+OUT=$BUILD/wcet
+GEN=$OUT/generated/pico_base
+mkdir -p "$GEN/pico"
+
+# The two pico_base headers the cmake configure step would generate
+{
+  echo "// written by tools/isr_report.sh in place of the cmake configure step"
+  echo "#include \"$SDK/src/boards/include/boards/${PICO_BOARD:-pico}.h\""
+  h=$SDK/src/rp2_common/cmsis/include/cmsis/rename_exceptions.h
+  if [ -f "$h" ]; then
+    echo "#include \"$h\""
+  fi
+} > "$GEN/pico/config_autogen.h"
+ver() {
+  sed -n "s/^set(PICO_SDK_VERSION_$1 \([0-9]*\)).*/\1/p" "$SDK/pico_sdk_version.cmake"
+}
+MAJ=$(ver MAJOR) MIN=$(ver MINOR) REV=$(ver REVISION)
+sed -e "s/\${PICO_SDK_VERSION_MAJOR}/$MAJ/; s/@PICO_SDK_VERSION_MAJOR@/$MAJ/" \
+    -e "s/\${PICO_SDK_VERSION_MINOR}/$MIN/; s/@PICO_SDK_VERSION_MINOR@/$MIN/" \
+    -e "s/\${PICO_SDK_VERSION_REVISION}/$REV/; s/@PICO_SDK_VERSION_REVISION@/$REV/" \
+    -e "s/\${PICO_SDK_VERSION_STRING}/$MAJ.$MIN.$REV/; s/@PICO_SDK_VERSION_STRING@/$MAJ.$MIN.$REV/" \
+    -e "/#cmakedefine/d" \
+    "$SDK"/src/common/pico_base*/include/pico/version.h.in > "$GEN/pico/version.h"
+
+INC="-I$GEN"
+for d in "$SDK"/src/common/*/include "$SDK"/src/rp2_common/*/include \
+         "$SDK"/src/rp2040/*/include "$SDK"/src/boards/include; do
+  INC="$INC -I$d"
+done
+arm-none-eabi-gcc -mcpu=cortex-m0plus -mthumb -O2 -ffunction-sections \
+  -fstack-usage -fcallgraph-info=su -DPICO_ON_DEVICE=1 -DPICO_RP2040=1 $INC \
+  -c bldc.c -o "$OUT/bldc.o"
+arm-none-eabi-objdump -d --no-show-raw-insn "$OUT/bldc.o" > "$OUT/bldc.dis"
+python3 tools/wcet.py --ci "$OUT/bldc.ci" --dis "$OUT/bldc.dis" \
+  --bounds tools/wcet_bounds.txt --json "$OUT/report.json"
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Generate the perfect hash for the bldc parameter registry.
+
+Reads the names in params[] from bldc.c, finds a seed for which the
+FNV-1a hash in param_hash() puts every name in its own slot, and
+rewrites the generated block after params[] with PARAM_SEED,
+PARAM_HASH_BITS and param_slot[]. The slot is the top bits of the hash:
+the low bits of FNV-1a only depend on the low bits of the seed.
+
+    python3 tools/param_hash.py            # update bldc.c
+    python3 tools/param_hash.py --check    # exit 1 if bldc.c is out of date
+"""
+import argparse
+import os
+import re
+import sys
+
+SOURCE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "bldc.c")
+TABLE = re.compile(r"const param_def params\[\] = \{(.*?)\n\};", re.S)
+ENTRY = re.compile(r"^\s*PARAM\(\s*([^,\s]+)\s*,", re.M)
+BLOCK = re.compile(r"(// -- Generated by tools/param_hash.py[^\n]*\n)(.*?)(// -- End of generated code --)", re.S)
+
+
+def fnv1a(name, seed):
+    h = seed
+    for c in name.encode():
+        h = ((h ^ c) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def find_seed(names, bits):
+    for seed in range(0x811C9DC5, 0x811C9DC5 + 100000):   # FNV offset basis first
+        slots = {fnv1a(n, seed) >> (32 - bits) for n in names}
+        if len(slots) == len(names):
+            return seed
+    return None
+
+
+def generate(names):
+    bits = 1
+    while 1 << bits < 2 * len(names):   # half full finds a seed in a few hundred tries
+        bits += 1
+    seed = find_seed(names, bits)
+    while seed is None:
+        bits += 1
+        seed = find_seed(names, bits)
+    size = 1 << bits
+    slot = [-1] * size
+    for i, n in enumerate(names):
+        slot[fnv1a(n, seed) >> (32 - bits)] = i
+    rows = [", ".join("%2d" % v for v in slot[i:i + 16]) for i in range(0, size, 16)]
+    return ("#define PARAM_SEED      0x%08xu\n"
+            "#define PARAM_HASH_BITS %d\n"
+            "const int8_t param_slot[1 << PARAM_HASH_BITS] = { // index in params[], -1 = empty\n"
+            "%s\n"
+            "};\n") % (seed, bits, ",\n".join("  " + r for r in rows))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--check", action="store_true", help="only check bldc.c is up to date")
+    parser.add_argument("source", nargs="?", default=SOURCE)
+    args = parser.parse_args()
+
+    with open(args.source) as f:
+        text = f.read()
+    table = TABLE.search(text)
+    names = ENTRY.findall(table.group(1)) if table else []
+    if not names:
+        sys.exit("no params[] table in %s" % args.source)
+    if len(set(names)) != len(names):
+        sys.exit("a parameter is in params[] twice")
+    if len(names) > 127:
+        sys.exit("param_slot[] is int8_t - at most 127 parameters")
+    block = BLOCK.search(text)
+    if not block:
+        sys.exit("no generated block in %s" % args.source)
+    new = generate(names)
+    if block.group(2) == new:
+        return
+    if args.check:
+        sys.exit("parameter hash is out of date - run tools/param_hash.py")
+    text = text[:block.start(2)] + new + text[block.end(2):]
+    with open(args.source, "w") as f:
+        f.write(text)
+    print("%d parameters" % len(names))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+"""Watch bldc variables live by name, without rebuilding.
+
+Looks the names up in the ELF file of the running build, sends the
+addresses to the 'W' UI command and prints the sampled values as CSV,
+or plots them with --plot (needs matplotlib).
+
+    python3 tools/watch.py build/bldc.elf /dev/ttyACM0 speed_cmd com_mag s_integral:s32
+    python3 tools/watch.py build/bldc.elf /dev/ttyACM0 --div 20 --plot pwm_step 'sin_table[64]:s16'
+    python3 tools/watch.py build/bldc.elf --list
+
+A variable is name, name[index] or name+offset, optionally followed by
+:type (u8 s8 u16 s16 u32 s32 f32). Without a type the symbol size is used,
+unsigned. Sampling is from pwm_isr, every --div pwm periods.
+"""
+import argparse
+import os
+import re
+import struct
+import sys
+import termios
+
+from dlog import Elf
+
+SHT_SYMTAB = 2
+STT_OBJECT = 1
+WATCH_MAX = 8           # keep in step with bldc.c
+PWM_FREQ = 20000
+
+TYPES = {"u8": (1, "<B"), "s8": (1, "<b"), "u16": (2, "<H"), "s16": (2, "<h"),
+         "u32": (4, "<I"), "s32": (4, "<i"), "f32": (4, "<f")}
+SPEC = re.compile(r"^(\w+)(?:\[(\d+)\]|\+(\w+))?(?::(\w+))?$")
+
+
+def symbols(data):
+    """Data objects in the symbol table: name -> (address, size)."""
+    shoff, = struct.unpack_from("<I", data, 0x20)
+    shentsize, shnum = struct.unpack_from("<HH", data, 0x2E)
+    headers = [struct.unpack_from("<10I", data, shoff + n * shentsize) for n in range(shnum)]
+    syms = {}
+    for h in headers:
+        if h[1] != SHT_SYMTAB:
+            continue
+        strtab = headers[h[6]]
+        strings = data[strtab[4]:strtab[4] + strtab[5]]
+        for off in range(h[4], h[4] + h[5], h[9]):
+            name, value, size, info, _, _ = struct.unpack_from("<IIIBBH", data, off)
+            if info & 0xF == STT_OBJECT and size:
+                end = strings.index(b"\0", name)
+                syms[strings[name:end].decode()] = (value, size)
+    return syms
+
+
+def resolve(spec, syms):
+    """(label, address, size, struct format) of a variable spec."""
+    m = SPEC.match(spec)
+    if not m:
+        raise ValueError("bad variable %s" % spec)
+    name, index, offset, type_ = m.groups()
+    if name not in syms:
+        raise ValueError("no variable %s in the ELF file" % name)
+    addr, sym_size = syms[name]
+    if type_:
+        if type_ not in TYPES:
+            raise ValueError("unknown type %s" % type_)
+        size, fmt = TYPES[type_]
+    elif index is None and offset is None and sym_size in (1, 2, 4):
+        size, fmt = sym_size, {1: "<B", 2: "<H", 4: "<I"}[sym_size]
+    else:
+        raise ValueError("%s needs a :type" % spec)
+    if index is not None:
+        addr += int(index) * size
+    elif offset is not None:
+        addr += int(offset, 0)
+    if addr % size:
+        raise ValueError("%s is not aligned" % spec)
+    return spec, addr, size, fmt
+
+
+def open_port(port):
+    fd = os.open(port, os.O_RDWR | os.O_NOCTTY)
+    if os.isatty(fd):
+        attr = termios.tcgetattr(fd)
+        attr[0] = attr[1] = attr[3] = 0                 # raw
+        attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+        attr[4] = attr[5] = termios.B115200
+        termios.tcsetattr(fd, termios.TCSANOW, attr)
+    return os.fdopen(fd, "r+b", buffering=0)
+
+
+def frames(port, variables):
+    """Yield (time us, values) for each "W" line from the target."""
+    buf = b""
+    while True:
+        buf += port.read(256)
+        *lines, buf = buf.split(b"\n")
+        for line in lines:
+            words = line.split()
+            if len(words) != len(variables) + 2 or words[0] != b"W":
+                continue
+            try:
+                raw = [int(w, 16) for w in words[1:]]
+            except ValueError:
+                continue
+            values = [struct.unpack(fmt, struct.pack(fmt.upper().replace("F", "I"), r))[0]
+                      for (_, _, _, fmt), r in zip(variables, raw[1:])]
+            yield raw[0], values
+
+
+def plot(source, variables, points):
+    import matplotlib.pyplot as plt
+    from matplotlib.animation import FuncAnimation
+    fig, ax = plt.subplots()
+    lines = [ax.plot([], [], label=v[0])[0] for v in variables]
+    ax.legend(loc="upper left")
+    times, data = [], [[] for _ in variables]
+
+    def update(_):
+        for _ in range(20):
+            t, values = next(source)
+            times.append(t / 1e6)
+            for d, v in zip(data, values):
+                d.append(v)
+        del times[:-points]
+        for line, d in zip(lines, data):
+            del d[:-points]
+            line.set_data(times, d)
+        ax.relim()
+        ax.autoscale_view()
+        return lines
+
+    anim = FuncAnimation(fig, update, interval=50, cache_frame_data=False)
+    plt.show()
+    return anim
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf", help="ELF file of the running build")
+    parser.add_argument("port", nargs="?", help="serial port of the UI")
+    parser.add_argument("var", nargs="*", help="variables to watch")
+    parser.add_argument("--div", type=int, default=PWM_FREQ // 100,
+                        help="sample every DIV pwm periods (default 200 = 100Hz)")
+    parser.add_argument("--plot", action="store_true", help="plot instead of printing CSV")
+    parser.add_argument("--points", type=int, default=1000, help="points on the plot")
+    parser.add_argument("--list", action="store_true", help="list the variables in the ELF file")
+    args = parser.parse_args()
+
+    with open(args.elf, "rb") as f:
+        data = f.read()
+    Elf(data)                                           # checks the file type
+    syms = symbols(data)
+    if args.list:
+        for name, (addr, size) in sorted(syms.items(), key=lambda s: s[1]):
+            print("%08x %5u %s" % (addr, size, name))
+        return
+    if not args.port or not args.var:
+        parser.error("need a port and at least one variable")
+    if len(args.var) > WATCH_MAX:
+        parser.error("at most %d variables" % WATCH_MAX)
+    try:
+        variables = [resolve(v, syms) for v in args.var]
+    except ValueError as e:
+        parser.error(str(e))
+
+    port = open_port(args.port)
+    port.write(("W\n%d %s\n" % (args.div, " ".join(
+        "%x:%d" % (addr, size) for _, addr, size, _ in variables))).encode())
+    try:
+        if args.plot:
+            plot(frames(port, variables), variables, args.points)
+        else:
+            print(",".join(["time_us"] + [v[0] for v in variables]))
+            for t, values in frames(port, variables):
+                print(",".join([str(t)] + [str(v) for v in values]), flush=True)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        port.write(b"W\n0\n")                           # stop sampling
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,349 @@
+#!/usr/bin/env python3
+"""Worst case stack depth and execution time of the bldc ISR call trees.
+
+Combines the call graph and per function stack use that gcc writes with
+-fcallgraph-info=su with instruction counts from an objdump disassembly.
+Each function's cycle bound is the sum of the Cortex-M0+ cycle costs of
+all of its instructions, which covers every path through loop free code.
+Loops must be given an allowance in the bounds file, otherwise the
+function is reported as unbounded. Functions outside bldc.o (SDK, libgcc)
+take their cost and stack from the bounds file, and so do the targets of
+calls through function pointers, which gcc shows as __indirect_call.
+
+Functions that never run in the same call of an ISR, such as the current
+loop of each cur_update mode or the steps of the function loop, are listed
+in the bounds file as alternatives. Where one function calls several of a
+set, only the costliest of them counts towards its bound, all its call
+sites included. Everything else is summed as before.
+
+The bounds file also lists the ISR roots with their NVIC priority and
+cycle budget. A root's response time adds one run of every higher
+priority ISR, and the interrupt stack adds the deepest tree at each
+priority level plus an exception frame per level. A root that runs more
+than once per budget, each run on a path of its own, is charged the
+exception entry and its shared code again for every extra run.
+
+Normally run by tools/isr_report.sh. Exits 1 if a budget or the stack
+size is exceeded or a bound is missing.
+"""
+import argparse
+import json
+import re
+import sys
+
+EXCEPTION_FRAME = 32        # bytes stacked on exception entry
+EXCEPTION_CYCLES = 15 + 13  # M0+ entry and exit with zero wait state memory
+CONDS = ("eq", "ne", "cs", "hs", "cc", "lo", "mi", "pl", "vs", "vc",
+         "hi", "ls", "ge", "lt", "gt", "le", "al")
+
+
+class Function:
+    def __init__(self, name):
+        self.name = name
+        self.stack = None          # bytes, None if not known
+        self.stack_dynamic = False
+        self.calls = []            # one entry per call site
+        self.cycles = None         # own cycles, None if not known
+        self.loops = 0             # backward branches
+        self.external = False
+
+
+def local(title):
+    """Call graph titles of static function clones carry a "file:" prefix."""
+    return title.rsplit(":", 1)[-1]
+
+
+def parse_ci(path, funcs):
+    node = re.compile(r'node: \{ title: "([^"]+)" label: "([^"]*)"(.*)\}')
+    edge = re.compile(r'edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"')
+    with open(path) as f:
+        for line in f:
+            m = node.match(line.strip())
+            if m:
+                fn = funcs.setdefault(local(m.group(1)), Function(local(m.group(1))))
+                fn.external = "ellipse" in m.group(3)
+                s = re.search(r"\\n(\d+) bytes \((static|dynamic[^)]*)\)", m.group(2))
+                if s:
+                    fn.stack = int(s.group(1))
+                    fn.stack_dynamic = s.group(2) == "dynamic"
+                continue
+            m = edge.match(line.strip())
+            if m:
+                src, dst = local(m.group(1)), local(m.group(2))
+                funcs.setdefault(src, Function(src)).calls.append(dst)
+                funcs.setdefault(dst, Function(dst))
+
+
+def reg_count(ops):
+    regs = re.search(r"\{([^}]*)\}", ops)
+    if not regs:
+        return 1
+    n = 0
+    for r in regs.group(1).split(","):
+        r = r.strip()
+        if "-" in r:
+            a, b = r.split("-")
+            n += int(b.strip()[1:]) - int(a.strip()[1:]) + 1
+        elif r:
+            n += 1
+    return n
+
+
+def thumb_cycles(mnemonic, ops):
+    """Cortex-M0+ cycles, taken branches assumed, single cycle multiplier."""
+    mn = mnemonic.split(".")[0]
+    if mn == "bl":
+        return 3
+    if mn in ("bx", "blx"):
+        return 2
+    if mn == "b" or (mn.startswith("b") and mn[1:] in CONDS):
+        return 2
+    if mn in ("push", "stm", "stmia", "ldm", "ldmia"):
+        return 1 + reg_count(ops)
+    if mn == "pop":
+        return 1 + reg_count(ops) + (2 if "pc" in ops else 0)
+    if mn.startswith("ldr") or mn.startswith("str"):
+        return 2
+    if mn in ("dmb", "dsb", "isb"):
+        return 3
+    return 1
+
+
+def branch_kind(mnemonic, ops):
+    """None, "cond", "jump" (unconditional) or "return"."""
+    mn = mnemonic.split(".")[0]
+    if mn in ("ret", "retq") or (mn == "bx" and "lr" in ops) or (mn == "pop" and "pc" in ops):
+        return "return"
+    if mn in ("b", "jmp"):
+        return "jump"
+    if (mn.startswith("b") and mn[1:] in CONDS) or (mn.startswith("j") and mn != "jmp"):
+        return "cond"
+    return None
+
+
+def count_loops(name, insns):
+    """Back edges in the control flow graph of one function."""
+    index = {addr: i for i, (addr, _, _) in enumerate(insns)}
+    succ = []
+    for i, (addr, mn, ops) in enumerate(insns):
+        kind = branch_kind(mn, ops)
+        nxt = [i + 1] if i + 1 < len(insns) and kind not in ("jump", "return") else []
+        if kind in ("jump", "cond"):
+            t = re.match(r"([0-9a-f]+)\s+<([^+>]+)", ops)
+            if t and t.group(2) == name and int(t.group(1), 16) in index:
+                nxt.append(index[int(t.group(1), 16)])
+        succ.append(nxt)
+    loops, state, stack = 0, [0] * len(insns), [(0, 0)] if insns else []
+    while stack:                            # iterative depth first search
+        node, child = stack.pop()
+        if child == 0:
+            state[node] = 1                 # on the current path
+        if child < len(succ[node]):
+            stack.append((node, child + 1))
+            nxt = succ[node][child]
+            if state[nxt] == 1:
+                loops += 1
+            elif state[nxt] == 0:
+                stack.append((nxt, 0))
+        else:
+            state[node] = 2                 # finished
+    return loops
+
+
+def parse_dis(path, funcs, arch):
+    head = re.compile(r"^[0-9a-f]+ <([^>]+)>:$")
+    insn = re.compile(r"^\s*([0-9a-f]+):\s+(\S+)\s*(.*)$")
+    bodies = {}
+    fn = None
+    with open(path) as f:
+        for line in f:
+            line = line.rstrip()
+            m = head.match(line)
+            if m:
+                fn = bodies.setdefault(m.group(1), [])
+                continue
+            m = insn.match(line)
+            if m and fn is not None and "R_" not in m.group(2):
+                fn.append((int(m.group(1), 16), m.group(2), m.group(3)))
+    for name, insns in bodies.items():
+        fn = funcs.setdefault(name, Function(name))
+        fn.cycles = sum(thumb_cycles(mn, ops) if arch == "thumb" else 1 for _, mn, ops in insns)
+        fn.loops = count_loops(name, insns)
+
+
+def parse_bounds(path):
+    isrs, loops, externs, targets, alts = [], {}, {}, {}, {}
+    with open(path) as f:
+        for line in f:
+            words = line.split("#")[0].split()
+            if not words:
+                continue
+            if words[0] == "isr":
+                isrs.append({"name": words[1], "priority": int(words[2], 0),
+                             "budget": None if words[3] == "-" else int(words[3]),
+                             "entry": int(words[4]) if len(words) > 4 else 0,
+                             "runs": 1, "shared": 0})
+            elif words[0] == "runs":
+                for isr in isrs:
+                    if isr["name"] == words[1]:
+                        isr.update(runs=int(words[2]), shared=int(words[3]))
+            elif words[0] == "loop":
+                loops[words[1]] = int(words[2])
+            elif words[0] == "extern":
+                externs[words[1]] = (int(words[2]), int(words[3]))
+            elif words[0] == "stack":
+                externs["@stack_size"] = (int(words[1]), 0)
+            elif words[0] == "thread_extern_stack":
+                externs["@thread_extern"] = (0, int(words[1]))
+            elif words[0] == "calls":
+                targets.setdefault(words[1], []).extend(words[2:])
+            elif words[0] == "alt":
+                for name in words[1:]:
+                    alts[name] = words[1]       # the set is known by its first member
+    return isrs, loops, externs, targets, alts
+
+
+class Analysis:
+    def __init__(self, funcs, loops, externs, alts=None, cycles=True):
+        self.funcs, self.loops, self.externs = funcs, loops, externs
+        self.alts = alts or {}
+        self.cycles = cycles       # False: only the stack matters
+        self.problems = []
+        self.memo = {}
+
+    def own(self, name):
+        """Own cycles and stack of one function, noting what is missing."""
+        fn = self.funcs.get(name)
+        base = name.split(".")[0]
+        if name in self.externs or base in self.externs:
+            return self.externs.get(name, self.externs.get(base))
+        if fn is None or fn.cycles is None:
+            if not self.cycles and "@thread_extern" in self.externs:
+                return self.externs["@thread_extern"]
+            self.problems.append("no %s for external function %s"
+                                 % ("cost" if self.cycles else "stack", name))
+            return 0, 0
+        cycles = fn.cycles
+        if fn.loops:
+            allowance = self.loops.get(name, self.loops.get(base))
+            if allowance is None and self.cycles:
+                self.problems.append("%s has %d loop(s) with no bound" % (name, fn.loops))
+            elif allowance is not None:
+                cycles += allowance * fn.loops
+        if fn.stack is None or fn.stack_dynamic:
+            self.problems.append("%s has no static stack bound" % name)
+        return cycles, fn.stack or 0
+
+    def tree(self, name, path=()):
+        """Worst case cycles and stack of a call tree, and its outline."""
+        if name in path:
+            self.problems.append("recursion through %s" % name)
+            return 0, 0, []
+        if name in self.memo:
+            return self.memo[name]
+        cycles, stack = self.own(name)
+        deepest = 0
+        outline = []
+        alt = {}                   # costliest member of each set of alternatives called
+        fn = self.funcs.get(name)
+        for callee in sorted(set(fn.calls)) if fn else []:
+            c, s, sub = self.tree(callee, path + (name,))
+            sites = fn.calls.count(callee)
+            group = self.alts.get(callee.split(".")[0])
+            if group:
+                alt[group] = max(alt.get(group, 0), c * sites)
+            else:
+                cycles += c * sites
+            deepest = max(deepest, s)
+            outline.append((callee, sites, c, s, sub, bool(group)))
+        cycles += sum(alt.values())
+        result = (cycles, stack + deepest, outline)
+        self.memo[name] = result
+        return result
+
+
+def print_outline(outline, depth=1):
+    for callee, sites, c, s, sub, alt in outline:
+        print("%s%-*s x%-2d %6d cyc %5d B%s" % ("  " * depth, 30 - 2 * depth, callee, sites, c, s,
+                                               "  alt" if alt else ""))
+        print_outline(sub, depth + 1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--ci", required=True, help="gcc -fcallgraph-info=su output")
+    parser.add_argument("--dis", required=True, help="objdump -d output")
+    parser.add_argument("--bounds", required=True, help="ISR roots, loop and external bounds")
+    parser.add_argument("--arch", default="thumb", choices=("thumb", "generic"),
+                        help="generic counts one cycle per instruction")
+    parser.add_argument("--main", default="main", help="thread root for the base stack")
+    parser.add_argument("--json", help="also write the report as JSON")
+    parser.add_argument("--tree", action="store_true", help="print each call tree")
+    args = parser.parse_args()
+
+    funcs = {}
+    parse_ci(args.ci, funcs)
+    parse_dis(args.dis, funcs, args.arch)
+    isrs, loops, externs, targets, alts = parse_bounds(args.bounds)
+    for name, callees in targets.items():  # each indirect call may reach any of them
+        fn = funcs.get(name)
+        if fn and "__indirect_call" in fn.calls:
+            fn.calls = [c for c in fn.calls if c != "__indirect_call"] + callees
+    stack_size = externs.pop("@stack_size", (2048, 0))[0]
+    thread_extern = externs.pop("@thread_extern", None)
+    a = Analysis(funcs, loops, externs, alts)
+
+    report = {"isrs": [], "violations": []}
+    for isr in isrs:
+        cycles, stack, outline = a.tree(isr["name"])
+        again = (isr["runs"] - 1) * (isr["entry"] + EXCEPTION_CYCLES + isr["shared"])
+        isr.update(cycles=cycles + isr["entry"] + EXCEPTION_CYCLES + again,
+                   stack=stack + EXCEPTION_FRAME, outline=outline)
+    for isr in isrs:
+        higher = [o for o in isrs if o["priority"] < isr["priority"]]
+        isr["response"] = isr["cycles"] + sum(o["cycles"] for o in higher)
+        isr["ok"] = isr["budget"] is None or isr["response"] <= isr["budget"]
+        if not isr["ok"]:
+            report["violations"].append("%s: %d cycles over a budget of %d"
+                                        % (isr["name"], isr["response"], isr["budget"]))
+
+    levels = {}
+    for isr in isrs:
+        levels[isr["priority"]] = max(levels.get(isr["priority"], 0), isr["stack"])
+    m = Analysis(funcs, loops, dict(externs, **({"@thread_extern": thread_extern}
+                                                if thread_extern else {})), alts, cycles=False)
+    main_stack = m.tree(args.main)[1] if args.main in funcs else 0
+    a.problems += m.problems
+    total_stack = main_stack + sum(levels.values())
+    if total_stack > stack_size:
+        report["violations"].append("stack: %d bytes over %d" % (total_stack, stack_size))
+
+    print("%-16s %6s %8s %8s %8s %8s  %s" % ("isr", "prio", "stack B", "cycles", "response",
+                                           "budget", "status"))
+    for isr in isrs:
+        print("%-16s %6s %8d %8d %8d %8s  %s" % (
+            isr["name"], "0x%02x" % isr["priority"], isr["stack"], isr["cycles"],
+            isr["response"], isr["budget"] if isr["budget"] is not None else "-",
+            "ok" if isr["ok"] else "OVER BUDGET"))
+        if args.tree:
+            print_outline(isr["outline"])
+        report["isrs"].append({k: isr[k] for k in ("name", "priority", "stack", "cycles",
+                                                   "response", "budget", "ok")})
+    print("%-16s %d B (%s %d B + one frame per priority level) of %d B" % (
+        "worst stack", total_stack, args.main, main_stack, stack_size))
+
+    problems = sorted(set(a.problems))
+    for p in problems:
+        print("warning: " + p)
+    for v in report["violations"]:
+        print("VIOLATION: " + v)
+    report.update(stack=total_stack, main_stack=main_stack, stack_size=stack_size,
+                  warnings=problems)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(report, f, indent=2)
+    return 1 if report["violations"] or problems else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())